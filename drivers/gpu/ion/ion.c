@@ -18,6 +18,8 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
+#include <linux/hash.h>
+#include <linux/idr.h>
 #include <linux/ion.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
@@ -25,6 +27,7 @@
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
@@ -38,15 +41,23 @@
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
  * @buffers:	an rb tree of all the existing buffers
- * @lock:		lock protecting the buffers & heaps trees
+ * @buffer_lock:	lock protecting the tree of buffers
+ * @heap_lock:		lock protecting the tree of heaps, held for reading
+ *			while allocating
  * @heaps:		list of all the heaps in the system
+ * @client_lock:	lock protecting the trees of clients
  * @user_clients:	list of all the clients created from userspace
+ *
+ * None of these locks is held while a heap allocates or frees memory,
+ * each heap protects its own state.
  */
 struct ion_device {
 	struct miscdevice dev;
 	struct rb_root buffers;
-	struct mutex lock;
+	struct mutex buffer_lock;
+	struct rw_semaphore heap_lock;
 	struct rb_root heaps;
+	struct rw_semaphore client_lock;
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
 			      unsigned long arg);
 	struct rb_root user_clients;
@@ -59,21 +70,31 @@ struct ion_device {
  * @ref:		for reference counting the client
  * @node:		node in the tree of all clients
  * @dev:		backpointer to ion device
- * @handles:		an rb tree of all the handles in this client
- * @lock:		lock protecting the tree of handles
+ * @idr:		handles of this client by id, the ids are the opaque
+ *			handles userspace sees
+ * @handle_hash:	handles of this client hashed by buffer
+ * @handle_ptrs:	handles of this client hashed by their own address, to
+ *			check handles passed in by kernel users
+ * @lock:		lock protecting the handle tables
  * @heap_mask:		mask of all supported heaps
  * @name:		used for debugging
  * @task:		used for debugging
  *
  * A client represents a list of buffers this client may access.
- * The mutex stored here is used to protect both handles tree
+ * The mutex stored here is used to protect both handle tables
  * as well as the handles themselves, and should be held while modifying either.
+ * Handle references are only dropped with it held, so a handle found in
+ * the tables always has a reference left.
  */
+#define ION_HANDLE_HASH_BITS	7
+
 struct ion_client {
 	struct kref ref;
 	struct rb_node node;
 	struct ion_device *dev;
-	struct rb_root handles;
+	struct idr idr;
+	struct hlist_head handle_hash[1 << ION_HANDLE_HASH_BITS];
+	struct hlist_head handle_ptrs[1 << ION_HANDLE_HASH_BITS];
 	struct mutex lock;
 	unsigned int heap_mask;
 	const char *name;
@@ -87,7 +108,9 @@ struct ion_client {
  * @ref:		reference count
  * @client:		back pointer to the client the buffer resides in
  * @buffer:		pointer to the buffer
- * @node:		node in the client's handle rbtree
+ * @node:		node in the client's handle hash
+ * @ptr_node:		node in the client's handle address hash
+ * @id:			id in the client's idr, 0 until the handle is added
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @dmap_cnt:		count of times this client has mapped for dma
  * @usermap_cnt:	count of times this client has mapped for userspace
@@ -99,13 +122,15 @@ struct ion_handle {
 	struct kref ref;
 	struct ion_client *client;
 	struct ion_buffer *buffer;
-	struct rb_node node;
+	struct hlist_node node;
+	struct hlist_node ptr_node;
+	int id;
 	unsigned int kmap_cnt;
 	unsigned int dmap_cnt;
 	unsigned int usermap_cnt;
 };
 
-/* this function should only be called while dev->lock is held */
+/* this function should only be called while dev->buffer_lock is held */
 static void ion_buffer_add(struct ion_device *dev,
 			   struct ion_buffer *buffer)
 {
@@ -131,7 +156,7 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
-/* this function should only be called while dev->lock is held */
+/* this function should only be called while dev->heap_lock is held */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
 				     unsigned long len,
@@ -149,6 +174,10 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	kref_init(&buffer->ref);
 
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	/* memory may be waiting on the free list, get it back and retry */
+	if (ret && (heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+	    ion_heap_freelist_drain(heap, 0))
+		ret = heap->ops->allocate(heap, buffer, len, align, flags);
 	if (ret) {
 		kfree(buffer);
 		return ERR_PTR(ret);
@@ -156,22 +185,37 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->dev = dev;
 	buffer->size = len;
 	mutex_init(&buffer->lock);
+	mutex_lock(&dev->buffer_lock);
 	ion_buffer_add(dev, buffer);
+	mutex_unlock(&dev->buffer_lock);
 	return buffer;
 }
 
-static void ion_buffer_destroy(struct kref *kref)
+void ion_buffer_destroy(struct ion_buffer *buffer)
 {
-	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
 
+	/* the pages must not go back with a kernel alias still on them */
+	if (WARN_ON(buffer->kmap_cnt > 0) || buffer->vaddr)
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
 	buffer->heap->ops->free(buffer);
-	mutex_lock(&dev->lock);
+	mutex_lock(&dev->buffer_lock);
 	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->lock);
+	mutex_unlock(&dev->buffer_lock);
 	kfree(buffer);
 }
 
+static void _ion_buffer_destroy(struct kref *kref)
+{
+	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_heap *heap = buffer->heap;
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_destroy(buffer);
+}
+
 static void ion_buffer_get(struct ion_buffer *buffer)
 {
 	kref_get(&buffer->ref);
@@ -179,7 +223,7 @@ static void ion_buffer_get(struct ion_buffer *buffer)
 
 static int ion_buffer_put(struct ion_buffer *buffer)
 {
-	return kref_put(&buffer->ref, ion_buffer_destroy);
+	return kref_put(&buffer->ref, _ion_buffer_destroy);
 }
 
 static struct ion_handle *ion_handle_create(struct ion_client *client,
@@ -191,7 +235,6 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 	if (!handle)
 		return ERR_PTR(-ENOMEM);
 	kref_init(&handle->ref);
-	rb_init_node(&handle->node);
 	handle->client = client;
 	ion_buffer_get(buffer);
 	handle->buffer = buffer;
@@ -199,17 +242,29 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 	return handle;
 }
 
+/* this function should only be called while client->lock is held */
 static void ion_handle_destroy(struct kref *kref)
 {
 	struct ion_handle *handle = container_of(kref, struct ion_handle, ref);
-	/* XXX Can a handle be destroyed while it's map count is non-zero?:
-	   if (handle->map_cnt) unmap
-	 */
+	struct ion_buffer *buffer = handle->buffer;
+
+	/* a handle freed while still mapped gives up its kernel mapping */
+	mutex_lock(&buffer->lock);
+	if (handle->kmap_cnt) {
+		handle->kmap_cnt = 0;
+		if (!--buffer->kmap_cnt) {
+			buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+			buffer->vaddr = NULL;
+		}
+	}
+	mutex_unlock(&buffer->lock);
+
+	if (handle->id) {
+		idr_remove(&handle->client->idr, handle->id);
+		hlist_del(&handle->node);
+		hlist_del(&handle->ptr_node);
+	}
 	ion_buffer_put(handle->buffer);
-	mutex_lock(&handle->client->lock);
-	if (!RB_EMPTY_NODE(&handle->node))
-		rb_erase(&handle->node, &handle->client->handles);
-	mutex_unlock(&handle->client->lock);
 	kfree(handle);
 }
 
@@ -225,60 +280,96 @@ static void ion_handle_get(struct ion_handle *handle)
 
 static int ion_handle_put(struct ion_handle *handle)
 {
-	return kref_put(&handle->ref, ion_handle_destroy);
+	struct ion_client *client = handle->client;
+	int ret;
+
+	mutex_lock(&client->lock);
+	ret = kref_put(&handle->ref, ion_handle_destroy);
+	mutex_unlock(&client->lock);
+	return ret;
+}
+
+static struct hlist_head *ion_handle_hash(struct ion_client *client,
+					  struct ion_buffer *buffer)
+{
+	return &client->handle_hash[hash_ptr(buffer, ION_HANDLE_HASH_BITS)];
 }
 
+/* this function should only be called while client->lock is held */
 static struct ion_handle *ion_handle_lookup(struct ion_client *client,
 					    struct ion_buffer *buffer)
 {
-	struct rb_node *n;
+	struct ion_handle *handle;
+	struct hlist_node *pos;
 
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
+	hlist_for_each_entry(handle, pos, ion_handle_hash(client, buffer), node)
 		if (handle->buffer == buffer)
 			return handle;
-	}
 	return NULL;
 }
 
+/* this function should only be called while client->lock is held */
+static struct ion_handle *ion_handle_lookup_id(struct ion_client *client,
+					       int id)
+{
+	return id > 0 ? idr_find(&client->idr, id) : NULL;
+}
+
+static struct hlist_head *ion_handle_ptr_hash(struct ion_client *client,
+					      struct ion_handle *handle)
+{
+	return &client->handle_ptrs[hash_ptr(handle, ION_HANDLE_HASH_BITS)];
+}
+
+/*
+ * Kernel users pass handles by pointer, which may be stale, so compare
+ * it against the client's handles without dereferencing it.
+ *
+ * this function should only be called while client->lock is held
+ */
 static bool ion_handle_validate(struct ion_client *client, struct ion_handle *handle)
 {
-	struct rb_node *n = client->handles.rb_node;
+	struct ion_handle *h;
+	struct hlist_node *pos;
 
-	while (n) {
-		struct ion_handle *handle_node = rb_entry(n, struct ion_handle,
-							  node);
-		if (handle < handle_node)
-			n = n->rb_left;
-		else if (handle > handle_node)
-			n = n->rb_right;
-		else
+	hlist_for_each_entry(h, pos, ion_handle_ptr_hash(client, handle),
+			     ptr_node)
+		if (h == handle)
 			return true;
-	}
 	return false;
 }
 
-static void ion_handle_add(struct ion_client *client, struct ion_handle *handle)
+/* this function should only be called while client->lock is held */
+static int ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 {
-	struct rb_node **p = &client->handles.rb_node;
-	struct rb_node *parent = NULL;
-	struct ion_handle *entry;
-
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct ion_handle, node);
+	int id, ret;
+
+	do {
+		if (!idr_pre_get(&client->idr, GFP_KERNEL))
+			return -ENOMEM;
+		ret = idr_get_new_above(&client->idr, handle, 1, &id);
+	} while (ret == -EAGAIN);
+	if (ret)
+		return ret;
+
+	handle->id = id;
+	hlist_add_head(&handle->node, ion_handle_hash(client, handle->buffer));
+	hlist_add_head(&handle->ptr_node, ion_handle_ptr_hash(client, handle));
+	return 0;
+}
 
-		if (handle < entry)
-			p = &(*p)->rb_left;
-		else if (handle > entry)
-			p = &(*p)->rb_right;
-		else
-			WARN(1, "%s: buffer already found.", __func__);
-	}
+/*
+ * Userspace refers to handles by their id in the client's idr, passed in
+ * the struct ion_handle * fields of the ioctl arguments.
+ */
+static struct ion_handle *ion_handle_to_user(struct ion_handle *handle)
+{
+	return (struct ion_handle *)(unsigned long)handle->id;
+}
 
-	rb_link_node(&handle->node, parent, p);
-	rb_insert_color(&handle->node, &client->handles);
+static int ion_user_to_id(struct ion_handle *user_handle)
+{
+	return (int)(unsigned long)user_handle;
 }
 
 struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
@@ -288,6 +379,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	struct ion_handle *handle;
 	struct ion_device *dev = client->dev;
 	struct ion_buffer *buffer = NULL;
+	int ret;
 
 	/*
 	 * traverse the list of heaps available in this system in priority
@@ -295,7 +387,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	 * request of the caller allocate from it.  Repeat until allocate has
 	 * succeeded or all heaps have been tried
 	 */
-	mutex_lock(&dev->lock);
+	down_read(&dev->heap_lock);
 	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		/* if the client doesn't support this heap type */
@@ -308,30 +400,28 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 		if (!IS_ERR_OR_NULL(buffer))
 			break;
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->heap_lock);
 
 	if (IS_ERR_OR_NULL(buffer))
 		return ERR_PTR(PTR_ERR(buffer));
 
 	handle = ion_handle_create(client, buffer);
 
-	if (IS_ERR_OR_NULL(handle))
-		goto end;
-
 	/*
 	 * ion_buffer_create will create a buffer with a ref_cnt of 1,
 	 * and ion_handle_create will take a second reference, drop one here
 	 */
 	ion_buffer_put(buffer);
 
+	if (IS_ERR_OR_NULL(handle))
+		return handle;
+
 	mutex_lock(&client->lock);
-	ion_handle_add(client, handle);
+	ret = ion_handle_add(client, handle);
+	if (ret)
+		kref_put(&handle->ref, ion_handle_destroy);
 	mutex_unlock(&client->lock);
-	return handle;
-
-end:
-	ion_buffer_put(buffer);
-	return handle;
+	return ret ? ERR_PTR(ret) : handle;
 }
 
 void ion_free(struct ion_client *client, struct ion_handle *handle)
@@ -342,13 +432,12 @@ void ion_free(struct ion_client *client, struct ion_handle *handle)
 
 	mutex_lock(&client->lock);
 	valid_handle = ion_handle_validate(client, handle);
+	if (valid_handle)
+		kref_put(&handle->ref, ion_handle_destroy);
 	mutex_unlock(&client->lock);
 
-	if (!valid_handle) {
+	if (!valid_handle)
 		WARN("%s: invalid handle passed to free.\n", __func__);
-		return;
-	}
-	ion_handle_put(handle);
 }
 
 static void ion_client_get(struct ion_client *client);
@@ -436,7 +525,8 @@ void *ion_map_kernel(struct ion_client *client, struct ion_handle *handle)
 		vaddr = buffer->heap->ops->map_kernel(buffer->heap, buffer);
 		if (IS_ERR_OR_NULL(vaddr))
 			_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt);
-		buffer->vaddr = vaddr;
+		else
+			buffer->vaddr = vaddr;
 	} else {
 		vaddr = buffer->vaddr;
 	}
@@ -537,6 +627,7 @@ struct ion_handle *ion_import(struct ion_client *client,
 			      struct ion_buffer *buffer)
 {
 	struct ion_handle *handle = NULL;
+	int ret;
 
 	mutex_lock(&client->lock);
 	/* if a handle exists for this buffer just take a reference to it */
@@ -548,7 +639,11 @@ struct ion_handle *ion_import(struct ion_client *client,
 	handle = ion_handle_create(client, buffer);
 	if (IS_ERR_OR_NULL(handle))
 		goto end;
-	ion_handle_add(client, handle);
+	ret = ion_handle_add(client, handle);
+	if (ret) {
+		kref_put(&handle->ref, ion_handle_destroy);
+		handle = ERR_PTR(ret);
+	}
 end:
 	mutex_unlock(&client->lock);
 	return handle;
@@ -580,15 +675,13 @@ end:
 static int ion_debug_client_show(struct seq_file *s, void *unused)
 {
 	struct ion_client *client = s->private;
-	struct rb_node *n;
+	struct ion_handle *handle;
 	size_t sizes[ION_NUM_HEAPS] = {0};
 	const char *names[ION_NUM_HEAPS] = {0};
-	int i;
+	int i, id;
 
 	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
+	for (id = 0; (handle = idr_get_next(&client->idr, &id)); id++) {
 		enum ion_heap_type type = handle->buffer->heap->type;
 
 		if (!names[type])
@@ -622,15 +715,16 @@ static const struct file_operations debug_client_fops = {
 static struct ion_client *ion_client_lookup(struct ion_device *dev,
 					    struct task_struct *task)
 {
-	struct rb_node *n = dev->user_clients.rb_node;
+	struct rb_node *n;
 	struct ion_client *client;
 
-	mutex_lock(&dev->lock);
+	down_read(&dev->client_lock);
+	n = dev->user_clients.rb_node;
 	while (n) {
 		client = rb_entry(n, struct ion_client, node);
 		if (task == client->task) {
 			ion_client_get(client);
-			mutex_unlock(&dev->lock);
+			up_read(&dev->client_lock);
 			return client;
 		} else if (task < client->task) {
 			n = n->rb_left;
@@ -638,7 +732,7 @@ static struct ion_client *ion_client_lookup(struct ion_device *dev,
 			n = n->rb_right;
 		}
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->client_lock);
 	return NULL;
 }
 
@@ -684,7 +778,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 	}
 
 	client->dev = dev;
-	client->handles = RB_ROOT;
+	idr_init(&client->idr);
 	mutex_init(&client->lock);
 	client->name = name;
 	client->heap_mask = heap_mask;
@@ -692,7 +786,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 	client->pid = pid;
 	kref_init(&client->ref);
 
-	mutex_lock(&dev->lock);
+	down_write(&dev->client_lock);
 	if (task) {
 		p = &dev->user_clients.rb_node;
 		while (*p) {
@@ -725,7 +819,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 	client->debug_root = debugfs_create_file(debug_name, 0664,
 						 dev->debug_root, client,
 						 &debug_client_fops);
-	mutex_unlock(&dev->lock);
+	up_write(&dev->client_lock);
 
 	return client;
 }
@@ -734,15 +828,17 @@ static void _ion_client_destroy(struct kref *kref)
 {
 	struct ion_client *client = container_of(kref, struct ion_client, ref);
 	struct ion_device *dev = client->dev;
-	struct rb_node *n;
+	struct ion_handle *handle;
+	int id = 0;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
-	while ((n = rb_first(&client->handles))) {
-		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
+	mutex_lock(&client->lock);
+	while ((handle = idr_get_next(&client->idr, &id)))
 		ion_handle_destroy(&handle->ref);
-	}
-	mutex_lock(&dev->lock);
+	mutex_unlock(&client->lock);
+	idr_destroy(&client->idr);
+
+	down_write(&dev->client_lock);
 	if (client->task) {
 		rb_erase(&client->node, &dev->user_clients);
 		put_task_struct(client->task);
@@ -750,7 +846,7 @@ static void _ion_client_destroy(struct kref *kref)
 		rb_erase(&client->node, &dev->kernel_clients);
 	}
 	debugfs_remove_recursive(client->debug_root);
-	mutex_unlock(&dev->lock);
+	up_write(&dev->client_lock);
 
 	kfree(client);
 }
@@ -943,45 +1039,56 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	{
 		struct ion_allocation_data data;
 
+		struct ion_handle *handle;
+
 		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
 			return -EFAULT;
-		data.handle = ion_alloc(client, data.len, data.align,
-					     data.flags);
-		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
+		handle = ion_alloc(client, data.len, data.align, data.flags);
+		if (IS_ERR_OR_NULL(handle))
+			return handle ? PTR_ERR(handle) : -ENOMEM;
+		data.handle = ion_handle_to_user(handle);
+		if (copy_to_user((void __user *)arg, &data, sizeof(data))) {
+			ion_free(client, handle);
 			return -EFAULT;
+		}
 		break;
 	}
 	case ION_IOC_FREE:
 	{
 		struct ion_handle_data data;
-		bool valid;
+		struct ion_handle *handle;
 
 		if (copy_from_user(&data, (void __user *)arg,
 				   sizeof(struct ion_handle_data)))
 			return -EFAULT;
 		mutex_lock(&client->lock);
-		valid = ion_handle_validate(client, data.handle);
+		handle = ion_handle_lookup_id(client,
+					      ion_user_to_id(data.handle));
+		if (handle)
+			kref_put(&handle->ref, ion_handle_destroy);
 		mutex_unlock(&client->lock);
-		if (!valid)
+		if (!handle)
 			return -EINVAL;
-		ion_free(client, data.handle);
 		break;
 	}
 	case ION_IOC_MAP:
 	case ION_IOC_SHARE:
 	{
 		struct ion_fd_data data;
+		struct ion_handle *handle;
 
 		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
 			return -EFAULT;
 		mutex_lock(&client->lock);
-		if (!ion_handle_validate(client, data.handle)) {
+		handle = ion_handle_lookup_id(client,
+					      ion_user_to_id(data.handle));
+		if (!handle) {
 			pr_err("%s: invalid handle passed to share ioctl.\n",
 			       __func__);
 			mutex_unlock(&client->lock);
 			return -EINVAL;
 		}
-		data.fd = ion_ioctl_share(filp, client, data.handle);
+		data.fd = ion_ioctl_share(filp, client, handle);
 		mutex_unlock(&client->lock);
 		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
 			return -EFAULT;
@@ -990,13 +1097,17 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case ION_IOC_IMPORT:
 	{
 		struct ion_fd_data data;
+		struct ion_handle *handle;
+
 		if (copy_from_user(&data, (void __user *)arg,
 				   sizeof(struct ion_fd_data)))
 			return -EFAULT;
 
-		data.handle = ion_import_fd(client, data.fd);
-		if (IS_ERR(data.handle))
+		handle = ion_import_fd(client, data.fd);
+		if (IS_ERR_OR_NULL(handle))
 			data.handle = NULL;
+		else
+			data.handle = ion_handle_to_user(handle);
 		if (copy_to_user((void __user *)arg, &data,
 				 sizeof(struct ion_fd_data)))
 			return -EFAULT;
@@ -1055,13 +1166,11 @@ static size_t ion_debug_heap_total(struct ion_client *client,
 				   enum ion_heap_type type)
 {
 	size_t size = 0;
-	struct rb_node *n;
+	struct ion_handle *handle;
+	int id;
 
 	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n,
-						     struct ion_handle,
-						     node);
+	for (id = 0; (handle = idr_get_next(&client->idr, &id)); id++) {
 		if (handle->buffer->heap->type == type)
 			size += handle->buffer->size;
 	}
@@ -1076,6 +1185,7 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	struct rb_node *n;
 
 	seq_printf(s, "%16.s %16.s %16.s\n", "client", "pid", "size");
+	down_read(&dev->client_lock);
 	for (n = rb_first(&dev->user_clients); n; n = rb_next(n)) {
 		struct ion_client *client = rb_entry(n, struct ion_client,
 						     node);
@@ -1098,6 +1208,7 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+	up_read(&dev->client_lock);
 	return 0;
 }
 
@@ -1120,7 +1231,13 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	struct ion_heap *entry;
 
 	heap->dev = dev;
-	mutex_lock(&dev->lock);
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE &&
+	    ion_heap_init_deferred_free(heap)) {
+		pr_err("%s: can not start deferred free for heap %s, freeing "
+		       "synchronously\n", __func__, heap->name);
+		heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+	}
+	down_write(&dev->heap_lock);
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct ion_heap, node);
@@ -1141,7 +1258,7 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
 			    &debug_heap_fops);
 end:
-	mutex_unlock(&dev->lock);
+	up_write(&dev->heap_lock);
 }
 
 struct ion_device *ion_device_create(long (*custom_ioctl)
@@ -1172,7 +1289,9 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 
 	idev->custom_ioctl = custom_ioctl;
 	idev->buffers = RB_ROOT;
-	mutex_init(&idev->lock);
+	mutex_init(&idev->buffer_lock);
+	init_rwsem(&idev->heap_lock);
+	init_rwsem(&idev->client_lock);
 	idev->heaps = RB_ROOT;
 	idev->user_clients = RB_ROOT;
 	idev->kernel_clients = RB_ROOT;
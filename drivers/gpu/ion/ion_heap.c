@@ -15,9 +15,124 @@
  */
 
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
 #include "ion_priv.h"
 
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer)
+{
+	spin_lock(&heap->free_lock);
+	list_add_tail(&buffer->list, &heap->free_list);
+	heap->free_list_size += buffer->size;
+	spin_unlock(&heap->free_lock);
+	wake_up(&heap->waitqueue);
+}
+
+size_t ion_heap_freelist_size(struct ion_heap *heap)
+{
+	size_t size;
+
+	spin_lock(&heap->free_lock);
+	size = heap->free_list_size;
+	spin_unlock(&heap->free_lock);
+
+	return size;
+}
+
+/* this function should only be called while heap->free_lock is held */
+static struct ion_buffer *ion_heap_freelist_remove(struct ion_heap *heap)
+{
+	struct ion_buffer *buffer;
+
+	if (list_empty(&heap->free_list))
+		return NULL;
+	buffer = list_first_entry(&heap->free_list, struct ion_buffer, list);
+	list_del(&buffer->list);
+	heap->free_list_size -= buffer->size;
+	return buffer;
+}
+
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size)
+{
+	struct ion_buffer *buffer;
+	size_t total_drained = 0;
+
+	spin_lock(&heap->free_lock);
+	if (size == 0)
+		size = heap->free_list_size;
+	while (total_drained < size &&
+	       (buffer = ion_heap_freelist_remove(heap))) {
+		spin_unlock(&heap->free_lock);
+		total_drained += buffer->size;
+		ion_buffer_destroy(buffer);
+		spin_lock(&heap->free_lock);
+	}
+	spin_unlock(&heap->free_lock);
+
+	return total_drained;
+}
+
+static int ion_heap_deferred_free(void *data)
+{
+	struct ion_heap *heap = data;
+
+	set_freezable();
+	for (;;) {
+		struct ion_buffer *buffer;
+
+		wait_event_freezable(heap->waitqueue,
+				     ion_heap_freelist_size(heap) > 0 ||
+				     kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+
+		spin_lock(&heap->free_lock);
+		buffer = ion_heap_freelist_remove(heap);
+		spin_unlock(&heap->free_lock);
+		if (buffer)
+			ion_buffer_destroy(buffer);
+	}
+
+	return 0;
+}
+
+static int ion_heap_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct ion_heap *heap = container_of(shrinker, struct ion_heap,
+					     shrinker);
+
+	if (sc->nr_to_scan)
+		ion_heap_freelist_drain(heap, sc->nr_to_scan * PAGE_SIZE);
+
+	return ion_heap_freelist_size(heap) / PAGE_SIZE;
+}
+
+int ion_heap_init_deferred_free(struct ion_heap *heap)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	INIT_LIST_HEAD(&heap->free_list);
+	heap->free_list_size = 0;
+	spin_lock_init(&heap->free_lock);
+	init_waitqueue_head(&heap->waitqueue);
+	heap->task = kthread_run(ion_heap_deferred_free, heap,
+				 "ion_%s", heap->name);
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating thread for deferred free failed\n",
+		       __func__);
+		return PTR_ERR(heap->task);
+	}
+	sched_setscheduler(heap->task, SCHED_IDLE, &param);
+
+	heap->shrinker.shrink = ion_heap_shrink;
+	heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&heap->shrinker);
+	return 0;
+}
+
 struct ion_heap *ion_heap_create(struct ion_platform_heap *heap_data)
 {
 	struct ion_heap *heap = NULL;
@@ -55,6 +170,12 @@ void ion_heap_destroy(struct ion_heap *heap)
 	if (!heap)
 		return;
 
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE && heap->task) {
+		unregister_shrinker(&heap->shrinker);
+		kthread_stop(heap->task);
+		ion_heap_freelist_drain(heap, 0);
+	}
+
 	switch (heap->type) {
 	case ION_HEAP_TYPE_SYSTEM_CONTIG:
 		ion_system_contig_heap_destroy(heap);
@@ -0,0 +1,190 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * Pages are kept on the pool's lists through page->lru, which is free for
+ * as long as the pages belong to ion. Pages freed back to the pool are
+ * dirty: they still hold the previous owner's data and are zeroed by
+ * zero_work before they move to the clean list. An allocation that finds
+ * no clean page zeroes a dirty one itself, which still saves the trip
+ * through the page allocator.
+ */
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool clean)
+{
+	struct page *page;
+
+	if (clean) {
+		BUG_ON(!pool->clean_count);
+		page = list_first_entry(&pool->clean_items, struct page, lru);
+		pool->clean_count--;
+	} else {
+		BUG_ON(!pool->dirty_count);
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		pool->dirty_count--;
+	}
+	list_del(&page->lru);
+	return page;
+}
+
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	for (;;) {
+		mutex_lock(&pool->lock);
+		if (!pool->dirty_count) {
+			mutex_unlock(&pool->lock);
+			break;
+		}
+		page = ion_page_pool_remove(pool, false);
+		mutex_unlock(&pool->lock);
+
+		ion_page_pool_zero(pool, page);
+
+		mutex_lock(&pool->lock);
+		list_add(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+		mutex_unlock(&pool->lock);
+		cond_resched();
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+	bool dirty = false;
+
+	mutex_lock(&pool->lock);
+	if (pool->clean_count) {
+		page = ion_page_pool_remove(pool, true);
+	} else if (pool->dirty_count) {
+		page = ion_page_pool_remove(pool, false);
+		dirty = true;
+	}
+	mutex_unlock(&pool->lock);
+
+	if (!page)
+		return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+	if (dirty)
+		ion_page_pool_zero(pool, page);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	mutex_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	mutex_unlock(&pool->lock);
+	queue_work(system_unbound_wq, &pool->zero_work);
+}
+
+static int ion_page_pool_total(struct ion_page_pool *pool)
+{
+	return (pool->clean_count + pool->dirty_count) << pool->order;
+}
+
+/*
+ * Dirty pages go back to the system first, there is no point in zeroing
+ * memory the system wants back.
+ */
+static int ion_page_pool_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct ion_page_pool *pool = container_of(shrinker,
+						  struct ion_page_pool,
+						  shrinker);
+	int nr_freed = 0;
+	int total;
+
+	if (sc->nr_to_scan && !mutex_trylock(&pool->lock))
+		return -1;
+	if (!sc->nr_to_scan)
+		mutex_lock(&pool->lock);
+
+	while (nr_freed < sc->nr_to_scan) {
+		struct page *page;
+
+		if (pool->dirty_count)
+			page = ion_page_pool_remove(pool, false);
+		else if (pool->clean_count)
+			page = ion_page_pool_remove(pool, true);
+		else
+			break;
+		__free_pages(page, pool->order);
+		nr_freed += 1 << pool->order;
+	}
+	total = ion_page_pool_total(pool);
+	mutex_unlock(&pool->lock);
+
+	return total;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kzalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	mutex_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_work);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	pool->shrinker.shrink = ion_page_pool_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	struct page *page, *tmp;
+
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->zero_work);
+	list_for_each_entry_safe(page, tmp, &pool->clean_items, lru) {
+		list_del(&page->lru);
+		__free_pages(page, pool->order);
+	}
+	list_for_each_entry_safe(page, tmp, &pool->dirty_items, lru) {
+		list_del(&page->lru);
+		__free_pages(page, pool->order);
+	}
+	kfree(pool);
+}
@@ -18,9 +18,13 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/ion.h>
 
 struct ion_mapping;
@@ -41,6 +45,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
  * @node:		node in the ion_device buffers tree
+ * @list:		element in the heap's deferred free list
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
@@ -58,6 +63,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 struct ion_buffer {
 	struct kref ref;
 	struct rb_node node;
+	struct list_head list;
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
@@ -84,6 +90,9 @@ struct ion_buffer {
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
+ *
+ * allocate and free are called without any of the device's locks held and
+ * may run concurrently, heaps must protect their own state.
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -101,16 +110,28 @@ struct ion_heap_ops {
 			 struct vm_area_struct *vma);
 };
 
+/**
+ * heap flags - flags between the heaps and core ion code
+ */
+#define ION_HEAP_FLAG_DEFER_FREE (1 << 0)
+
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
  * @dev:		back pointer to the ion_device
  * @type:		type of heap
  * @ops:		ops struct as above
+ * @flags:		flags
  * @id:			id of heap, also indicates priority of this heap when
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @free_list:		buffers waiting to be freed, if the heap defers frees
+ * @free_list_size:	size of the buffers on the free list in bytes
+ * @free_lock:		protects the free list
+ * @waitqueue:		the deferred free thread waits here for buffers
+ * @task:		the deferred free thread
+ * @shrinker:		drains the free list under memory pressure
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -122,8 +143,15 @@ struct ion_heap {
 	struct ion_device *dev;
 	enum ion_heap_type type;
 	struct ion_heap_ops *ops;
+	unsigned long flags;
 	int id;
 	const char *name;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
 };
 
 /**
@@ -150,6 +178,32 @@ void ion_device_destroy(struct ion_device *dev);
  */
 void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 
+/**
+ * ion_buffer_destroy - free a buffer's memory and the buffer itself
+ * @buffer:		the buffer, its last reference must be gone
+ */
+void ion_buffer_destroy(struct ion_buffer *buffer);
+
+/**
+ * Deferred free: heaps that set ION_HEAP_FLAG_DEFER_FREE have their buffers
+ * put on a free list when the last reference goes away, instead of being
+ * freed in the releasing thread. The list is drained by a low priority
+ * thread, by the heap's shrinker, and by allocations that fail on the heap.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+
+/**
+ * ion_heap_freelist_drain - synchronously free buffers off the free list
+ * @heap:		the heap
+ * @size:		number of bytes to free, 0 to free everything
+ *
+ * Returns the number of bytes freed, which may be more than @size since
+ * only whole buffers are freed.
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 /**
  * functions for creating and destroying the built in ion heaps.
  * architectures can add their own custom architecture specific
@@ -181,4 +235,37 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean_count:	number of zeroed items in the pool
+ * @dirty_count:	number of items in the pool still waiting to be zeroed
+ * @clean_items:	list of zeroed items, ready to be handed out
+ * @dirty_items:	list of items freed back to the pool
+ * @lock:		lock protecting this struct and the item lists
+ * @gfp_mask:		gfp_mask to use when allocating from the page allocator
+ * @order:		order of the pages in the pool
+ * @zero_work:		zeroes dirty items in the background
+ * @shrinker:		gives the pool's pages back under memory pressure
+ *
+ * Allows you to keep a pool of pre-zeroed pages of one order around, to
+ * avoid the cost of going through the page allocator and zeroing on every
+ * allocation. Pages are returned to the system by the shrinker.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	struct mutex lock;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct work_struct zero_work;
+	struct shrinker shrinker;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+
 #endif /* _ION_PRIV_H */
@@ -15,11 +15,13 @@
 
 #include <linux/time.h>
 #include <linux/module.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
 #include <linux/platform_device.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/alarmtimer.h>
@@ -62,10 +64,23 @@ struct devalarm {
 		struct alarm alrm;
 	} u;
 	enum android_alarm_type type;
+	/* start of the alarm's window, in the alarm's own clock */
+	ktime_t soft;
 };
 
 static struct devalarm alarms[ANDROID_ALARM_TYPE_COUNT];
 
+/*
+ * Per type: alarms set, alarms that went off on their own timer, and
+ * alarms delivered early along with another one, saving an expiry (and,
+ * for the wakeup types, possibly a wakeup from suspend).
+ */
+static struct devalarm_stats {
+	unsigned long set;
+	unsigned long fired;
+	unsigned long coalesced;
+} alarm_stats[ANDROID_ALARM_TYPE_COUNT];
+
 
 static int is_wakeup(enum android_alarm_type type)
 {
@@ -76,12 +91,34 @@ static int is_wakeup(enum android_alarm_type type)
 }
 
 
-static void devalarm_start(struct devalarm *alrm, ktime_t exp)
+static ktime_t devalarm_now(enum android_alarm_type type)
+{
+	switch (type) {
+	case ANDROID_ALARM_RTC_WAKEUP:
+	case ANDROID_ALARM_RTC:
+		return ktime_get_real();
+	case ANDROID_ALARM_ELAPSED_REALTIME_WAKEUP:
+	case ANDROID_ALARM_ELAPSED_REALTIME:
+		return ktime_get_boottime();
+	default:
+		return ktime_get();
+	}
+}
+
+/*
+ * Wakeup alarms are queued at the end of their window, so that the RTC is
+ * only programmed for the latest time that will do. The others let the
+ * hrtimer code pick an expiry within the window.
+ */
+static void devalarm_start(struct devalarm *alrm, ktime_t soft, ktime_t hard)
 {
+	alrm->soft = soft;
 	if (is_wakeup(alrm->type))
-		alarm_start(&alrm->u.alrm, exp);
+		alarm_start(&alrm->u.alrm, hard);
 	else
-		hrtimer_start(&alrm->u.hrt, exp, HRTIMER_MODE_ABS);
+		hrtimer_start_range_ns(&alrm->u.hrt, soft,
+				       ktime_to_ns(ktime_sub(hard, soft)),
+				       HRTIMER_MODE_ABS);
 }
 
 
@@ -109,6 +146,8 @@ static long alarm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	int rv = 0;
 	unsigned long flags;
 	struct timespec new_alarm_time;
+	struct timespec new_alarm_window = { 0, 0 };
+	struct android_alarm_window window;
 	struct timespec new_rtc_time;
 	struct timespec tmp_time;
 	struct rtc_time new_rtc_tm;
@@ -158,6 +197,26 @@ static long alarm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		new_alarm_time.tv_nsec = 0;
 		goto from_old_alarm_set;
 
+	case ANDROID_ALARM_SET_WINDOW(0):
+		/*
+		 * Setting a window replaces the one pending alarm of this
+		 * type, like ANDROID_ALARM_SET does. Coalescing only merges
+		 * across the ANDROID_ALARM_TYPE_COUNT per-type alarms, not
+		 * across alarms of separate clients.
+		 */
+		if (copy_from_user(&window, (void __user *)arg,
+		    sizeof(window))) {
+			rv = -EFAULT;
+			goto err1;
+		}
+		if (!timespec_valid(&window.window)) {
+			rv = -EINVAL;
+			goto err1;
+		}
+		new_alarm_time = window.time;
+		new_alarm_window = window.window;
+		goto from_old_alarm_set;
+
 	case ANDROID_ALARM_SET_AND_WAIT(0):
 	case ANDROID_ALARM_SET(0):
 		if (copy_from_user(&new_alarm_time, (void __user *)arg,
@@ -167,11 +226,17 @@ static long alarm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 from_old_alarm_set:
 		spin_lock_irqsave(&alarm_slock, flags);
-		pr_alarm(IO, "alarm %d set %ld.%09ld\n", alarm_type,
-			new_alarm_time.tv_sec, new_alarm_time.tv_nsec);
+		pr_alarm(IO, "alarm %d set %ld.%09ld window %ld.%09ld\n",
+			alarm_type, new_alarm_time.tv_sec,
+			new_alarm_time.tv_nsec, new_alarm_window.tv_sec,
+			new_alarm_window.tv_nsec);
 		alarm_enabled |= alarm_type_mask;
+		alarm_stats[alarm_type].set++;
+		/* a valid window can still end past KTIME_MAX, so clamp it */
 		devalarm_start(&alarms[alarm_type],
-			timespec_to_ktime(new_alarm_time));
+			timespec_to_ktime(new_alarm_time),
+			ktime_add_safe(timespec_to_ktime(new_alarm_time),
+				       timespec_to_ktime(new_alarm_window)));
 		spin_unlock_irqrestore(&alarm_slock, flags);
 		if (ANDROID_ALARM_BASE_CMD(cmd) != ANDROID_ALARM_SET_AND_WAIT(0)
 		    && cmd != ANDROID_ALARM_SET_AND_WAIT_OLD)
@@ -283,6 +348,34 @@ static int alarm_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/*
+ * Deliver every other enabled alarm whose window has opened, so that it
+ * doesn't need an expiry of its own. There is one alarm per type, so at
+ * most ANDROID_ALARM_TYPE_COUNT - 1 others are looked at. Called with
+ * alarm_slock held.
+ */
+static void devalarm_coalesce(struct devalarm *alarm)
+{
+	int i;
+
+	for (i = 0; i < ANDROID_ALARM_TYPE_COUNT; i++) {
+		uint32_t alarm_type_mask = 1U << i;
+
+		if (i == alarm->type || !(alarm_enabled & alarm_type_mask))
+			continue;
+		if (alarms[i].soft.tv64 > devalarm_now(i).tv64)
+			continue;
+		/* if its own callback is running, it delivers itself */
+		if (devalarm_try_to_cancel(&alarms[i]) < 0)
+			continue;
+		pr_alarm(INT, "devalarm_triggered type %d with %d\n",
+			 i, alarm->type);
+		alarm_enabled &= ~alarm_type_mask;
+		alarm_pending |= alarm_type_mask;
+		alarm_stats[i].coalesced++;
+	}
+}
+
 static void devalarm_triggered(struct devalarm *alarm)
 {
 	unsigned long flags;
@@ -294,6 +387,8 @@ static void devalarm_triggered(struct devalarm *alarm)
 		wake_lock_timeout(&alarm_wake_lock, 5 * HZ);
 		alarm_enabled &= ~alarm_type_mask;
 		alarm_pending |= alarm_type_mask;
+		alarm_stats[alarm->type].fired++;
+		devalarm_coalesce(alarm);
 		wake_up(&alarm_wait_queue);
 	}
 	spin_unlock_irqrestore(&alarm_slock, flags);
@@ -318,6 +413,54 @@ static enum alarmtimer_restart devalarm_alarmhandler(struct alarm *alrm,
 }
 
 
+static const char * const alarm_type_names[ANDROID_ALARM_TYPE_COUNT] = {
+	[ANDROID_ALARM_RTC_WAKEUP] = "rtc_wakeup",
+	[ANDROID_ALARM_RTC] = "rtc",
+	[ANDROID_ALARM_ELAPSED_REALTIME_WAKEUP] = "elapsed_realtime_wakeup",
+	[ANDROID_ALARM_ELAPSED_REALTIME] = "elapsed_realtime",
+	[ANDROID_ALARM_SYSTEMTIME] = "systemtime",
+};
+
+static int alarm_stats_show(struct seq_file *m, void *unused)
+{
+	struct devalarm_stats stats[ANDROID_ALARM_TYPE_COUNT];
+	unsigned long saved = 0, wakeups_saved = 0;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&alarm_slock, flags);
+	memcpy(stats, alarm_stats, sizeof(stats));
+	spin_unlock_irqrestore(&alarm_slock, flags);
+
+	seq_printf(m, "%-24s %10s %10s %10s\n", "type", "set", "fired",
+		   "coalesced");
+	for (i = 0; i < ANDROID_ALARM_TYPE_COUNT; i++) {
+		seq_printf(m, "%-24s %10lu %10lu %10lu\n", alarm_type_names[i],
+			   stats[i].set, stats[i].fired, stats[i].coalesced);
+		saved += stats[i].coalesced;
+		if (is_wakeup(i))
+			wakeups_saved += stats[i].coalesced;
+	}
+	seq_printf(m, "expiries saved: %lu, wakeup alarms saved: %lu\n",
+		   saved, wakeups_saved);
+	return 0;
+}
+
+static int alarm_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, alarm_stats_show, inode->i_private);
+}
+
+static const struct file_operations alarm_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = alarm_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *alarm_debugfs;
+
 static const struct file_operations alarm_fops = {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = alarm_ioctl,
@@ -359,11 +502,15 @@ static int __init alarm_dev_init(void)
 
 	wake_lock_init(&alarm_wake_lock, WAKE_LOCK_SUSPEND, "alarm");
 
+	alarm_debugfs = debugfs_create_file("alarm_stats", S_IRUGO, NULL, NULL,
+					    &alarm_stats_fops);
+
 	return 0;
 }
 
 static void  __exit alarm_dev_exit(void)
 {
+	debugfs_remove(alarm_debugfs);
 	misc_deregister(&alarm_device);
 	wake_lock_destroy(&alarm_wake_lock);
 }
@@ -44,6 +44,19 @@ enum android_alarm_return_flags {
 	ANDROID_ALARM_TIME_CHANGE_MASK = 1U << 16
 };
 
+/*
+ * A windowed alarm may go off at any time from @time to @time + @window.
+ * alarm-dev delivers all the alarms whose windows have opened whenever one
+ * of them goes off, so alarms with overlapping windows share one expiry.
+ * There is only one alarm per type, shared by all openers of the device,
+ * so at most ANDROID_ALARM_TYPE_COUNT alarms can be coalesced; merging
+ * the alarms of individual clients is left to userspace.
+ */
+struct android_alarm_window {
+	struct timespec time;
+	struct timespec window;
+};
+
 /* Disable alarm */
 #define ANDROID_ALARM_CLEAR(type)           _IO('a', 0 | ((type) << 4))
 
@@ -56,6 +69,8 @@ enum android_alarm_return_flags {
 #define ANDROID_ALARM_SET_AND_WAIT(type)    ALARM_IOW(3, type, struct timespec)
 #define ANDROID_ALARM_GET_TIME(type)        ALARM_IOW(4, type, struct timespec)
 #define ANDROID_ALARM_SET_RTC               _IOW('a', 5, struct timespec)
+#define ANDROID_ALARM_SET_WINDOW(type)      ALARM_IOW(6, type, \
+						struct android_alarm_window)
 #define ANDROID_ALARM_BASE_CMD(cmd)         (cmd & ~(_IOC(0, 0, 0xf0, 0)))
 #define ANDROID_ALARM_IOCTL_TO_TYPE(cmd)    (_IOC_NR(cmd) >> 4)
 
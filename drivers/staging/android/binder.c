@@ -16,9 +16,11 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/atomic.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -28,15 +30,36 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking:
+ *
+ * binder_lock is held shared by every ioctl and by poll.  Each binder_proc
+ * has its own mutex, proc->lock, which protects the proc's threads, nodes,
+ * buffers and todo lists, the transaction stacks of its threads and the
+ * state of the nodes it owns.  A plain transaction only needs the sender's
+ * and the target's proc->lock, taken in address order, so unrelated
+ * processes do not serialize against each other.
+ *
+ * Anything that changes the object graph across processes (references,
+ * node creation, death notifications, fd translation, thread exit and
+ * process teardown) upgrades to binder_lock exclusive and then needs no
+ * proc->lock.  The refs trees, node->refs, binder_procs, binder_dead_nodes
+ * and the context manager only change under the exclusive lock, so shared
+ * holders may read them without further locking.
+ *
+ * Lock order: binder_lock -> proc->lock -> mmap_sem.
+ */
+static DECLARE_RWSEM(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
 
@@ -44,11 +67,15 @@ static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
 
+static LIST_HEAD(binder_lru);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static int binder_lru_count;
+
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -106,6 +133,9 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static bool binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+static int binder_prealloc_pages = 4;
+module_param_named(prealloc_pages, binder_prealloc_pages, int, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -147,22 +177,53 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
+	atomic_long_t bytes_copied;	/* data and offsets, all transactions */
+	atomic_long_t bytes_gathered;	/* data of TF_SCATTER_GATHER ones */
 };
 
 static struct binder_stats binder_stats;
 
+/*
+ * Transaction latency histograms, in log2 microsecond buckets: bucket n
+ * counts latencies of 2^(n-1) to 2^n - 1 us, the last one everything above.
+ * Dispatch is from queueing a transaction or reply to a thread reading it,
+ * call is from BC_TRANSACTION to the caller reading the reply.
+ */
+#define BINDER_LATENCY_BUCKETS	21
+
+static atomic_t binder_dispatch_latency[BINDER_LATENCY_BUCKETS];
+static atomic_t binder_call_latency[BINDER_LATENCY_BUCKETS];
+
+static void binder_latency_add(atomic_t *hist, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	if (us > 0)
+		bucket = min_t(int, fls64(us), BINDER_LATENCY_BUCKETS - 1);
+	atomic_inc(&hist[bucket]);
+}
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+static inline void binder_stats_copied(struct binder_stats *stats,
+				       size_t copied, size_t gathered)
+{
+	atomic_long_add(copied, &stats->bytes_copied);
+	if (gathered)
+		atomic_long_add(gathered, &stats->bytes_gathered);
 }
 
 struct binder_transaction_log_entry {
@@ -178,24 +239,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -259,8 +323,10 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by address */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct list_head free_entry; /* free entry in its size class */
+		struct rb_node rb_node; /* allocated entry by address */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -280,8 +346,26 @@ enum binder_deferred_state {
 	BINDER_DEFERRED_RELEASE      = 0x04,
 };
 
+/*
+ * Free buffers are kept in lists by size class: class n holds the buffers
+ * of 2^(n-1) to 2^n - 1 bytes.  A proc's buffer area is at most 4M.
+ */
+#define BINDER_FREE_BUCKETS	24
+
+/*
+ * A page of a proc's buffer area.  Once no buffer uses it, the page stays
+ * mapped on binder_lru until the shrinker wants it back, so that the next
+ * buffer allocated there need not map it again.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -297,11 +381,12 @@ struct binder_proc {
 	ptrdiff_t user_buffer_offset;
 
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct list_head free_buckets[BINDER_FREE_BUCKETS];
+	unsigned long free_bucket_map;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -312,6 +397,7 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
+	struct list_head waiting_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
 };
@@ -328,6 +414,8 @@ enum {
 struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
+	struct list_head waiting_thread_node; /* on proc->waiting_threads */
+	struct task_struct *task;
 	int pid;
 	int looper;
 	struct binder_transaction *transaction_stack;
@@ -356,12 +444,58 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	unsigned int	policy;
+	unsigned int	rt_priority;
+	unsigned int	saved_policy;
+	unsigned int	saved_rt_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
+	ktime_t	call_start_time;	/* of the call a reply answers */
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+/*
+ * Called with binder_lock held shared and no proc->lock.  Anything looked
+ * up before the upgrade has to be looked up again afterwards.
+ */
+static void binder_upgrade_lock(void)
+{
+	up_read(&binder_lock);
+	down_write(&binder_lock);
+}
+
+static void binder_downgrade_lock(void)
+{
+	downgrade_write(&binder_lock);
+}
+
+/*
+ * Lock the target of a transaction while the sender's proc->lock is held.
+ * Two procs are always locked in address order, so the sender's lock may be
+ * dropped and retaken here.
+ */
+static void binder_lock_target(struct binder_proc *proc,
+			       struct binder_proc *target_proc)
+{
+	if (target_proc == proc || mutex_trylock(&target_proc->lock))
+		return;
+	if (target_proc < proc) {
+		mutex_unlock(&proc->lock);
+		mutex_lock(&target_proc->lock);
+		mutex_lock_nested(&proc->lock, SINGLE_DEPTH_NESTING);
+	} else
+		mutex_lock_nested(&target_proc->lock, SINGLE_DEPTH_NESTING);
+}
+
+static void binder_unlock_target(struct binder_proc *proc,
+				 struct binder_proc *target_proc)
+{
+	if (target_proc && target_proc != proc)
+		mutex_unlock(&target_proc->lock);
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -516,6 +650,27 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static bool binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+/*
+ * Binder threads take on the real-time policy of their caller for the
+ * duration of a call, which unprivileged threads could not set themselves.
+ */
+static void binder_set_policy(unsigned int policy, unsigned int rt_priority)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+
+	if (current->policy == policy && current->rt_priority == rt_priority)
+		return;
+	if (sched_setscheduler_nocheck(current, policy, &param))
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: policy %u priority %u not allowed\n",
+			     current->pid, policy, rt_priority);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -526,14 +681,16 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_free_bucket(size_t size)
+{
+	return min_t(int, fls(size), BINDER_FREE_BUCKETS - 1);
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
 	size_t new_buffer_size;
+	int bucket;
 
 	BUG_ON(!new_buffer->free);
 
@@ -543,20 +700,20 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-
-		buffer_size = binder_buffer_size(proc, buffer);
+	bucket = binder_free_bucket(new_buffer_size);
+	list_add(&new_buffer->free_entry, &proc->free_buckets[bucket]);
+	__set_bit(bucket, &proc->free_bucket_map);
+}
 
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
-	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+/*
+ * The bucket's bit in free_bucket_map is left set; binder_alloc_buf()
+ * clears it when it finds the bucket empty.
+ */
+static void binder_erase_free_buffer(struct binder_proc *proc,
+				     struct binder_buffer *buffer)
+{
+	BUG_ON(!buffer->free);
+	list_del(&buffer->free_entry);
 }
 
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
@@ -608,6 +765,12 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/*
+ * Make the pages of [start, end) available to a new buffer, or give them up
+ * when the buffer is freed.  Pages given up stay mapped on binder_lru, and
+ * only pages the shrinker has reclaimed in the meantime need to be allocated
+ * and mapped again.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -615,8 +778,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *page;
 	struct mm_struct *mm;
+	int need_map = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -625,6 +789,26 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	spin_lock(&binder_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!allocate) {
+			BUG_ON(!page->page_ptr);
+			BUG_ON(!list_empty(&page->lru));
+			list_add_tail(&page->lru, &binder_lru);
+			binder_lru_count++;
+		} else if (page->page_ptr) {
+			BUG_ON(list_empty(&page->lru));
+			list_del_init(&page->lru);
+			binder_lru_count--;
+		} else
+			need_map = 1;
+	}
+	spin_unlock(&binder_lru_lock);
+
+	if (!need_map)
+		return 0;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -640,9 +824,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -654,16 +835,18 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_HIGHMEM |
+					    __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -673,7 +856,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -688,22 +871,23 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
+	/* whatever is mapped in the range is unused again */
+	spin_lock(&binder_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr) {
+			list_add_tail(&page->lru, &binder_lru);
+			binder_lru_count++;
+		}
+	}
+	spin_unlock(&binder_lru_lock);
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -711,17 +895,133 @@ err_no_vma:
 	return -ENOMEM;
 }
 
+/*
+ * Called by the shrinker with binder_lock held shared and proc->lock held,
+ * for a page it has taken off binder_lru.  Returns -EBUSY if the user
+ * mapping cannot be torn down right now.
+ */
+static int binder_reclaim_page(struct binder_proc *proc,
+			       struct binder_lru_page *page)
+{
+	void *page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		if (!down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return -EBUSY;
+		}
+		if (mm == proc->vma_vm_mm)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				       proc->user_buffer_offset, PAGE_SIZE,
+				       NULL);
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	} else
+		return -EBUSY;
+
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	return 0;
+}
+
+/*
+ * Unmap and free unused buffer pages, oldest first.  Reclaim can be entered
+ * with binder_lock, a proc->lock or the mmap_sem of the very proc we are
+ * after held, so everything here is a trylock.
+ */
+static int binder_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int nr_to_scan = sc->nr_to_scan;
+
+	if (!nr_to_scan)
+		return binder_lru_count;
+	/* dropping the last mm reference can recurse into filesystem code */
+	if (!(sc->gfp_mask & __GFP_FS))
+		return -1;
+	if (!down_read_trylock(&binder_lock))
+		return -1;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_lru)) {
+		struct binder_lru_page *page;
+		struct binder_proc *proc;
+
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->lock)) {
+			list_move_tail(&page->lru, &binder_lru);
+			continue;
+		}
+		/* not mapped yet, or unmapped: binder_free_pages() owns it */
+		if (proc->vma == NULL) {
+			mutex_unlock(&proc->lock);
+			list_move_tail(&page->lru, &binder_lru);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		if (binder_reclaim_page(proc, page)) {
+			spin_lock(&binder_lru_lock);
+			list_add_tail(&page->lru, &binder_lru);
+			binder_lru_count++;
+			mutex_unlock(&proc->lock);
+			continue;
+		}
+		mutex_unlock(&proc->lock);
+		spin_lock(&binder_lru_lock);
+	}
+	spin_unlock(&binder_lru_lock);
+	up_read(&binder_lock);
+
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/* Free every page still mapped in the buffer area, used or not. */
+static int binder_free_pages(struct binder_proc *proc)
+{
+	int i, page_count = 0;
+
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		struct binder_lru_page *page = &proc->pages[i];
+		void *page_addr = proc->buffer + i * PAGE_SIZE;
+
+		if (!page->page_ptr)
+			continue;
+		spin_lock(&binder_lru_lock);
+		if (!list_empty(&page->lru)) {
+			list_del_init(&page->lru);
+			binder_lru_count--;
+		}
+		spin_unlock(&binder_lru_lock);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		page_count++;
+	}
+	return page_count;
+}
+
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
 					      size_t offsets_size, int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct binder_buffer *buffer, *best_fit = NULL;
+	size_t buffer_size, best_size = 0;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
+	int bucket;
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
@@ -746,30 +1046,38 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
+	/* best fit within the size class, else any buffer of a larger one */
+	bucket = binder_free_bucket(size);
+	list_for_each_entry(buffer, &proc->free_buckets[bucket], free_entry) {
 		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
+		if (buffer_size < size ||
+		    (best_fit && buffer_size >= best_size))
+			continue;
+		best_fit = buffer;
+		best_size = buffer_size;
+		if (buffer_size == size)
+			break;
+	}
+	while (best_fit == NULL) {
+		bucket = find_next_bit(&proc->free_bucket_map,
+				       BINDER_FREE_BUCKETS, bucket + 1);
+		if (bucket >= BINDER_FREE_BUCKETS)
 			break;
+		if (list_empty(&proc->free_buckets[bucket])) {
+			__clear_bit(bucket, &proc->free_bucket_map);
+			continue;
 		}
+		best_fit = list_first_entry(&proc->free_buckets[bucket],
+					    struct binder_buffer, free_entry);
+		best_size = binder_buffer_size(proc, best_fit);
 	}
 	if (best_fit == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer = best_fit;
+	buffer_size = best_size;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -777,7 +1085,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (buffer_size != size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -791,7 +1099,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -913,7 +1221,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -921,8 +1229,8 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
+			binder_erase_free_buffer(proc, prev);
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
 			buffer = prev;
 		}
 	}
@@ -974,7 +1282,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -1109,7 +1417,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1381,14 +1689,70 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
-static void binder_transaction(struct binder_proc *proc,
-			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+/*
+ * Copy the segments of a TF_SCATTER_GATHER transaction back to back into
+ * the target buffer, so that the sender does not have to flatten them into
+ * one buffer first.
+ */
+static int binder_copy_iovec(void *dst, const struct iovec *iov,
+			     unsigned long nr_segs)
+{
+	unsigned long seg;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		if (copy_from_user(dst, iov[seg].iov_base, iov[seg].iov_len))
+			return -EFAULT;
+		dst += iov[seg].iov_len;
+	}
+	return 0;
+}
+
+/*
+ * Wake one idle looper for new proc work, preferring one that last ran on
+ * this CPU, then one sharing its cache, so that the transaction data is
+ * still warm when it is read.  Only falls back to proc->wait, which also
+ * wakes pollers, when no thread is blocked in binder_thread_read().
+ * Called with proc->lock held.
+ */
+static void binder_wakeup_proc(struct binder_proc *proc)
+{
+	struct binder_thread *thread, *best = NULL;
+	int cpu = raw_smp_processor_id();
+
+	list_for_each_entry(thread, &proc->waiting_threads,
+			    waiting_thread_node) {
+		int thread_cpu = task_cpu(thread->task);
+
+		if (thread_cpu == cpu) {
+			best = thread;
+			break;
+		}
+		if (best == NULL ||
+		    (cpus_share_cache(cpu, thread_cpu) &&
+		     !cpus_share_cache(cpu, task_cpu(best->task))))
+			best = thread;
+	}
+	if (best == NULL) {
+		wake_up_interruptible(&proc->wait);
+		return;
+	}
+	list_del_init(&best->waiting_thread_node);
+	wake_up_process(best->task);
+}
+
+/*
+ * Called with binder_lock held, exclusive if the transaction carries objects.
+ * Returns -EAGAIN if it has to be retried with binder_lock held exclusive.
+ */
+static int binder_transaction(struct binder_proc *proc,
+			      struct binder_thread *thread,
+			      struct binder_transaction_data *tr, int reply,
+			      int exclusive)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
@@ -1396,6 +1760,22 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
+	struct iovec *iov = NULL;
+	unsigned long nr_segs = 0;
+	size_t data_size = tr->data_size;
+
+	mutex_lock(&proc->lock);
+	in_reply_to = thread->transaction_stack;
+	if (reply && !exclusive && in_reply_to &&
+	    in_reply_to->to_thread == thread && in_reply_to->from == NULL) {
+		/*
+		 * The caller is gone: failing the reply unwinds its call
+		 * chain, which can span any number of processes.
+		 */
+		mutex_unlock(&proc->lock);
+		return -EAGAIN;
+	}
+	in_reply_to = NULL;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1414,6 +1794,8 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
+		binder_set_policy(in_reply_to->saved_policy,
+				  in_reply_to->saved_rt_priority);
 		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
@@ -1434,6 +1816,8 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		target_proc = target_thread->proc;
+		binder_lock_target(proc, target_proc);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1447,7 +1831,6 @@ static void binder_transaction(struct binder_proc *proc,
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
-		target_proc = target_thread->proc;
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
@@ -1468,11 +1851,12 @@ static void binder_transaction(struct binder_proc *proc,
 			}
 		}
 		e->to_node = target_node->debug_id;
-		target_proc = target_node->proc;
-		if (target_proc == NULL) {
+		if (target_node->proc == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		target_proc = target_node->proc;
+		binder_lock_target(proc, target_proc);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
@@ -1519,7 +1903,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1547,9 +1931,35 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_proc = target_proc;
 	t->to_thread = target_thread;
 	t->code = tr->code;
-	t->flags = tr->flags;
+	t->flags = tr->flags & ~TF_SCATTER_GATHER;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
+	t->policy = current->policy;
+	t->rt_priority = current->rt_priority;
+	t->start_time = ktime_get();
+	if (reply)
+		t->call_start_time = in_reply_to->start_time;
+
+	if (tr->flags & TF_SCATTER_GATHER) {
+		ssize_t len;
+
+		/* data.ptr.buffer points to data_size bytes of iovecs */
+		nr_segs = tr->data_size / sizeof(struct iovec);
+		len = rw_copy_check_uvector(WRITE, tr->data.ptr.buffer,
+					    nr_segs, 0, NULL, &iov, 1);
+		if (len < 0 ||
+		    tr->data_size != nr_segs * sizeof(struct iovec)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid iovec %p, size %zd\n",
+				proc->pid, thread->pid,
+				tr->data.ptr.buffer, tr->data_size);
+			return_error = BR_FAILED_REPLY;
+			goto err_bad_iovec;
+		}
+		data_size = len;
+		e->data_size = data_size;
+	}
+
+	t->buffer = binder_alloc_buf(target_proc, data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
@@ -1562,9 +1972,10 @@ static void binder_transaction(struct binder_proc *proc,
 	if (target_node)
 		binder_inc_node(target_node, 1, 0, NULL);
 
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
+	offp = (size_t *)(t->buffer->data + ALIGN(data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (iov ? binder_copy_iovec(t->buffer->data, iov, nr_segs) :
+	    copy_from_user(t->buffer->data, tr->data.ptr.buffer, data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
@@ -1576,6 +1987,12 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
+	binder_stats_copied(&binder_stats, data_size + tr->offsets_size,
+			    iov ? data_size : 0);
+	binder_stats_copied(&proc->stats, data_size + tr->offsets_size,
+			    iov ? data_size : 0);
+	binder_stats_copied(&thread->stats, data_size + tr->offsets_size,
+			    iov ? data_size : 0);
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1742,9 +2159,14 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
+	if (target_wait == &target_proc->wait)
+		binder_wakeup_proc(target_proc);
+	else if (target_wait)
 		wake_up_interruptible(target_wait);
-	return;
+	binder_unlock_target(proc, target_proc);
+	mutex_unlock(&proc->lock);
+	kfree(iov);
+	return 0;
 
 err_get_unused_fd_failed:
 err_fget_failed:
@@ -1759,6 +2181,7 @@ err_copy_data_failed:
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
+err_bad_iovec:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1787,23 +2210,33 @@ err_no_context_mgr_node:
 		binder_send_failed_reply(in_reply_to, return_error);
 	} else
 		thread->return_error = return_error;
+	binder_unlock_target(proc, target_proc);
+	mutex_unlock(&proc->lock);
+	kfree(iov);
+	return 0;
 }
 
+/*
+ * Called with binder_lock held shared.  Each command takes proc->lock, or
+ * upgrades to the exclusive lock if it changes references across processes.
+ */
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *buffer, int size, signed long *consumed)
 {
 	uint32_t cmd;
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	int exclusive = 0;
+	int locked = 0;
 
 	while (ptr < end && thread->return_error == BR_OK) {
 		if (get_user(cmd, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1817,6 +2250,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			binder_upgrade_lock();
+			exclusive = 1;
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1874,6 +2309,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			mutex_lock(&proc->lock);
+			locked = 1;
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
 				binder_user_error("binder: %d:%d "
@@ -1939,7 +2376,17 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->lock);
+			locked = 1;
 			buffer = binder_buffer_lookup(proc, data_ptr);
+			if (buffer && buffer->offsets_size) {
+				/* releasing the objects drops references */
+				mutex_unlock(&proc->lock);
+				locked = 0;
+				binder_upgrade_lock();
+				exclusive = 1;
+				buffer = binder_buffer_lookup(proc, data_ptr);
+			}
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
@@ -1981,7 +2428,17 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			if (tr.offsets_size) {
+				binder_upgrade_lock();
+				exclusive = 1;
+			}
+			if (binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					       exclusive) == -EAGAIN) {
+				binder_upgrade_lock();
+				exclusive = 1;
+				binder_transaction(proc, thread, &tr,
+						   cmd == BC_REPLY, exclusive);
+			}
 			break;
 		}
 
@@ -1989,6 +2446,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->lock);
+			locked = 1;
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2011,6 +2470,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->lock);
+			locked = 1;
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2024,6 +2485,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			mutex_lock(&proc->lock);
+			locked = 1;
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
 			break;
 
@@ -2040,6 +2503,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_upgrade_lock();
+			exclusive = 1;
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d %s "
@@ -2135,6 +2600,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			mutex_lock(&proc->lock);
+			locked = 1;
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2169,6 +2636,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			       proc->pid, thread->pid, cmd);
 			return -EINVAL;
 		}
+		if (exclusive) {
+			binder_downgrade_lock();
+			exclusive = 0;
+		} else if (locked) {
+			mutex_unlock(&proc->lock);
+			locked = 0;
+		}
 		*consumed = ptr - buffer;
 	}
 	return 0;
@@ -2178,9 +2652,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2197,6 +2671,10 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * Called with binder_lock held shared and proc->lock held.  Both are
+ * dropped while waiting for work.
+ */
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2238,7 +2716,10 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	if (wait_for_proc_work && !non_block)
+		list_add(&thread->waiting_thread_node, &proc->waiting_threads);
+	mutex_unlock(&proc->lock);
+	up_read(&binder_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2262,7 +2743,9 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	down_read(&binder_lock);
+	mutex_lock(&proc->lock);
+	list_del_init(&thread->waiting_thread_node);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2408,10 +2891,18 @@ retry:
 			continue;
 
 		BUG_ON(t->buffer == NULL);
+		binder_latency_add(binder_dispatch_latency, t->start_time);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
+			t->saved_policy = current->policy;
+			t->saved_rt_priority = current->rt_priority;
+			if (!(t->flags & TF_ONE_WAY) &&
+			    binder_is_rt_policy(t->policy) &&
+			    (!binder_is_rt_policy(current->policy) ||
+			     current->rt_priority < t->rt_priority))
+				binder_set_policy(t->policy, t->rt_priority);
 			t->saved_priority = task_nice(current);
 			if (t->priority < target_node->min_priority &&
 			    !(t->flags & TF_ONE_WAY))
@@ -2424,6 +2915,8 @@ retry:
 			tr.target.ptr = NULL;
 			tr.cookie = NULL;
 			cmd = BR_REPLY;
+			binder_latency_add(binder_call_latency,
+					   t->call_start_time);
 		}
 		tr.code = t->code;
 		tr.flags = t->flags;
@@ -2569,6 +3062,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
+		thread->task = current;
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
 		rb_link_node(&thread->rb_node, parent, p);
@@ -2628,12 +3123,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_lock);
+	mutex_lock(&proc->lock);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&proc->lock);
+	up_read(&binder_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2651,6 +3148,33 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+/* Called with binder_lock held exclusive. */
+static int binder_set_context_mgr(struct binder_proc *proc)
+{
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		return -EBUSY;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			return -EPERM;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
+	if (binder_context_mgr_node == NULL)
+		return -ENOMEM;
+	binder_context_mgr_node->local_weak_refs++;
+	binder_context_mgr_node->local_strong_refs++;
+	binder_context_mgr_node->has_strong_ref = 1;
+	binder_context_mgr_node->has_weak_ref = 1;
+	return 0;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2665,8 +3189,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_lock);
+	mutex_lock(&proc->lock);
 	thread = binder_get_thread(proc);
+	mutex_unlock(&proc->lock);
 	if (thread == NULL) {
 		ret = -ENOMEM;
 		goto err;
@@ -2698,9 +3224,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		}
 		if (bwr.read_size > 0) {
+			mutex_lock(&proc->lock);
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
+			mutex_unlock(&proc->lock);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2717,43 +3245,31 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		mutex_lock(&proc->lock);
+		proc->max_threads = max_threads;
+		mutex_unlock(&proc->lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
+		binder_upgrade_lock();
+		ret = binder_set_context_mgr(proc);
+		binder_downgrade_lock();
+		if (ret)
 			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
-			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
+		binder_upgrade_lock();
 		binder_free_thread(proc, thread);
+		binder_downgrade_lock();
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2772,9 +3288,12 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		mutex_lock(&proc->lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		mutex_unlock(&proc->lock);
+	}
+	up_read(&binder_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2816,6 +3335,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i, prealloc_pages;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2865,17 +3385,32 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
 
-	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + PAGE_SIZE, vma)) {
+	/*
+	 * Map a few pages up front so that the first small transactions
+	 * find them on the lru; only the first one holds a buffer header.
+	 */
+	prealloc_pages = clamp_t(int, binder_prealloc_pages, 1,
+				 proc->buffer_size / PAGE_SIZE);
+	if (binder_update_page_range(proc, 1, proc->buffer, proc->buffer + prealloc_pages * PAGE_SIZE, vma)) {
 		ret = -ENOMEM;
 		failure_string = "alloc small buf";
 		goto err_alloc_small_buf_failed;
 	}
+	binder_update_page_range(proc, 0, proc->buffer + PAGE_SIZE,
+				 proc->buffer + prealloc_pages * PAGE_SIZE,
+				 vma);
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
+	for (i = 0; i < BINDER_FREE_BUCKETS; i++)
+		INIT_LIST_HEAD(&proc->free_buckets[i]);
 	list_add(&buffer->entry, &proc->buffers);
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
@@ -2890,6 +3425,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	binder_free_pages(proc);
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2919,14 +3455,16 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	INIT_LIST_HEAD(&proc->waiting_threads);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	mutex_init(&proc->lock);
+	down_write(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3070,21 +3608,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 
 	page_count = 0;
 	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
+		page_count = binder_free_pages(proc);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3108,7 +3632,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3135,7 +3659,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3388,17 +3912,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int count = atomic_read(&stats->bc[i]);
+
+		if (count)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], count);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int count = atomic_read(&stats->br[i]);
+
+		if (count)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], count);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3406,12 +3934,19 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
+
+	if (atomic_long_read(&stats->bytes_copied))
+		seq_printf(m, "%sbytes copied: %ld gathered %ld\n", prefix,
+			   atomic_long_read(&stats->bytes_copied),
+			   atomic_long_read(&stats->bytes_gathered));
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3452,6 +3987,22 @@ static void print_binder_proc_stats(struct seq_file *m,
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
 
+	if (proc->pages) {
+		int i, unused = 0;
+
+		count = 0;
+		spin_lock(&binder_lru_lock);
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (!proc->pages[i].page_ptr)
+				continue;
+			count++;
+			if (!list_empty(&proc->pages[i].lru))
+				unused++;
+		}
+		spin_unlock(&binder_lru_lock);
+		seq_printf(m, "  pages: %d unused %d\n", count, unused);
+	}
+
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
@@ -3476,7 +4027,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3488,7 +4039,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3499,7 +4050,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder stats:\n");
 
@@ -3508,7 +4059,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3519,13 +4070,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3535,11 +4086,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3557,13 +4108,15 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
+	unsigned int next = (unsigned int)atomic_read(&log->cur) + 1;
 	int i;
 
+	next %= ARRAY_SIZE(log->entry);
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
+		for (i = next; i < ARRAY_SIZE(log->entry); i++)
 			print_binder_transaction_log_entry(m, &log->entry[i]);
 	}
-	for (i = 0; i < log->next; i++)
+	for (i = 0; i < next; i++)
 		print_binder_transaction_log_entry(m, &log->entry[i]);
 	return 0;
 }
@@ -3589,6 +4142,30 @@ BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
 
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	seq_printf(m, "%-20s %10s %10s\n", "usecs", "dispatch", "call");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		char range[24];
+
+		if (i == 0)
+			snprintf(range, sizeof(range), "0");
+		else if (i == BINDER_LATENCY_BUCKETS - 1)
+			snprintf(range, sizeof(range), "%lu+", 1UL << (i - 1));
+		else
+			snprintf(range, sizeof(range), "%lu-%lu",
+				 1UL << (i - 1), (1UL << i) - 1);
+		seq_printf(m, "%-20s %10d %10d\n", range,
+			   atomic_read(&binder_dispatch_latency[i]),
+			   atomic_read(&binder_call_latency[i]));
+	}
+	return 0;
+}
+
+BINDER_DEBUG_ENTRY(latency);
+
 static int __init binder_init(void)
 {
 	int ret;
@@ -3628,7 +4205,13 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
+	register_shrinker(&binder_shrinker);
 	return ret;
 }
 
@@ -112,6 +112,12 @@ enum transaction_flags {
 	TF_ROOT_OBJECT	= 0x04,	/* contents are the component's root object */
 	TF_STATUS_CODE	= 0x08,	/* contents are a 32-bit status code */
 	TF_ACCEPT_FDS	= 0x10,	/* allow replies with file descriptors */
+	/*
+	 * data.ptr.buffer points to an array of struct iovec and data_size
+	 * is the size of that array; the driver gathers the segments into
+	 * the target buffer.  The target sees a plain transaction.
+	 */
+	TF_SCATTER_GATHER = 0x20,
 };
 
 struct binder_transaction_data {
@@ -20,21 +20,51 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/io.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * struct logger_stage - a per-CPU staging ring for writes
+ *
+ * Writers append complete entries here with preemption disabled, so there is
+ * exactly one producer per ring and no lock. logger_merge() is the only
+ * consumer, under log->mutex. 'head' and 'tail' count bytes and only ever
+ * grow; the offset into the ring is the count modulo LOGGER_STAGE_SIZE.
+ *
+ * Each staged entry is preceded by its sequence number in the log, and
+ * logger_merge() moves entries in sequence order. Timestamps cannot order
+ * them: they are tick-granular, so a writer that migrates between two
+ * writes in the same tick leaves two entries with equal timestamps on
+ * different rings.
+ */
+struct logger_stage {
+	unsigned char		*buffer;
+	unsigned long		head;	/* written by the producer */
+	unsigned long		tail;	/* written by the consumer */
+};
+
+/* must be a power of two, and hold at least one entry of maximum size */
+#define LOGGER_STAGE_SIZE	(16 * 1024)
+
+/* the sequence number in front of each staged entry */
+#define LOGGER_STAGE_SEQ	sizeof(u32)
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * mutex 'mutex', apart from the staging rings.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
@@ -45,6 +75,12 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	__u64			w_pos;	/* bytes ever written to buffer */
+	struct logger_stage __percpu *stages; /* per-CPU staging rings */
+	atomic_t		stage_seq; /* last sequence number taken */
+	u32			merge_seq; /* next one logger_merge() wants */
+	struct work_struct	merge_work; /* merges stages for readers */
+	struct logger_mmap_status *status; /* first page of an mmap() */
 };
 
 /*
@@ -58,6 +94,7 @@ struct logger_reader {
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
+	bool			r_mapped; /* reader has mmap()ed the log */
 	int			r_ver;	/* reader ABI version */
 };
 
@@ -239,6 +276,151 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
 	return off;
 }
 
+/*
+ * logger_status_begin - mark the mmap() status as being updated, before
+ * anything in the buffer is overwritten
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void logger_status_begin(struct logger_log *log)
+{
+	if (!log->status)
+		return;
+	log->status->seq++;
+	smp_wmb();
+}
+
+/*
+ * logger_status_end - publish the new write and head positions to mmap()
+ * readers
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void logger_status_end(struct logger_log *log)
+{
+	if (!log->status)
+		return;
+	log->status->w_pos = log->w_pos;
+	log->status->head_pos = log->w_pos -
+		logger_offset(log, log->w_off - log->head);
+	smp_wmb();
+	log->status->seq++;
+}
+
+static void stage_read(struct logger_stage *stage, unsigned long pos,
+		       void *buf, size_t count)
+{
+	size_t off = pos & (LOGGER_STAGE_SIZE - 1);
+	size_t len = min_t(size_t, count, LOGGER_STAGE_SIZE - off);
+
+	memcpy(buf, stage->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, stage->buffer, count - len);
+}
+
+static void stage_write(struct logger_stage *stage, unsigned long pos,
+			const void *buf, size_t count)
+{
+	size_t off = pos & (LOGGER_STAGE_SIZE - 1);
+	size_t len = min_t(size_t, count, LOGGER_STAGE_SIZE - off);
+
+	memcpy(stage->buffer + off, buf, len);
+	if (count != len)
+		memcpy(stage->buffer, buf + len, count - len);
+}
+
+static void fix_up_readers(struct logger_log *log, size_t len);
+static void do_write_log(struct logger_log *log, const void *buf,
+			 size_t count);
+
+/*
+ * logger_merge - move every entry written to the staging rings so far into
+ * the log, oldest first. Returns the number of entries moved.
+ *
+ * Entries are moved in the order of their sequence numbers, up to the last
+ * one taken when the merge starts, so writers that keep adding entries are
+ * not chased. The merge stops at a number that is taken but whose entry is
+ * not visible yet, rather than waiting for it under log->mutex. The writer
+ * of that entry schedules merge_work once it is published, if anyone is
+ * waiting for it.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static int logger_merge(struct logger_log *log)
+{
+	int cpu, merged = 0;
+	u32 last;
+
+	if (!log->stages)
+		return 0;
+
+	last = atomic_read(&log->stage_seq);
+	while ((s32)(last - log->merge_seq) >= 0) {
+		struct logger_stage *stage, *next = NULL;
+		struct logger_entry header;
+		unsigned long pos;
+		size_t len, off;
+		u32 seq;
+
+		for_each_possible_cpu(cpu) {
+			stage = per_cpu_ptr(log->stages, cpu);
+			if (stage->tail == ACCESS_ONCE(stage->head))
+				continue;
+			/* pairs with the smp_wmb() in logger_stage_write() */
+			smp_rmb();
+			stage_read(stage, stage->tail, &seq, LOGGER_STAGE_SEQ);
+			if (seq == log->merge_seq) {
+				next = stage;
+				break;
+			}
+		}
+		/* taken, but not published yet */
+		if (!next)
+			break;
+
+		if (!merged)
+			logger_status_begin(log);
+		stage_read(next, next->tail + LOGGER_STAGE_SEQ, &header,
+			   sizeof(struct logger_entry));
+		len = sizeof(struct logger_entry) + header.len;
+		fix_up_readers(log, len);
+		pos = next->tail + LOGGER_STAGE_SEQ;
+		off = pos & (LOGGER_STAGE_SIZE - 1);
+		if (off + len <= LOGGER_STAGE_SIZE)
+			do_write_log(log, next->buffer + off, len);
+		else {
+			do_write_log(log, next->buffer + off,
+				     LOGGER_STAGE_SIZE - off);
+			do_write_log(log, next->buffer,
+				     len - (LOGGER_STAGE_SIZE - off));
+		}
+		log->w_pos += len;
+		/* done reading before the producer may reuse the space */
+		smp_mb();
+		next->tail = pos + len;
+		log->merge_seq++;
+		merged++;
+	}
+	if (merged)
+		logger_status_end(log);
+
+	return merged;
+}
+
+static void logger_merge_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      merge_work);
+	int merged;
+
+	mutex_lock(&log->mutex);
+	merged = logger_merge(log);
+	mutex_unlock(&log->mutex);
+
+	if (merged)
+		wake_up_interruptible(&log->wq);
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -265,6 +447,7 @@ start:
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
+		logger_merge(log);
 		ret = (log->w_off == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
@@ -438,26 +621,101 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * logger_stage_write - the lockless write path: append the entry to this
+ * CPU's staging ring. Returns the number of payload bytes written, or zero
+ * if the entry has to go through the locked path: the ring is full, or the
+ * payload is not resident and copying it would fault.
+ */
+static ssize_t logger_stage_write(struct logger_log *log,
+				  struct logger_entry *header,
+				  const struct iovec *iov,
+				  unsigned long nr_segs)
+{
+	struct logger_stage *stage;
+	unsigned long pos, tail;
+	size_t len = LOGGER_STAGE_SEQ + sizeof(struct logger_entry) +
+		     header->len;
+	ssize_t ret = 0;
+	struct timespec now;
+	u32 seq;
+
+	if (!log->stages)
+		return 0;
+
+	stage = get_cpu_ptr(log->stages);
+	pos = stage->head;
+	tail = ACCESS_ONCE(stage->tail);
+	if (LOGGER_STAGE_SIZE - (pos - tail) < len)
+		goto out;
+
+	/* copy the payload first, nothing may fail once a number is taken */
+	pos += LOGGER_STAGE_SEQ + sizeof(struct logger_entry);
+	pagefault_disable();
+	for (; nr_segs > 0 && ret < header->len; nr_segs--, iov++) {
+		const char __user *src = iov->iov_base;
+		size_t count = min_t(size_t, iov->iov_len, header->len - ret);
+
+		while (count) {
+			size_t off = pos & (LOGGER_STAGE_SIZE - 1);
+			size_t chunk = min_t(size_t, count,
+					     LOGGER_STAGE_SIZE - off);
+
+			if (__copy_from_user_inatomic(stage->buffer + off,
+						      src, chunk))
+				goto fault;
+			src += chunk;
+			pos += chunk;
+			count -= chunk;
+			ret += chunk;
+		}
+	}
+fault:
+	pagefault_enable();
+	if (ret != header->len) {
+		ret = 0;
+		goto out;
+	}
+
+	/* taken with preemption off, so each ring stays in order */
+	seq = atomic_inc_return(&log->stage_seq);
+	now = current_kernel_time();
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+
+	pos = stage->head;
+	stage_write(stage, pos, &seq, LOGGER_STAGE_SEQ);
+	stage_write(stage, pos + LOGGER_STAGE_SEQ, header,
+		    sizeof(struct logger_entry));
+
+	/* publish the entry only once it is complete */
+	smp_wmb();
+	stage->head += len;
+out:
+	put_cpu_ptr(log->stages);
+	return ret;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Entries normally go to the writer's per-CPU staging ring without taking
+ * log->mutex; readers merge the rings into the log before they look at it.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	u32 last;
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
@@ -466,7 +724,35 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
+	ret = logger_stage_write(log, &header, iov, nr_segs);
+	if (likely(ret)) {
+		/* pairs with prepare_to_wait() in logger_read() */
+		smp_mb();
+		if (waitqueue_active(&log->wq))
+			schedule_work(&log->merge_work);
+		return ret;
+	}
+
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
+
+	/*
+	 * Staged entries are older than this one. A merge stops at an entry
+	 * that is not published yet, so retry until everything staged so far
+	 * is in, without holding log->mutex while waiting for its writer.
+	 */
+	last = atomic_read(&log->stage_seq);
 	mutex_lock(&log->mutex);
+	logger_merge(log);
+	while ((s32)(last - log->merge_seq) >= 0) {
+		mutex_unlock(&log->mutex);
+		cpu_relax();
+		mutex_lock(&log->mutex);
+		logger_merge(log);
+	}
+	orig = log->w_off;
+	logger_status_begin(log);
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
@@ -489,6 +775,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		nr = do_write_log_from_user(log, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
 			log->w_off = orig;
+			logger_status_end(log);
 			mutex_unlock(&log->mutex);
 			return nr;
 		}
@@ -497,6 +784,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
+	log->w_pos += sizeof(struct logger_entry) + header.len;
+	logger_status_end(log);
 	mutex_unlock(&log->mutex);
 
 	/* wake up any blocked readers */
@@ -534,6 +823,7 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_mapped = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
@@ -576,6 +866,8 @@ static int logger_release(struct inode *ignored, struct file *file)
  * logger_poll - the log's poll file operation, for poll/select/epoll
  *
  * Note we always return POLLOUT, because you can always write() to the log.
+ * For a reader that has mmap()ed the log, POLLIN means that entries were
+ * added since the last poll.
  * Note also that, strictly speaking, a return value of POLLIN does not
  * guarantee that the log is readable without blocking, as there is a small
  * chance that the writer can lap the reader in the interim between poll()
@@ -596,12 +888,17 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
+	logger_merge(log);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
-	if (log->w_off != reader->r_off)
+	if (log->w_off != reader->r_off) {
 		ret |= POLLIN | POLLRDNORM;
+		/* a mapped reader only wants to hear about new entries */
+		if (reader->r_mapped)
+			reader->r_off = log->w_off;
+	}
 	mutex_unlock(&log->mutex);
 
 	return ret;
@@ -628,6 +925,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	void __user *argp = (void __user *) arg;
 
 	mutex_lock(&log->mutex);
+	logger_merge(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -668,7 +966,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
+		logger_status_begin(log);
 		log->head = log->w_off;
+		logger_status_end(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -694,11 +994,68 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/*
+ * logger_mmap - map a read-only view of the log for a reader allowed to read
+ * all of it: the status page, then the ring buffer itself. See struct
+ * logger_mmap_status for how to read entries from it.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	size_t off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	reader = file->private_data;
+	log = reader->log;
+	if (!reader->r_all || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+	if (!log->status)
+		return -ENOMEM;
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->status) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+	/*
+	 * The buffer is a static array, which is in module space rather than
+	 * the linear map when the logger is built as a module, so it is mapped
+	 * page by page.
+	 */
+	for (off = 0; off < log->size; off += PAGE_SIZE) {
+		void *addr = log->buffer + off;
+		unsigned long pfn;
+
+		if (is_vmalloc_or_module_addr(addr))
+			pfn = vmalloc_to_pfn(addr);
+		else
+			pfn = virt_to_phys(addr) >> PAGE_SHIFT;
+		ret = remap_pfn_range(vma, vma->vm_start + PAGE_SIZE + off,
+				      pfn, PAGE_SIZE, vma->vm_page_prot);
+		if (ret)
+			return ret;
+	}
+
+	mutex_lock(&log->mutex);
+	reader->r_mapped = true;
+	mutex_unlock(&log->mutex);
+
+	return 0;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -708,10 +1065,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)). The buffer is
+ * page aligned so that readers can map it.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -726,6 +1084,8 @@ static struct logger_log VAR = { \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.merge_seq = 1, \
+	.merge_work = __WORK_INITIALIZER(VAR .merge_work, logger_merge_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -746,10 +1106,43 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * init_log_stages - set up the staging rings and the mmap() status page. If
+ * that fails, the log still works, with every write taking log->mutex.
+ */
+static void __init init_log_stages(struct logger_log *log)
+{
+	int cpu;
+
+	log->status = (void *)get_zeroed_page(GFP_KERNEL);
+	if (log->status)
+		log->status->size = log->size;
+
+	log->stages = alloc_percpu(struct logger_stage);
+	if (!log->stages)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct logger_stage *stage = per_cpu_ptr(log->stages, cpu);
+
+		stage->buffer = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		if (stage->buffer)
+			continue;
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(log->stages, cpu)->buffer);
+		free_percpu(log->stages);
+		log->stages = NULL;
+		printk(KERN_ERR "logger: no staging buffers for log '%s'\n",
+		       log->misc.name);
+		return;
+	}
+}
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	init_log_stages(log);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
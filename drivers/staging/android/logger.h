@@ -51,6 +51,25 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * The first page of a reader's mmap() of a log, followed by the log buffer
+ * itself. Only readers that may read every entry can map the log.
+ *
+ * Positions count bytes written since boot; an entry at position pos starts
+ * at offset (pos & (size - 1)) in the buffer, as a struct logger_entry and
+ * its payload, possibly wrapping around the end. Entries run from head_pos
+ * up to w_pos. seq is odd while the log is being written to: sample seq,
+ * the positions and seq again until seq is even and unchanged. An entry
+ * copied out of the buffer at pos is intact if w_pos sampled afterwards is
+ * at most pos + size.
+ */
+struct logger_mmap_status {
+	__u32		seq;
+	__u32		size;		/* size of the log buffer */
+	__u64		w_pos;		/* position of the next entry */
+	__u64		head_pos;	/* position of the oldest entry */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -17,6 +17,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * The killer runs when the page allocator finds a zone below its low
+ * watermark and wakes kswapd, when reclaim reports memory pressure (see
+ * mm/vmpressure.c), and again whenever a victim exits while memory is still
+ * low. Every process is kept in a bucket of its oom_score_adj, so
+ * picking a victim only looks at the processes in the highest non-empty
+ * buckets instead of walking the whole task list.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -36,7 +43,15 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 #include <linux/notifier.h>
+#include <linux/vmpressure.h>
+
+#define CREATE_TRACE_POINTS
+#include "trace/lowmemorykiller.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -62,20 +77,63 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * One bucket per oom_score_adj value, highest value first, so that the
+ * first set bit of lowmem_bucket_map is the most killable non-empty bucket.
+ * Only thread group leaders are kept here. Both are zero-initialized, so
+ * they are usable from the first fork on, long before lowmem_init().
+ *
+ * The fork, exit and exec hooks take lowmem_bucket_lock nested inside
+ * write_lock_irq(&tasklist_lock). tasklist_lock is read-locked from hard
+ * interrupts, so everybody else must take lowmem_bucket_lock with
+ * interrupts off too, and hold it only briefly.
+ */
+#define LOWMEM_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+
+static struct hlist_head lowmem_buckets[LOWMEM_BUCKETS];
+static DECLARE_BITMAP(lowmem_bucket_map, LOWMEM_BUCKETS);
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+/* the last victim, until it exits or lowmem_deathpending_timeout passes */
+static struct task_struct *lowmem_deathpending;
+
+static struct workqueue_struct *lowmem_wq;
+static ktime_t lowmem_trigger_time;
+
+static void lowmem_work_fn(struct work_struct *work);
+static DECLARE_WORK(lowmem_work, lowmem_work_fn);
+
+static int lowmem_bucket(int oom_score_adj)
+{
+	oom_score_adj = clamp(oom_score_adj, OOM_SCORE_ADJ_MIN,
+			      OOM_SCORE_ADJ_MAX);
+	return OOM_SCORE_ADJ_MAX - oom_score_adj;
+}
+
+static void lowmem_bucket_insert(struct task_struct *p)
+{
+	int bucket = lowmem_bucket(p->signal->oom_score_adj);
+
+	hlist_add_head(&p->lowmem_node, &lowmem_buckets[bucket]);
+	p->lowmem_bucket = bucket;
+	__set_bit(bucket, lowmem_bucket_map);
+}
+
+static void lowmem_bucket_erase(struct task_struct *p)
+{
+	hlist_del_init(&p->lowmem_node);
+	if (hlist_empty(&lowmem_buckets[p->lowmem_bucket]))
+		__clear_bit(p->lowmem_bucket, lowmem_bucket_map);
+}
+
+/*
+ * Returns the oom_score_adj above which processes may be killed with this
+ * much free memory, or OOM_SCORE_ADJ_MAX + 1 if memory is not low.
+ */
+static int lowmem_min_score_adj(int other_free, int other_file)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
+	int i;
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
@@ -83,98 +141,297 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_score_adj = lowmem_adj[i];
-			break;
-		}
+		    other_file < lowmem_minfree[i])
+			return lowmem_adj[i];
 	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
+	return OOM_SCORE_ADJ_MAX + 1;
+}
+
+static int lowmem_other_free(void)
+{
+	return global_page_state(NR_FREE_PAGES);
+}
+
+static int lowmem_other_file(void)
+{
+	return global_page_state(NR_FILE_PAGES) - global_page_state(NR_SHMEM);
+}
+
+static void lowmem_check(void)
+{
+	if (!lowmem_wq)
+		return;
+	if (lowmem_min_score_adj(lowmem_other_free(), lowmem_other_file()) >
+	    OOM_SCORE_ADJ_MAX)
+		return;
+	if (work_pending(&lowmem_work))
+		return;
+	lowmem_trigger_time = ktime_get();
+	queue_work(lowmem_wq, &lowmem_work);
+}
+
+/* the fork, exit and exec hooks run under write_lock_irq(&tasklist_lock) */
+void lowmem_task_add(struct task_struct *p)
+{
+	spin_lock(&lowmem_bucket_lock);
+	lowmem_bucket_insert(p);
+	spin_unlock(&lowmem_bucket_lock);
+}
+
+void lowmem_task_del(struct task_struct *p)
+{
+	bool recheck = false;
+
+	spin_lock(&lowmem_bucket_lock);
+	if (!hlist_unhashed(&p->lowmem_node))
+		lowmem_bucket_erase(p);
+	if (p == lowmem_deathpending) {
+		lowmem_deathpending = NULL;
+		recheck = true;
 	}
-	selected_oom_score_adj = min_score_adj;
+	spin_unlock(&lowmem_bucket_lock);
 
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	/* the victim is gone, see whether another one is needed */
+	if (recheck)
+		lowmem_check();
+}
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+/* de_thread() made @new the leader of @old's thread group */
+void lowmem_task_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_bucket_lock);
+	if (!hlist_unhashed(&old->lowmem_node)) {
+		lowmem_bucket_erase(old);
+		lowmem_bucket_insert(new);
+	}
+	if (old == lowmem_deathpending)
+		lowmem_deathpending = new;
+	spin_unlock(&lowmem_bucket_lock);
+}
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+void lowmem_task_adj_changed(struct task_struct *p)
+{
+	unsigned long flags;
 
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	p = p->group_leader;
+	if (!hlist_unhashed(&p->lowmem_node) &&
+	    p->lowmem_bucket != lowmem_bucket(p->signal->oom_score_adj)) {
+		lowmem_bucket_erase(p);
+		lowmem_bucket_insert(p);
+	}
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+}
+
+/*
+ * Called by the page allocator, possibly from atomic context, when it wakes
+ * kswapd because a zone is below its low watermark.
+ */
+void lowmem_watermark_low(void)
+{
+	lowmem_check();
+}
+
+/*
+ * System-wide memory pressure from reclaim. The minfree thresholds still
+ * decide whether anything is killed, this only makes sure they are looked
+ * at while reclaim is struggling.
+ */
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long level, void *data)
+{
+	lowmem_check();
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notify,
+};
+
+/* Returns the resident size of @p's mm, or 0 if it has none. */
+static int lowmem_task_size(struct task_struct *p)
+{
+	struct task_struct *t;
+	int tasksize = 0;
+
+	t = find_lock_task_mm(p);
+	if (t) {
+		tasksize = get_mm_rss(t->mm);
+		task_unlock(t);
+	}
+
+	return tasksize;
+}
+
+/* tasks taken off a bucket per trip under lowmem_bucket_lock */
+#define LOWMEM_BATCH	16
+
+/*
+ * Picks the largest process in the highest non-empty bucket at or above
+ * @min_score_adj, and returns it with a reference held. Candidates are
+ * taken off the buckets a batch at a time under lowmem_bucket_lock, and
+ * sized once it is dropped. A batch resumes after the last task of the
+ * previous one, unless that task has left the bucket meanwhile, in which
+ * case the rest of the bucket is skipped.
+ */
+static struct task_struct *lowmem_select(int min_score_adj,
+					 int *selected_tasksize,
+					 int *selected_oom_score_adj,
+					 int *buckets, int *tasks)
+{
+	struct task_struct *batch[LOWMEM_BATCH];
+	struct task_struct *selected = NULL, *cursor = NULL;
+	int last = lowmem_bucket(min_score_adj) + 1;
+	int bucket = 0;
+	unsigned long flags;
+
+	while (!selected || cursor) {
+		struct hlist_node *node;
+		int oom_score_adj;
+		int i, n = 0;
+
+		spin_lock_irqsave(&lowmem_bucket_lock, flags);
+		if (cursor) {
+			node = NULL;
+			if (!hlist_unhashed(&cursor->lowmem_node) &&
+			    cursor->lowmem_bucket == bucket)
+				node = cursor->lowmem_node.next;
+		} else {
+			bucket = find_next_bit(lowmem_bucket_map, last, bucket);
+			if (bucket >= last) {
+				spin_unlock_irqrestore(&lowmem_bucket_lock,
+						       flags);
+				break;
+			}
+			(*buckets)++;
+			node = lowmem_buckets[bucket].first;
 		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
+		for (; node && n < LOWMEM_BATCH; node = node->next) {
+			struct task_struct *p = hlist_entry(node,
+					struct task_struct, lowmem_node);
+
+			(*tasks)++;
+			if (p->flags & PF_KTHREAD)
 				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
+			get_task_struct(p);
+			batch[n++] = p;
+		}
+		spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+
+		oom_score_adj = OOM_SCORE_ADJ_MAX - bucket;
+		if (cursor)
+			put_task_struct(cursor);
+		cursor = NULL;
+		if (node) {
+			cursor = batch[n - 1];
+			get_task_struct(cursor);
+		} else {
+			bucket++;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct task_struct *p = batch[i];
+			int tasksize = lowmem_task_size(p);
+
+			if (tasksize <= 0 ||
+			    (selected && tasksize <= *selected_tasksize)) {
+				put_task_struct(p);
 				continue;
+			}
+			if (selected)
+				put_task_struct(selected);
+			selected = p;
+			*selected_tasksize = tasksize;
+			*selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_score_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
 	}
+	return selected;
+}
+
+static bool lowmem_death_pending(void)
+{
+	return lowmem_deathpending &&
+	       time_before_eq(jiffies, lowmem_deathpending_timeout);
+}
+
+static void lowmem_work_fn(struct work_struct *work)
+{
+	struct task_struct *selected;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj = 0;
+	int buckets = 0, tasks = 0;
+	int other_free = lowmem_other_free();
+	int other_file = lowmem_other_file();
+	int min_score_adj = lowmem_min_score_adj(other_free, other_file);
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	bool pending;
+
+	lowmem_print(3, "lowmem_work ofree %d %d, ma %d\n",
+		     other_free, other_file, min_score_adj);
+	if (min_score_adj == OOM_SCORE_ADJ_MAX + 1)
+		return;
+
+	spin_lock_irqsave(&lowmem_bucket_lock, flags);
+	pending = lowmem_death_pending();
+	spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+	if (pending)
+		return;
+
+	selected = lowmem_select(min_score_adj, &selected_tasksize,
+				 &selected_oom_score_adj, &buckets, &tasks);
 	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_score_adj, selected_tasksize);
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+		/* the victim may have exited, or been replaced, meanwhile */
+		spin_lock_irqsave(&lowmem_bucket_lock, flags);
+		if (lowmem_death_pending() ||
+		    hlist_unhashed(&selected->lowmem_node)) {
+			spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+			put_task_struct(selected);
+			selected = NULL;
+		} else {
+			lowmem_deathpending = selected;
+			lowmem_deathpending_timeout = jiffies + HZ;
+			spin_unlock_irqrestore(&lowmem_bucket_lock, flags);
+		}
 	}
-	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
-		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
-	return rem;
-}
 
-static struct shrinker lowmem_shrinker = {
-	.shrink = lowmem_shrink,
-	.seeks = DEFAULT_SEEKS * 16
-};
+	trace_lowmem_select(min_score_adj, other_free, other_file,
+			    buckets, tasks,
+			    ktime_to_ns(ktime_sub(start, lowmem_trigger_time)),
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
+	if (!selected)
+		return;
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_score_adj, selected_tasksize);
+	trace_lowmem_kill(selected, selected_oom_score_adj, selected_tasksize);
+	send_sig(SIGKILL, selected, 0);
+	set_tsk_thread_flag(selected, TIF_MEMDIE);
+	put_task_struct(selected);
+}
 
 static int __init lowmem_init(void)
 {
-	register_shrinker(&lowmem_shrinker);
+	lowmem_wq = alloc_workqueue("lowmemorykiller",
+				    WQ_MEM_RECLAIM | WQ_HIGHPRI, 1);
+	if (!lowmem_wq)
+		return -ENOMEM;
+	register_vmpressure_notifier(&lowmem_vmpressure_nb);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
-	unregister_shrinker(&lowmem_shrinker);
+	struct workqueue_struct *wq = lowmem_wq;
+
+	unregister_vmpressure_notifier(&lowmem_vmpressure_nb);
+	lowmem_wq = NULL;
+	destroy_workqueue(wq);
 }
 
-module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
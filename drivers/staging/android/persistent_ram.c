@@ -20,10 +20,13 @@
 #include <linux/io.h>
 #include <linux/list.h>
 #include <linux/memblock.h>
+#include <linux/moduleparam.h>
+#include <linux/notifier.h>
 #include <linux/persistent_ram.h>
 #include <linux/rslib.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 struct persistent_ram_buffer {
 	uint32_t    sig;
@@ -36,6 +39,15 @@ struct persistent_ram_buffer {
 
 static __devinitdata LIST_HEAD(persistent_ram_list);
 
+/*
+ * Zones with deferred ECC, which the worker and the panic notifier bring up
+ * to date. Once the system panics, writes compute their ECC right away.
+ */
+static LIST_HEAD(persistent_ram_deferred_list);
+static bool persistent_ram_ecc_sync;
+static unsigned int persistent_ram_ecc_delay_ms = 1000;
+module_param_named(ecc_delay_ms, persistent_ram_ecc_delay_ms, uint, 0644);
+
 static inline size_t buffer_size(struct persistent_ram_zone *prz)
 {
 	return atomic_read(&prz->buffer->size);
@@ -104,41 +116,189 @@ static int persistent_ram_decode_rs8(struct persistent_ram_zone *prz,
 				NULL, 0, NULL, 0, NULL);
 }
 
+static void notrace persistent_ram_encode_block(struct persistent_ram_zone *prz,
+	unsigned int block)
+{
+	struct persistent_ram_buffer *buffer = prz->buffer;
+	uint8_t *data = buffer->data + block * prz->ecc_block_size;
+	uint8_t *par = (uint8_t *)prz->par_buffer + block * prz->ecc_size;
+	size_t size = prz->ecc_block_size;
+
+	if (data + size > buffer->data + prz->buffer_size)
+		size = buffer->data + prz->buffer_size - data;
+	persistent_ram_encode_rs8(prz, data, size, par);
+}
+
 static void notrace persistent_ram_update_ecc(struct persistent_ram_zone *prz,
 	unsigned int start, unsigned int count)
+{
+	unsigned int block;
+
+	if (!prz->ecc || !count)
+		return;
+
+	for (block = start / prz->ecc_block_size;
+	     block <= (start + count - 1) / prz->ecc_block_size; block++)
+		persistent_ram_encode_block(prz, block);
+}
+
+static void notrace persistent_ram_update_header_ecc(struct persistent_ram_zone *prz)
 {
 	struct persistent_ram_buffer *buffer = prz->buffer;
-	uint8_t *buffer_end = buffer->data + prz->buffer_size;
-	uint8_t *block;
-	uint8_t *par;
-	int ecc_block_size = prz->ecc_block_size;
-	int ecc_size = prz->ecc_size;
-	int size = prz->ecc_block_size;
 
 	if (!prz->ecc)
 		return;
 
-	block = buffer->data + (start & ~(ecc_block_size - 1));
-	par = prz->par_buffer + (start / ecc_block_size) * prz->ecc_size;
+	persistent_ram_encode_rs8(prz, (uint8_t *)buffer, sizeof(*buffer),
+				  (uint8_t *)prz->par_header);
+}
 
-	do {
-		if (block + ecc_block_size > buffer_end)
-			size = buffer_end - block;
-		persistent_ram_encode_rs8(prz, block, size, par);
-		block += ecc_block_size;
-		par += ecc_size;
-	} while (block < buffer->data + start + count);
+static inline bool persistent_ram_defer_ecc(struct persistent_ram_zone *prz)
+{
+	return prz->ecc_dirty && likely(!persistent_ram_ecc_sync) &&
+		!oops_in_progress;
+}
+
+/*
+ * With deferred ECC a written block is marked dirty, and its parity is
+ * zeroed the first time so that a reset before the worker gets to it does
+ * not leave parity that "corrects" the new data back to the old. Writers
+ * mark the blocks both before and after copying in, because the worker may
+ * clear a bit while the copy is in progress; see
+ * persistent_ram_flush_block() for how the worker copes with that.
+ */
+static void notrace persistent_ram_mark_dirty(struct persistent_ram_zone *prz,
+	unsigned int block, char *par)
+{
+	if (test_bit(block, prz->ecc_dirty))
+		return;
+	if (!test_and_set_bit(block, prz->ecc_dirty))
+		memset(par, 0, prz->ecc_size);
+}
+
+static void notrace persistent_ram_dirty_ecc(struct persistent_ram_zone *prz,
+	unsigned int start, unsigned int count)
+{
+	unsigned int block;
+
+	if (!count)
+		return;
+
+	for (block = start / prz->ecc_block_size;
+	     block <= (start + count - 1) / prz->ecc_block_size; block++)
+		persistent_ram_mark_dirty(prz, block,
+				prz->par_buffer + block * prz->ecc_size);
 }
 
-static void persistent_ram_update_header_ecc(struct persistent_ram_zone *prz)
+static void notrace persistent_ram_dirty_header_ecc(struct persistent_ram_zone *prz)
+{
+	persistent_ram_mark_dirty(prz, prz->ecc_blocks, prz->par_header);
+}
+
+/*
+ * Encode a dirty block whose bit has just been cleared. Writers are not
+ * excluded, so the parity is computed from a snapshot, and kept only if
+ * the block still matches the snapshot and was not marked dirty again.
+ * Otherwise the parity is left zeroed, as the writer marking the block
+ * zeroed it, and the next flush encodes the block.
+ */
+static void persistent_ram_flush_block(struct persistent_ram_zone *prz,
+	unsigned int block)
 {
 	struct persistent_ram_buffer *buffer = prz->buffer;
+	uint8_t snap[prz->ecc_block_size];	/* the header fits too */
+	uint8_t par[prz->ecc_size];
+	uint8_t *data, *ecc;
+	size_t size;
+
+	if (block == prz->ecc_blocks) {
+		data = (uint8_t *)buffer;
+		size = sizeof(*buffer);
+		ecc = (uint8_t *)prz->par_header;
+	} else {
+		data = buffer->data + block * prz->ecc_block_size;
+		size = min_t(size_t, prz->ecc_block_size,
+			     buffer->data + prz->buffer_size - data);
+		ecc = (uint8_t *)prz->par_buffer + block * prz->ecc_size;
+	}
 
-	if (!prz->ecc)
+	memcpy(snap, data, size);
+	persistent_ram_encode_rs8(prz, snap, size, par);
+	smp_mb();
+	if (memcmp(snap, data, size) || test_bit(block, prz->ecc_dirty))
 		return;
 
-	persistent_ram_encode_rs8(prz, (uint8_t *)buffer, sizeof(*buffer),
-				  prz->par_header);
+	memcpy(ecc, par, prz->ecc_size);
+	/*
+	 * A writer that marked the block before the check above zeroed the
+	 * parity first, and then it was overwritten here.
+	 */
+	smp_mb();
+	if (test_bit(block, prz->ecc_dirty))
+		memset(ecc, 0, prz->ecc_size);
+}
+
+/* Computes the ECC of every block written since the last call. */
+static void persistent_ram_flush_ecc(struct persistent_ram_zone *prz)
+{
+	unsigned int block;
+
+	for_each_set_bit(block, prz->ecc_dirty, prz->ecc_blocks + 1) {
+		if (!test_and_clear_bit(block, prz->ecc_dirty))
+			continue;
+		persistent_ram_flush_block(prz, block);
+	}
+}
+
+static void persistent_ram_flush_zone(struct persistent_ram_zone *prz)
+{
+	int i;
+
+	if (!prz->sub) {
+		persistent_ram_flush_ecc(prz);
+		return;
+	}
+	for (i = 0; i < prz->nr_sub; i++)
+		persistent_ram_flush_ecc(&prz->sub[i]);
+}
+
+static void persistent_ram_ecc_work(struct work_struct *work)
+{
+	struct persistent_ram_zone *prz = container_of(to_delayed_work(work),
+				struct persistent_ram_zone, ecc_work);
+
+	persistent_ram_flush_zone(prz);
+	schedule_delayed_work(&prz->ecc_work,
+			      msecs_to_jiffies(persistent_ram_ecc_delay_ms));
+}
+
+static int persistent_ram_panic(struct notifier_block *nb,
+	unsigned long event, void *unused)
+{
+	struct persistent_ram_zone *prz;
+
+	persistent_ram_ecc_sync = true;
+	smp_mb();
+	list_for_each_entry(prz, &persistent_ram_deferred_list, node)
+		persistent_ram_flush_zone(prz);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block persistent_ram_panic_nb = {
+	.notifier_call = persistent_ram_panic,
+};
+
+/* Parity that was zeroed for a write whose ECC was never computed. */
+static bool persistent_ram_par_unset(const void *par, int ecc_size)
+{
+	const uint8_t *p = par;
+
+	while (ecc_size--) {
+		if (*p++)
+			return false;
+	}
+	return true;
 }
 
 static void persistent_ram_ecc_old(struct persistent_ram_zone *prz)
@@ -157,6 +317,12 @@ static void persistent_ram_ecc_old(struct persistent_ram_zone *prz)
 		int size = prz->ecc_block_size;
 		if (block + size > buffer->data + prz->buffer_size)
 			size = buffer->data + prz->buffer_size - block;
+		if (persistent_ram_par_unset(par, prz->ecc_size)) {
+			prz->unset_blocks++;
+			block += prz->ecc_block_size;
+			par += prz->ecc_size;
+			continue;
+		}
 		numerr = persistent_ram_decode_rs8(prz, block, size, par);
 		if (numerr > 0) {
 			pr_devel("persistent_ram: error in block %p, %d\n",
@@ -173,7 +339,7 @@ static void persistent_ram_ecc_old(struct persistent_ram_zone *prz)
 }
 
 static int persistent_ram_init_ecc(struct persistent_ram_zone *prz,
-	size_t buffer_size)
+	size_t buffer_size, bool deferred)
 {
 	int numerr;
 	struct persistent_ram_buffer *buffer = prz->buffer;
@@ -198,6 +364,15 @@ static int persistent_ram_init_ecc(struct persistent_ram_zone *prz,
 
 	prz->par_buffer = buffer->data + prz->buffer_size;
 	prz->par_header = prz->par_buffer + ecc_blocks * prz->ecc_size;
+	prz->ecc_blocks = ecc_blocks;
+
+	if (deferred) {
+		/* one bit per block, and one for the header */
+		prz->ecc_dirty = kcalloc(BITS_TO_LONGS(ecc_blocks + 1),
+					 sizeof(long), GFP_KERNEL);
+		if (!prz->ecc_dirty)
+			return -ENOMEM;
+	}
 
 	/*
 	 * first consecutive root is 0
@@ -212,6 +387,12 @@ static int persistent_ram_init_ecc(struct persistent_ram_zone *prz,
 
 	prz->corrected_bytes = 0;
 	prz->bad_blocks = 0;
+	prz->unset_blocks = 0;
+
+	if (persistent_ram_par_unset(prz->par_header, prz->ecc_size)) {
+		pr_info("persistent_ram: no ECC for header\n");
+		return 0;
+	}
 
 	numerr = persistent_ram_decode_rs8(prz, buffer, sizeof(*buffer),
 					   prz->par_header);
@@ -229,14 +410,31 @@ static int persistent_ram_init_ecc(struct persistent_ram_zone *prz,
 ssize_t persistent_ram_ecc_string(struct persistent_ram_zone *prz,
 	char *str, size_t len)
 {
+	int corrected_bytes = prz->corrected_bytes;
+	int bad_blocks = prz->bad_blocks;
+	int unset_blocks = prz->unset_blocks;
 	ssize_t ret;
+	int i;
 
-	if (prz->corrected_bytes || prz->bad_blocks)
+	for (i = 0; i < prz->nr_sub; i++) {
+		corrected_bytes += prz->sub[i].corrected_bytes;
+		bad_blocks += prz->sub[i].bad_blocks;
+		unset_blocks += prz->sub[i].unset_blocks;
+	}
+
+	if (corrected_bytes || bad_blocks)
 		ret = snprintf(str, len, ""
 			"\n%d Corrected bytes, %d unrecoverable blocks\n",
-			prz->corrected_bytes, prz->bad_blocks);
+			corrected_bytes, bad_blocks);
 	else
 		ret = snprintf(str, len, "\nNo errors detected\n");
+	if (unset_blocks) {
+		size_t off = min_t(size_t, ret, len);
+
+		ret += snprintf(str ? str + off : NULL, len - off,
+			"%d blocks written after their last ECC update\n",
+			unset_blocks);
+	}
 
 	return ret;
 }
@@ -245,6 +443,13 @@ static void notrace persistent_ram_update(struct persistent_ram_zone *prz,
 	const void *s, unsigned int start, unsigned int count)
 {
 	struct persistent_ram_buffer *buffer = prz->buffer;
+
+	if (persistent_ram_defer_ecc(prz)) {
+		persistent_ram_dirty_ecc(prz, start, count);
+		memcpy(buffer->data + start, s, count);
+		persistent_ram_dirty_ecc(prz, start, count);
+		return;
+	}
 	memcpy(buffer->data + start, s, count);
 	persistent_ram_update_ecc(prz, start, count);
 }
@@ -278,11 +483,18 @@ int notrace persistent_ram_write(struct persistent_ram_zone *prz,
 	int c = count;
 	size_t start;
 
+	/* concurrent writers on different CPUs don't share a ring */
+	if (prz->cpu_sub)
+		prz = prz->cpu_sub[raw_smp_processor_id()];
+
 	if (unlikely(c > prz->buffer_size)) {
 		s += c - prz->buffer_size;
 		c = prz->buffer_size;
 	}
 
+	if (persistent_ram_defer_ecc(prz))
+		persistent_ram_dirty_header_ecc(prz);
+
 	buffer_size_add(prz, c);
 
 	start = buffer_start_add(prz, c);
@@ -296,7 +508,10 @@ int notrace persistent_ram_write(struct persistent_ram_zone *prz,
 	}
 	persistent_ram_update(prz, s, start, c);
 
-	persistent_ram_update_header_ecc(prz);
+	if (persistent_ram_defer_ecc(prz))
+		persistent_ram_dirty_header_ecc(prz);
+	else
+		persistent_ram_update_header_ecc(prz);
 
 	return count;
 }
@@ -378,30 +593,24 @@ static int __devinit persistent_ram_buffer_init(const char *name,
 	return -EINVAL;
 }
 
-static  __devinit
-struct persistent_ram_zone *__persistent_ram_init(struct device *dev, bool ecc)
+/*
+ * Sets up the ring in prz->buffer: its ECC, and whatever the last boot left
+ * in it. If @record_size is set, the ring holds a whole number of records
+ * so that its old contents start at a record.
+ */
+static int __devinit persistent_ram_setup(struct persistent_ram_zone *prz,
+		unsigned int flags, size_t record_size)
 {
-	struct persistent_ram_zone *prz;
-	int ret = -ENOMEM;
-
-	prz = kzalloc(sizeof(struct persistent_ram_zone), GFP_KERNEL);
-	if (!prz) {
-		pr_err("persistent_ram: failed to allocate persistent ram zone\n");
-		goto err;
-	}
-
-	INIT_LIST_HEAD(&prz->node);
-
-	ret = persistent_ram_buffer_init(dev_name(dev), prz);
-	if (ret) {
-		pr_err("persistent_ram: failed to initialize buffer\n");
-		goto err;
-	}
+	int ret;
 
-	prz->ecc = ecc;
-	ret = persistent_ram_init_ecc(prz, prz->buffer_size);
+	prz->ecc = flags & PERSISTENT_RAM_ECC;
+	ret = persistent_ram_init_ecc(prz, prz->buffer_size,
+				      flags & PERSISTENT_RAM_ECC_DEFERRED);
 	if (ret)
-		goto err;
+		return ret;
+
+	if (record_size)
+		prz->buffer_size -= prz->buffer_size % record_size;
 
 	if (prz->buffer->sig == PERSISTENT_RAM_SIG) {
 		if (buffer_size(prz) > prz->buffer_size ||
@@ -424,16 +633,157 @@ struct persistent_ram_zone *__persistent_ram_init(struct device *dev, bool ecc)
 	atomic_set(&prz->buffer->start, 0);
 	atomic_set(&prz->buffer->size, 0);
 
+	return 0;
+}
+
+/*
+ * Splits the zone's buffer into one ring per possible CPU, each with its
+ * own header and ECC. The old contents of the rings are concatenated, in
+ * CPU order.
+ */
+static int __devinit persistent_ram_setup_percpu(struct persistent_ram_zone *prz,
+		unsigned int flags, size_t record_size)
+{
+	size_t chunk;
+	size_t old_size = 0;
+	int cpu, i = 0;
+	int ret;
+
+	prz->nr_sub = num_possible_cpus();
+	chunk = (prz->buffer_size + sizeof(struct persistent_ram_buffer)) /
+		prz->nr_sub;
+	chunk &= ~(sizeof(long) - 1);
+	if (chunk <= sizeof(struct persistent_ram_buffer) + record_size) {
+		pr_err("persistent_ram: %zu bytes is too small to share "
+		       "between %d cpus\n", prz->buffer_size, prz->nr_sub);
+		return -EINVAL;
+	}
+
+	prz->sub = kcalloc(prz->nr_sub, sizeof(*prz->sub), GFP_KERNEL);
+	prz->cpu_sub = kcalloc(nr_cpu_ids, sizeof(*prz->cpu_sub), GFP_KERNEL);
+	if (!prz->sub || !prz->cpu_sub)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct persistent_ram_zone *sub = &prz->sub[i];
+
+		INIT_LIST_HEAD(&sub->node);
+		sub->buffer = (void *)prz->buffer + i * chunk;
+		sub->buffer_size = chunk - sizeof(struct persistent_ram_buffer);
+		ret = persistent_ram_setup(sub, flags, record_size);
+		if (ret)
+			return ret;
+		old_size += sub->old_log_size;
+		prz->cpu_sub[cpu] = sub;
+		i++;
+	}
+
+	if (old_size) {
+		prz->old_log = kmalloc(old_size, GFP_KERNEL);
+		if (!prz->old_log)
+			pr_err("persistent_ram: failed to allocate buffer\n");
+	}
+	for (i = 0; i < prz->nr_sub; i++) {
+		struct persistent_ram_zone *sub = &prz->sub[i];
+
+		if (prz->old_log)
+			memcpy(prz->old_log + prz->old_log_size, sub->old_log,
+			       sub->old_log_size);
+		prz->old_log_size += prz->old_log ? sub->old_log_size : 0;
+		persistent_ram_free_old(sub);
+	}
+
+	return 0;
+}
+
+static void persistent_ram_free_zone(struct persistent_ram_zone *prz)
+{
+	int i;
+
+	for (i = 0; i < prz->nr_sub; i++) {
+		kfree(prz->sub[i].ecc_dirty);
+		kfree(prz->sub[i].old_log);
+	}
+	kfree(prz->sub);
+	kfree(prz->cpu_sub);
+	kfree(prz->ecc_dirty);
+	kfree(prz->old_log);
+	kfree(prz);
+}
+
+static  __devinit
+struct persistent_ram_zone *__persistent_ram_init(struct device *dev,
+		unsigned int flags, size_t record_size)
+{
+	struct persistent_ram_zone *prz;
+	int ret = -ENOMEM;
+
+	prz = kzalloc(sizeof(struct persistent_ram_zone), GFP_KERNEL);
+	if (!prz) {
+		pr_err("persistent_ram: failed to allocate persistent ram zone\n");
+		goto err;
+	}
+
+	INIT_LIST_HEAD(&prz->node);
+
+	ret = persistent_ram_buffer_init(dev_name(dev), prz);
+	if (ret) {
+		pr_err("persistent_ram: failed to initialize buffer\n");
+		goto err;
+	}
+
+	if (!(flags & PERSISTENT_RAM_ECC))
+		flags &= ~PERSISTENT_RAM_ECC_DEFERRED;
+	prz->ecc = flags & PERSISTENT_RAM_ECC;
+
+	if ((flags & PERSISTENT_RAM_PERCPU) && num_possible_cpus() > 1)
+		ret = persistent_ram_setup_percpu(prz, flags, record_size);
+	else
+		ret = persistent_ram_setup(prz, flags, record_size);
+	if (ret)
+		goto err;
+
+	if (flags & PERSISTENT_RAM_ECC_DEFERRED) {
+		if (list_empty(&persistent_ram_deferred_list))
+			atomic_notifier_chain_register(&panic_notifier_list,
+						&persistent_ram_panic_nb);
+		list_add_tail(&prz->node, &persistent_ram_deferred_list);
+		INIT_DELAYED_WORK_DEFERRABLE(&prz->ecc_work,
+					     persistent_ram_ecc_work);
+		schedule_delayed_work(&prz->ecc_work,
+				msecs_to_jiffies(persistent_ram_ecc_delay_ms));
+	}
+
 	return prz;
 err:
-	kfree(prz);
+	if (prz)
+		persistent_ram_free_zone(prz);
 	return ERR_PTR(ret);
 }
 
 struct persistent_ram_zone * __devinit
 persistent_ram_init_ringbuffer(struct device *dev, bool ecc)
 {
-	return __persistent_ram_init(dev, ecc);
+	return __persistent_ram_init(dev, ecc ? PERSISTENT_RAM_ECC : 0, 0);
+}
+
+/**
+ * persistent_ram_init_ringbuffer_flags - set up a persistent ram zone
+ * @dev:	device whose name is the zone's descriptor name
+ * @flags:	PERSISTENT_RAM_* flags
+ * @record_size: size of the fixed-size records written to the zone, or 0
+ *
+ * PERSISTENT_RAM_ECC_DEFERRED computes ECC for written blocks from a
+ * worker, or at panic, instead of on every write. PERSISTENT_RAM_PERCPU
+ * gives each CPU a ring of its own. The old contents of per-CPU zones are
+ * ordered by CPU first, so they only make sense for fixed-size records,
+ * and @record_size keeps each CPU's part aligned to them.
+ */
+struct persistent_ram_zone * __devinit
+persistent_ram_init_ringbuffer_flags(struct device *dev, unsigned int flags,
+		size_t record_size)
+{
+	return __persistent_ram_init(dev, flags, record_size);
 }
 
 int __init persistent_ram_early_init(struct persistent_ram *ram)
@@ -0,0 +1,72 @@
+#undef TRACE_SYSTEM
+#define TRACE_INCLUDE_PATH ../../drivers/staging/android/trace
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_score_adj, int other_free, int other_file,
+		 int buckets, int tasks, s64 wait_ns, s64 select_ns),
+
+	TP_ARGS(min_score_adj, other_free, other_file, buckets, tasks,
+		wait_ns, select_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	min_score_adj	)
+		__field(	int,	other_free	)
+		__field(	int,	other_file	)
+		__field(	int,	buckets		)
+		__field(	int,	tasks		)
+		__field(	s64,	wait_ns		)
+		__field(	s64,	select_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->min_score_adj	= min_score_adj;
+		__entry->other_free	= other_free;
+		__entry->other_file	= other_file;
+		__entry->buckets	= buckets;
+		__entry->tasks		= tasks;
+		__entry->wait_ns	= wait_ns;
+		__entry->select_ns	= select_ns;
+	),
+
+	TP_printk("min_score_adj=%d free=%d file=%d buckets=%d tasks=%d wait=%lldns select=%lldns",
+		__entry->min_score_adj, __entry->other_free,
+		__entry->other_file, __entry->buckets, __entry->tasks,
+		__entry->wait_ns, __entry->select_ns)
+);
+
+TRACE_EVENT(lowmem_kill,
+
+	TP_PROTO(struct task_struct *task, int oom_score_adj, int tasksize),
+
+	TP_ARGS(task, oom_score_adj, tasksize),
+
+	TP_STRUCT__entry(
+		__field(	pid_t,	pid			)
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	int,	oom_score_adj		)
+		__field(	int,	tasksize		)
+	),
+
+	TP_fast_assign(
+		__entry->pid = task->pid;
+		memcpy(__entry->comm, task->comm, TASK_COMM_LEN);
+		__entry->oom_score_adj = oom_score_adj;
+		__entry->tasksize = tasksize;
+	),
+
+	TP_printk("pid=%d comm=%s oom_score_adj=%d size=%d",
+		__entry->pid, __entry->comm, __entry->oom_score_adj,
+		__entry->tasksize)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
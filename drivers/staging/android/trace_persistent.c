@@ -207,7 +207,13 @@ static int __devinit persistent_trace_probe(struct platform_device *pdev)
 	struct dentry *d;
 	int ret;
 
-	persistent_trace = persistent_ram_init_ringbuffer(&pdev->dev, false);
+	/*
+	 * Every traced function lands here, so keep writers on their own CPU's
+	 * ring and leave the ECC to the persistent_ram worker.
+	 */
+	persistent_trace = persistent_ram_init_ringbuffer_flags(&pdev->dev,
+			PERSISTENT_RAM_ECC | PERSISTENT_RAM_ECC_DEFERRED |
+			PERSISTENT_RAM_PERCPU, REC_SIZE);
 	if (IS_ERR(persistent_trace)) {
 		pr_err("persistent_trace: failed to init ringbuffer: %ld\n",
 				PTR_ERR(persistent_trace));
@@ -43,6 +43,11 @@ static struct dmm *omap_dmm;
 /* global spinlock for protecting lists */
 static DEFINE_SPINLOCK(list_lock);
 
+MODULE_PARM_DESC(sita, "Use the SiTA container manager instead of the row "
+		 "bitmap one (default 'n')");
+static bool sita_enabled;
+module_param_named(sita, sita_enabled, bool, 0444);
+
 /* Geometry table */
 #define GEOM(xshift, yshift, bytes_per_pixel) { \
 		.x_shft = (xshift), \
@@ -711,9 +716,14 @@ static int omap_dmm_probe(struct platform_device *dev)
 
 	/* init containers */
 	for (i = 0; i < omap_dmm->num_lut; i++) {
-		omap_dmm->tcm[i] = sita_init(omap_dmm->container_width,
-						omap_dmm->container_height,
-						NULL);
+		if (sita_enabled)
+			omap_dmm->tcm[i] = sita_init(omap_dmm->container_width,
+						     omap_dmm->container_height,
+						     NULL);
+		else
+			omap_dmm->tcm[i] = bitmap_init(omap_dmm->container_width,
+						       omap_dmm->container_height,
+						       NULL);
 
 		if (!omap_dmm->tcm[i]) {
 			dev_err(&dev->dev, "failed to allocate container\n");
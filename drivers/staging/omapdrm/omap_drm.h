@@ -41,6 +41,7 @@ struct drm_omap_get_base {
 
 #define OMAP_BO_SCANOUT		0x00000001	/* scanout capable (phys contiguous) */
 #define OMAP_BO_CACHE_MASK	0x00000006	/* cache type mask, see cache modes */
+#define OMAP_BO_CPU_SYNC	0x00000008	/* cached, cpu access bracketed by cpu_prep/cpu_fini */
 #define OMAP_BO_TILED_MASK	0x00000f00	/* tiled mapping mask, see tiled modes */
 
 /* cache modes */
@@ -75,20 +76,31 @@ enum omap_gem_op {
 	OMAP_GEM_WRITE = 0x02,
 };
 
+/* a byte range of a buffer which the CPU accesses: */
+struct drm_omap_gem_region {
+	uint32_t offset;
+	uint32_t size;
+};
+
+/* For OMAP_BO_CPU_SYNC buffers, cpu_prep and cpu_fini do the cache
+ * maintenance for the pages covered by the passed regions, or for the
+ * whole buffer if nregions is zero.  Userspace which predates regions
+ * passes a shorter struct, which reads as nregions == 0.
+ */
 struct drm_omap_gem_cpu_prep {
 	uint32_t handle;		/* buffer handle (in) */
 	uint32_t op;			/* mask of omap_gem_op (in) */
+	uint32_t nregions;		/* # of regions (in) */
+	uint32_t __pad;
+	uint64_t regions;		/* ptr to drm_omap_gem_region[] (in) */
 };
 
 struct drm_omap_gem_cpu_fini {
 	uint32_t handle;		/* buffer handle (in) */
 	uint32_t op;			/* mask of omap_gem_op (in) */
-	/* TODO maybe here we pass down info about what regions are touched
-	 * by sw so we can be clever about cache ops?  For now a placeholder,
-	 * set to zero and we just do full buffer flush..
-	 */
-	uint32_t nregions;
+	uint32_t nregions;		/* # of regions (in) */
 	uint32_t __pad;
+	uint64_t regions;		/* ptr to drm_omap_gem_region[] (in) */
 };
 
 struct drm_omap_gem_info {
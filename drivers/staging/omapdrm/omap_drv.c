@@ -464,6 +464,33 @@ static int ioctl_gem_new(struct drm_device *dev, void *data,
 			args->flags, &args->handle);
 }
 
+/* apply a cpu_prep/cpu_fini cache op to each of the regions passed by
+ * userspace, or to the whole buffer if there are none
+ */
+static int gem_cpu_regions(struct drm_gem_object *obj, uint32_t op,
+		uint32_t nregions, uint64_t regions,
+		int (*fxn)(struct drm_gem_object *obj, enum omap_gem_op op,
+				uint32_t offset, uint32_t size))
+{
+	struct drm_omap_gem_region __user *uregions =
+			(void __user *)(unsigned long)regions;
+	struct drm_omap_gem_region region;
+	int i, ret;
+
+	if (!nregions)
+		return fxn(obj, op, 0, obj->size);
+
+	for (i = 0; i < nregions; i++) {
+		if (copy_from_user(&region, &uregions[i], sizeof(region)))
+			return -EFAULT;
+		ret = fxn(obj, op, region.offset, region.size);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static int ioctl_gem_cpu_prep(struct drm_device *dev, void *data,
 		struct drm_file *file_priv)
 {
@@ -480,6 +507,11 @@ static int ioctl_gem_cpu_prep(struct drm_device *dev, void *data,
 
 	ret = omap_gem_op_sync(obj, args->op);
 
+	if (!ret) {
+		ret = gem_cpu_regions(obj, args->op, args->nregions,
+				args->regions, omap_gem_cpu_prep);
+	}
+
 // TODO: need a way to kick sgx after omap_gem_op_finish() but for now
 // just disable this:
 //	if (!ret) {
@@ -505,8 +537,8 @@ static int ioctl_gem_cpu_fini(struct drm_device *dev, void *data,
 		return -ENOENT;
 	}
 
-	/* XXX flushy, flushy */
-	ret = 0;
+	ret = gem_cpu_regions(obj, args->op, args->nregions,
+			args->regions, omap_gem_cpu_fini);
 
 // TODO: need a way to kick sgx after omap_gem_op_finish() but for now
 // just disable this:
@@ -174,6 +174,10 @@ int omap_gem_roll(struct drm_gem_object *obj, uint32_t roll);
 void omap_gem_cpu_sync(struct drm_gem_object *obj, int pgoff);
 void omap_gem_dma_sync(struct drm_gem_object *obj,
 		enum dma_data_direction dir);
+int omap_gem_cpu_prep(struct drm_gem_object *obj, enum omap_gem_op op,
+		uint32_t offset, uint32_t size);
+int omap_gem_cpu_fini(struct drm_gem_object *obj, enum omap_gem_op op,
+		uint32_t offset, uint32_t size);
 int omap_gem_get_paddr(struct drm_gem_object *obj,
 		dma_addr_t *paddr, bool remap);
 int omap_gem_put_paddr(struct drm_gem_object *obj);
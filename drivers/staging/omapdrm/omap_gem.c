@@ -89,6 +89,14 @@ struct omap_gem_object {
 	/** addresses corresponding to pages in above array */
 	dma_addr_t *addrs;
 
+	/**
+	 * For cached buffers, pages which the CPU may have dirtied in the
+	 * cache since the last time they were cleaned for DMA.  Without
+	 * OMAP_BO_CPU_SYNC these are the pages faulted in since the last
+	 * omap_gem_dma_sync(), with it the pages prepped for write.
+	 */
+	unsigned long *dirty;
+
 	/**
 	 * Virtual address, if mapped.
 	 */
@@ -220,7 +228,8 @@ static inline bool is_shmem(struct drm_gem_object *obj)
 
 /**
  * shmem buffers that are mapped cached can simulate coherency via using
- * page faulting to keep track of dirty pages
+ * page faulting to keep track of dirty pages, or with OMAP_BO_CPU_SYNC
+ * leave it to userspace to tell which pages it touches
  */
 static inline bool is_cached_coherent(struct drm_gem_object *obj)
 {
@@ -252,44 +261,57 @@ static int omap_gem_attach_pages(struct drm_gem_object *obj)
 		return PTR_ERR(pages);
 	}
 
-	/* for non-cached buffers, ensure the new pages are clean because
-	 * DSS, GPU, etc. are not cache coherent:
+	addrs = kmalloc(npages * sizeof(*addrs), GFP_KERNEL);
+	if (!addrs)
+		goto fail;
+
+	/* cached buffers start out with no dirty pages, the mapping below
+	 * cleans what shmem zeroed:
 	 */
-	if (omap_obj->flags & (OMAP_BO_WC|OMAP_BO_UNCACHED)) {
-		addrs = kmalloc(npages * sizeof(*addrs), GFP_KERNEL);
-		for (i = 0; i < npages; i++) {
-			addrs[i] = dma_map_page(dev->dev, pages[i],
-					0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	if (is_cached_coherent(obj)) {
+		omap_obj->dirty = kcalloc(BITS_TO_LONGS(npages),
+				sizeof(long), GFP_KERNEL);
+		if (!omap_obj->dirty) {
+			kfree(addrs);
+			goto fail;
 		}
-	} else {
-		addrs = kzalloc(npages * sizeof(*addrs), GFP_KERNEL);
+	}
+
+	/* ensure the new pages are clean because DSS, GPU, etc. are not
+	 * cache coherent:
+	 */
+	for (i = 0; i < npages; i++) {
+		addrs[i] = dma_map_page(dev->dev, pages[i],
+				0, PAGE_SIZE, DMA_BIDIRECTIONAL);
 	}
 
 	omap_obj->addrs = addrs;
 	omap_obj->pages = pages;
 
 	return 0;
+
+fail:
+	_drm_gem_put_pages(obj, pages, false, false);
+	return -ENOMEM;
 }
 
 /** release backing pages */
 static void omap_gem_detach_pages(struct drm_gem_object *obj)
 {
 	struct omap_gem_object *omap_obj = to_omap_bo(obj);
+	int i, npages = obj->size >> PAGE_SHIFT;
 
-	/* for non-cached buffers, ensure the new pages are clean because
-	 * DSS, GPU, etc. are not cache coherent:
-	 */
-	if (omap_obj->flags & (OMAP_BO_WC|OMAP_BO_UNCACHED)) {
-		int i, npages = obj->size >> PAGE_SHIFT;
-		for (i = 0; i < npages; i++) {
-			dma_unmap_page(obj->dev->dev, omap_obj->addrs[i],
-					PAGE_SIZE, DMA_BIDIRECTIONAL);
-		}
+	for (i = 0; i < npages; i++) {
+		dma_unmap_page(obj->dev->dev, omap_obj->addrs[i],
+				PAGE_SIZE, DMA_BIDIRECTIONAL);
 	}
 
 	kfree(omap_obj->addrs);
 	omap_obj->addrs = NULL;
 
+	kfree(omap_obj->dirty);
+	omap_obj->dirty = NULL;
+
 	_drm_gem_put_pages(obj, omap_obj->pages, true, false);
 	omap_obj->pages = NULL;
 }
@@ -375,7 +397,9 @@ static int fault_1d(struct drm_gem_object *obj,
 			vma->vm_start) >> PAGE_SHIFT;
 
 	if (omap_obj->pages) {
-		omap_gem_cpu_sync(obj, pgoff);
+		/* with explicit sync, userspace does its own cache ops */
+		if (!(omap_obj->flags & OMAP_BO_CPU_SYNC))
+			omap_gem_cpu_sync(obj, pgoff);
 		pfn = page_to_pfn(omap_obj->pages[pgoff]);
 	} else {
 		BUG_ON(!(omap_obj->flags & OMAP_BO_DMA));
@@ -718,10 +742,10 @@ void omap_gem_cpu_sync(struct drm_gem_object *obj, int pgoff)
 	struct drm_device *dev = obj->dev;
 	struct omap_gem_object *omap_obj = to_omap_bo(obj);
 
-	if (is_cached_coherent(obj) && omap_obj->addrs[pgoff]) {
-		dma_unmap_page(dev->dev, omap_obj->addrs[pgoff],
+	if (is_cached_coherent(obj) &&
+			!test_and_set_bit(pgoff, omap_obj->dirty)) {
+		dma_sync_single_for_cpu(dev->dev, omap_obj->addrs[pgoff],
 				PAGE_SIZE, DMA_BIDIRECTIONAL);
-		omap_obj->addrs[pgoff] = 0;
 	}
 }
 
@@ -732,24 +756,132 @@ void omap_gem_dma_sync(struct drm_gem_object *obj,
 	struct drm_device *dev = obj->dev;
 	struct omap_gem_object *omap_obj = to_omap_bo(obj);
 
-	if (is_cached_coherent(obj)) {
-		int i, npages = obj->size >> PAGE_SHIFT;
-		struct page **pages = omap_obj->pages;
-		bool dirty = false;
-
-		for (i = 0; i < npages; i++) {
-			if (!omap_obj->addrs[i]) {
-				omap_obj->addrs[i] = dma_map_page(dev->dev, pages[i], 0,
-						PAGE_SIZE, DMA_BIDIRECTIONAL);
-				dirty = true;
+	if (is_cached_coherent(obj) && omap_obj->dirty) {
+		int i, first, last, npages = obj->size >> PAGE_SHIFT;
+
+		/* only the runs of pages the CPU has touched need cleaning,
+		 * and only those need to be zapped from userspace so that
+		 * the next CPU access to them faults again:
+		 */
+		first = find_first_bit(omap_obj->dirty, npages);
+		while (first < npages) {
+			last = find_next_zero_bit(omap_obj->dirty, npages, first);
+
+			if (!(omap_obj->flags & OMAP_BO_CPU_SYNC)) {
+				unmap_mapping_range(obj->filp->f_mapping,
+						(loff_t)first << PAGE_SHIFT,
+						(loff_t)(last - first) << PAGE_SHIFT,
+						1);
+			}
+
+			for (i = first; i < last; i++) {
+				dma_sync_single_for_device(dev->dev,
+						omap_obj->addrs[i], PAGE_SIZE, dir);
 			}
+			bitmap_clear(omap_obj->dirty, first, last - first);
+
+			first = find_next_bit(omap_obj->dirty, npages, last);
+		}
+	}
+}
+
+/* check that a CPU access range is inside the buffer, and convert it
+ * to first and last page
+ */
+static int cpu_range(struct drm_gem_object *obj, uint32_t offset,
+		uint32_t size, int *first, int *last)
+{
+	if (offset >= obj->size || size > obj->size - offset)
+		return -EINVAL;
+
+	*first = offset >> PAGE_SHIFT;
+	*last = (offset + size - 1) >> PAGE_SHIFT;
+
+	return 0;
+}
+
+/*
+ * Explicit CPU access to OMAP_BO_CPU_SYNC buffers.  These stay mapped
+ * cached in userspace, which brackets its access with cpu_prep/cpu_fini
+ * and passes the ranges it touches, so cache maintenance is limited to
+ * those pages: prep invalidates the pages about to be read and marks the
+ * ones about to be written dirty, and fini cleans the dirty pages which
+ * were written.  Whatever is left dirty gets cleaned by
+ * omap_gem_dma_sync().
+ *
+ * For other buffers only the ranges are checked, cached ones keep
+ * relying on page faults to find out which pages the CPU touched.
+ */
+int omap_gem_cpu_prep(struct drm_gem_object *obj, enum omap_gem_op op,
+		uint32_t offset, uint32_t size)
+{
+	struct drm_device *dev = obj->dev;
+	struct omap_gem_object *omap_obj = to_omap_bo(obj);
+	struct page **pages;
+	int i, first, last, ret;
+
+	if (!size)
+		return 0;
+
+	ret = cpu_range(obj, offset, size, &first, &last);
+	if (ret || !(omap_obj->flags & OMAP_BO_CPU_SYNC))
+		return ret;
+
+	mutex_lock(&dev->struct_mutex);
+
+	ret = get_pages(obj, &pages);
+	if (ret)
+		goto fail;
+
+	for (i = first; i <= last; i++) {
+		/* a dirty page has not been handed to DMA since the CPU
+		 * last wrote it, so there is nothing stale in the cache:
+		 */
+		if ((op & OMAP_GEM_READ) && !test_bit(i, omap_obj->dirty)) {
+			dma_sync_single_for_cpu(dev->dev, omap_obj->addrs[i],
+					PAGE_SIZE, DMA_FROM_DEVICE);
 		}
+		if (op & OMAP_GEM_WRITE)
+			set_bit(i, omap_obj->dirty);
+	}
+
+fail:
+	mutex_unlock(&dev->struct_mutex);
 
-		if (dirty) {
-			unmap_mapping_range(obj->filp->f_mapping, 0,
-					omap_gem_mmap_size(obj), 1);
+	return ret;
+}
+
+int omap_gem_cpu_fini(struct drm_gem_object *obj, enum omap_gem_op op,
+		uint32_t offset, uint32_t size)
+{
+	struct drm_device *dev = obj->dev;
+	struct omap_gem_object *omap_obj = to_omap_bo(obj);
+	int i, first, last, ret;
+
+	if (!size)
+		return 0;
+
+	ret = cpu_range(obj, offset, size, &first, &last);
+	if (ret || !(omap_obj->flags & OMAP_BO_CPU_SYNC) ||
+			!(op & OMAP_GEM_WRITE))
+		return ret;
+
+	mutex_lock(&dev->struct_mutex);
+
+	/* no pages means nothing was prepped, so nothing is dirty */
+	if (omap_obj->pages) {
+		i = find_next_bit(omap_obj->dirty, last + 1, first);
+		while (i <= last) {
+			dma_sync_single_for_device(dev->dev, omap_obj->addrs[i],
+					PAGE_SIZE, DMA_TO_DEVICE);
+			clear_bit(i, omap_obj->dirty);
+			i = find_next_bit(omap_obj->dirty, last + 1, i + 1);
 		}
 	}
+
+	mutex_unlock(&dev->struct_mutex);
+
+	return 0;
 }
 
 /* Get physical address for DMA.. if 'remap' is true, and the buffer is not
@@ -1429,6 +1561,10 @@ struct drm_gem_object *omap_gem_new(struct drm_device *dev,
 		}
 	}
 
+	/* explicit cpu sync only applies to cached shmem buffers */
+	if (flags & (OMAP_BO_TILED | OMAP_BO_DMA | OMAP_BO_CACHE_MASK))
+		flags &= ~OMAP_BO_CPU_SYNC;
+
 	omap_obj->flags = flags;
 
 	if (flags & OMAP_BO_TILED) {
@@ -0,0 +1,307 @@
+/*
+ * tcm-bitmap.c
+ *
+ * Row bitmap tiler container manager: 2D and 1D allocation(reservation)
+ * on top of a slot occupancy bitmap.
+ *
+ * Copyright (C) 2011 Texas Instruments, Inc.
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/*
+ * The container is kept as one bit per slot, row after row, so that a row
+ * of a 2D area and a whole 1D area are both runs of consecutive bits and
+ * can be tested, set and cleared a word at a time.
+ *
+ * Placement follows SiTA: aligned 2D areas go top-left, 1-aligned 2D areas
+ * go top-right of the divider point, each falling back to the whole
+ * container, and 1D areas are packed from the bottom-right. Within a scan
+ * field the first fit is taken instead of scoring every candidate, and
+ * busy runs are skipped with find_next_zero_bit() rather than slot by
+ * slot, so a reservation costs a few word operations per busy run instead
+ * of a full area test per candidate position.
+ */
+#include <linux/bitmap.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "tcm.h"
+
+struct bitmap_pvt {
+	spinlock_t lock;	/* spinlock to protect access */
+	struct tcm_pt div_pt;	/* divider point splitting container */
+	unsigned long *map;	/* one bit per slot, set if busy */
+};
+
+/* index of a slot in the bitmap */
+static inline unsigned long slot(struct tcm *tcm, u16 x, u16 y)
+{
+	return (unsigned long)y * tcm->width + x;
+}
+
+/**
+ * Check a row of a candidate 2D area.
+ *
+ * @return the first busy x coordinate in [x, x + w) of row y, or x + w if
+ *	   the whole run is free.
+ */
+static u32 row_busy(struct tcm *tcm, u16 x, u16 y, u16 w)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	unsigned long start = slot(tcm, x, y);
+
+	return find_next_bit(pvt->map, start + w, start) - start + x;
+}
+
+/**
+ * Find the first free 2D area of given size inside a scan field, scanning
+ * rows top to bottom and each row left to right.
+ *
+ * @param x0, y0, x1, y1	scan field (inclusive)
+ *
+ * @return 0 on success, non-0 error value on failure.
+ */
+static s32 scan_field(struct tcm *tcm, u16 w, u16 h, u16 align,
+		      u16 x0, u16 y0, u16 x1, u16 y1, struct tcm_area *area)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	u32 x, y, r, busy;
+
+	if (w > x1 - x0 + 1 || h > y1 - y0 + 1)
+		return -ENOSPC;
+
+	for (y = y0; y + h - 1 <= y1; y++) {
+		x = ALIGN(x0, align);
+		while (x + w - 1 <= x1) {
+			r = y;
+			do {
+				busy = row_busy(tcm, x, r, w);
+			} while (busy == x + w && ++r < y + h);
+			if (busy == x + w) {
+				area->p0.x = x;
+				area->p0.y = y;
+				area->p1.x = x + w - 1;
+				area->p1.y = y + h - 1;
+				return 0;
+			}
+
+			/* restart past the busy run that was hit */
+			busy = find_next_zero_bit(pvt->map, slot(tcm, 0, r + 1),
+						  slot(tcm, busy, r)) -
+				slot(tcm, 0, r);
+			x = ALIGN(busy, align);
+		}
+	}
+
+	return -ENOSPC;
+}
+
+static void fill_2d(struct tcm *tcm, struct tcm_area *area, bool busy)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	u16 w = __tcm_area_width(area);
+	u32 y;
+
+	for (y = area->p0.y; y <= area->p1.y; y++) {
+		if (busy)
+			bitmap_set(pvt->map, slot(tcm, area->p0.x, y), w);
+		else
+			bitmap_clear(pvt->map, slot(tcm, area->p0.x, y), w);
+	}
+}
+
+static bool is_area_busy_2d(struct tcm *tcm, struct tcm_area *area)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	u16 w = __tcm_area_width(area);
+	unsigned long start;
+	u32 y;
+
+	for (y = area->p0.y; y <= area->p1.y; y++) {
+		start = slot(tcm, area->p0.x, y);
+		if (find_next_zero_bit(pvt->map, start + w, start) < start + w)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Reserve a 2D area in the container
+ *
+ * @param w	width
+ * @param h	height
+ * @param area	pointer to the area that will be populated with the reserved
+ *		area
+ *
+ * @return 0 on success, non-0 error value on failure.
+ */
+static s32 bitmap_reserve_2d(struct tcm *tcm, u16 h, u16 w, u8 align,
+			     struct tcm_area *area)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	u16 x0, x1, y1;
+	s32 ret;
+
+	/* same alignment policy as SiTA, so the two are interchangeable */
+	if (align > 64)
+		return -EINVAL;
+	align = align <= 1 ? 1 : align <= 32 ? 32 : 64;
+
+	if (align > 1) {
+		/* prefer top-left corner */
+		x0 = 0;
+		x1 = w > pvt->div_pt.x ? tcm->width - 1 : pvt->div_pt.x - 1;
+	} else {
+		/* prefer top-right corner */
+		x0 = w > tcm->width - pvt->div_pt.x ? 0 : pvt->div_pt.x;
+		x1 = tcm->width - 1;
+	}
+	y1 = h > pvt->div_pt.y ? tcm->height - 1 : pvt->div_pt.y - 1;
+
+	spin_lock(&(pvt->lock));
+	ret = scan_field(tcm, w, h, align, x0, 0, x1, y1, area);
+
+	/* scan whole container if failed, but do not scan 2x */
+	if (ret && (x0 != 0 || x1 != tcm->width - 1 ||
+		    y1 != tcm->height - 1))
+		ret = scan_field(tcm, w, h, align, 0, 0, tcm->width - 1,
+				 tcm->height - 1, area);
+	if (!ret)
+		fill_2d(tcm, area, true);
+	spin_unlock(&(pvt->lock));
+
+	return ret;
+}
+
+/**
+ * Reserve a 1D area in the container
+ *
+ * @param num_slots	size of 1D area
+ * @param area		pointer to the area that will be populated with the
+ *			reserved area
+ *
+ * @return 0 on success, non-0 error value on failure.
+ */
+static s32 bitmap_reserve_1d(struct tcm *tcm, u32 num_slots,
+			     struct tcm_area *area)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	unsigned long size = slot(tcm, 0, tcm->height);
+	unsigned long pos = 0, start, end, found = size;
+
+	spin_lock(&(pvt->lock));
+
+	/* take the end of the last free run that is long enough */
+	while (pos < size) {
+		start = find_next_zero_bit(pvt->map, size, pos);
+		if (start >= size)
+			break;
+		end = find_next_bit(pvt->map, size, start);
+		if (end - start >= num_slots)
+			found = end - num_slots;
+		pos = end;
+	}
+
+	if (found == size) {
+		spin_unlock(&(pvt->lock));
+		return -ENOSPC;
+	}
+
+	bitmap_set(pvt->map, found, num_slots);
+	spin_unlock(&(pvt->lock));
+
+	area->p0.x = found % tcm->width;
+	area->p0.y = found / tcm->width;
+	area->p1.x = (found + num_slots - 1) % tcm->width;
+	area->p1.y = (found + num_slots - 1) / tcm->width;
+	return 0;
+}
+
+/**
+ * Unreserve a previously allocated 2D or 1D area
+ * @param area	area to be freed
+ * @return 0 - success
+ */
+static s32 bitmap_free(struct tcm *tcm, struct tcm_area *area)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+	unsigned long start, end;
+
+	spin_lock(&(pvt->lock));
+	if (area->is2d) {
+		/* check that this is in fact an existing area */
+		WARN_ON(!is_area_busy_2d(tcm, area));
+		fill_2d(tcm, area, false);
+	} else {
+		start = slot(tcm, area->p0.x, area->p0.y);
+		end = slot(tcm, area->p1.x, area->p1.y) + 1;
+		WARN_ON(find_next_zero_bit(pvt->map, end, start) < end);
+		bitmap_clear(pvt->map, start, end - start);
+	}
+	spin_unlock(&(pvt->lock));
+
+	return 0;
+}
+
+static void bitmap_deinit(struct tcm *tcm)
+{
+	struct bitmap_pvt *pvt = (struct bitmap_pvt *)tcm->pvt;
+
+	kfree(pvt->map);
+	kfree(pvt);
+	kfree(tcm);
+}
+
+struct tcm *bitmap_init(u16 width, u16 height, struct tcm_pt *attr)
+{
+	struct tcm *tcm;
+	struct bitmap_pvt *pvt;
+
+	if (width == 0 || height == 0)
+		return NULL;
+
+	tcm = kzalloc(sizeof(*tcm), GFP_KERNEL);
+	pvt = kzalloc(sizeof(*pvt), GFP_KERNEL);
+	if (!tcm || !pvt)
+		goto error;
+
+	pvt->map = kzalloc(BITS_TO_LONGS(width * height) * sizeof(long),
+			   GFP_KERNEL);
+	if (!pvt->map)
+		goto error;
+
+	tcm->height = height;
+	tcm->width = width;
+	tcm->reserve_2d = bitmap_reserve_2d;
+	tcm->reserve_1d = bitmap_reserve_1d;
+	tcm->free = bitmap_free;
+	tcm->deinit = bitmap_deinit;
+	tcm->pvt = (void *)pvt;
+
+	spin_lock_init(&(pvt->lock));
+
+	if (attr && attr->x <= tcm->width && attr->y <= tcm->height) {
+		pvt->div_pt.x = attr->x;
+		pvt->div_pt.y = attr->y;
+	} else {
+		/* Defaulting to 3:1 ratio on width for 2D area split */
+		/* Defaulting to 3:1 ratio on height for 2D and 1D split */
+		pvt->div_pt.x = (tcm->width * 3) / 4;
+		pvt->div_pt.y = (tcm->height * 3) / 4;
+	}
+
+	return tcm;
+
+error:
+	kfree(tcm);
+	kfree(pvt);
+	return NULL;
+}
@@ -91,6 +91,7 @@ struct tcm {
  */
 
 struct tcm *sita_init(u16 width, u16 height, struct tcm_pt *attr);
+struct tcm *bitmap_init(u16 width, u16 height, struct tcm_pt *attr);
 
 
 /**
@@ -27,6 +27,8 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
+#include <linux/err.h>
+#include <linux/rcupdate.h>
 
 #include "tmem.h"
 
@@ -68,10 +70,20 @@ void tmem_register_pamops(struct tmem_pamops *m)
  * of rb_trees to reduce search, insert, delete, and rebalancing time.
  * Each hashbucket also has a lock to manage concurrent access.
  *
- * The following routines manage tmem_objs.  When any tmem_obj is accessed,
- * the hashbucket lock must be held.
+ * The following routines manage tmem_objs.  Adding an object to or removing
+ * it from an rbtree requires the hashbucket lock and the object's lock, in
+ * that order.  The get path finds objects locklessly, under RCU, and then
+ * only takes the object's lock.
  */
 
+/* deeper than any rbtree can grow: a lookup this long raced with a change */
+#define TMEM_RB_MAX_DEPTH	64
+
+void tmem_obj_ctor(void *obj)
+{
+	spin_lock_init(&((struct tmem_obj *)obj)->lock);
+}
+
 /* searches for object==oid in pool, returns locked object if found */
 static struct tmem_obj *tmem_obj_find(struct tmem_hashbucket *hb,
 					struct tmem_oid *oidp)
@@ -99,14 +111,83 @@ out:
 	return obj;
 }
 
+/*
+ * Lockless lookup for the get path, called under rcu_read_lock().  The
+ * rbtree may be rebalanced under us: a walk never faults, since tmem_objs
+ * are type-stable, but it may miss the object or run around in circles
+ * for a while.  So it is bounded, a miss only counts if the hashbucket's
+ * seqcount did not move, and a hit is only trusted once it is locked and
+ * checked.  Returns the object locked, NULL, or ERR_PTR(-EAGAIN) if the
+ * caller has to search under the hashbucket lock.
+ */
+static struct tmem_obj *tmem_obj_find_rcu(struct tmem_pool *pool,
+					struct tmem_hashbucket *hb,
+					struct tmem_oid *oidp)
+{
+	struct rb_node *rbnode;
+	struct tmem_obj *obj;
+	unsigned seq;
+	int depth;
+
+	seq = read_seqcount_begin(&hb->seq);
+	rbnode = rcu_dereference(hb->obj_rb_root.rb_node);
+	for (depth = 0; rbnode && depth < TMEM_RB_MAX_DEPTH; depth++) {
+		obj = rb_entry(rbnode, struct tmem_obj, rb_tree_node);
+		switch (tmem_oid_compare(oidp, &obj->oid)) {
+		case 0: /* equal */
+			spin_lock(&obj->lock);
+			if (likely(obj->pool == pool &&
+				   !tmem_oid_compare(oidp, &obj->oid)))
+				return obj;
+			spin_unlock(&obj->lock);
+			return ERR_PTR(-EAGAIN);
+		case -1:
+			rbnode = rcu_dereference(rbnode->rb_left);
+			break;
+		case 1:
+			rbnode = rcu_dereference(rbnode->rb_right);
+			break;
+		}
+	}
+	if (rbnode || read_seqcount_retry(&hb->seq, seq))
+		return ERR_PTR(-EAGAIN);
+	return NULL;
+}
+
+/* find object==oid in pool without holding the hashbucket lock */
+static struct tmem_obj *tmem_obj_find_get(struct tmem_pool *pool,
+					struct tmem_hashbucket *hb,
+					struct tmem_oid *oidp)
+{
+	struct tmem_obj *obj;
+
+	rcu_read_lock();
+	obj = tmem_obj_find_rcu(pool, hb, oidp);
+	rcu_read_unlock();
+	if (likely(!IS_ERR(obj)))
+		return obj;
+
+	spin_lock(&hb->lock);
+	obj = tmem_obj_find(hb, oidp);
+	if (obj != NULL)
+		spin_lock(&obj->lock);
+	spin_unlock(&hb->lock);
+	return obj;
+}
+
 static void tmem_pampd_destroy_all_in_obj(struct tmem_obj *);
 
-/* free an object that has no more pampds in it */
+/*
+ * free an object that has no more pampds in it; the caller drops the
+ * object's lock before handing it back to tmem_hostops.obj_free
+ */
 static void tmem_obj_free(struct tmem_obj *obj, struct tmem_hashbucket *hb)
 {
 	struct tmem_pool *pool;
 
 	BUG_ON(obj == NULL);
+	ASSERT_SPINLOCK(&hb->lock);
+	ASSERT_SPINLOCK(&obj->lock);
 	ASSERT_SENTINEL(obj, OBJ);
 	BUG_ON(obj->pampd_count > 0);
 	pool = obj->pool;
@@ -120,11 +201,15 @@ static void tmem_obj_free(struct tmem_obj *obj, struct tmem_hashbucket *hb)
 	INVERT_SENTINEL(obj, OBJ);
 	obj->pool = NULL;
 	tmem_oid_set_invalid(&obj->oid);
+	write_seqcount_begin(&hb->seq);
 	rb_erase(&obj->rb_tree_node, &hb->obj_rb_root);
+	write_seqcount_end(&hb->seq);
 }
 
 /*
- * initialize, and insert an tmem_object_root (called only if find failed)
+ * initialize, and insert an tmem_object_root (called only if find failed);
+ * returns with the object locked, as lockless lookups may find it as soon
+ * as it is linked in
  */
 static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 					struct tmem_pool *pool,
@@ -135,6 +220,8 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 	struct tmem_obj *this;
 
 	BUG_ON(pool == NULL);
+	ASSERT_SPINLOCK(&hb->lock);
+	spin_lock(&obj->lock);
 	atomic_inc(&pool->obj_count);
 	obj->objnode_tree_height = 0;
 	obj->objnode_tree_root = NULL;
@@ -160,8 +247,30 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 			break;
 		}
 	}
+	write_seqcount_begin(&hb->seq);
 	rb_link_node(&obj->rb_tree_node, parent, new);
 	rb_insert_color(&obj->rb_tree_node, root);
+	write_seqcount_end(&hb->seq);
+}
+
+/*
+ * Free obj if it is still the object for oidp in pool and still empty.
+ * The get path empties objects without holding the hashbucket lock, which
+ * unlinking them needs, so they are reaped here after the fact.
+ */
+static void tmem_obj_reap(struct tmem_obj *obj, struct tmem_hashbucket *hb,
+				struct tmem_pool *pool, struct tmem_oid *oidp)
+{
+	spin_lock(&hb->lock);
+	spin_lock(&obj->lock);
+	if (obj->pool == pool && !tmem_oid_compare(&obj->oid, oidp) &&
+	    obj->pampd_count == 0) {
+		tmem_obj_free(obj, hb);
+		spin_unlock(&obj->lock);
+		(*tmem_hostops.obj_free)(obj, pool);
+	} else
+		spin_unlock(&obj->lock);
+	spin_unlock(&hb->lock);
 }
 
 /*
@@ -187,8 +296,10 @@ static void tmem_pool_flush(struct tmem_pool *pool, bool destroy)
 		while (rbnode != NULL) {
 			obj = rb_entry(rbnode, struct tmem_obj, rb_tree_node);
 			rbnode = rb_next(rbnode);
+			spin_lock(&obj->lock);
 			tmem_pampd_destroy_all_in_obj(obj);
 			tmem_obj_free(obj, hb);
+			spin_unlock(&obj->lock);
 			(*tmem_hostops.obj_free)(obj, pool);
 		}
 		spin_unlock(&hb->lock);
@@ -540,6 +651,7 @@ int tmem_put(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 	spin_lock(&hb->lock);
 	obj = objfound = tmem_obj_find(hb, oidp);
 	if (obj != NULL) {
+		spin_lock(&obj->lock);
 		pampd = tmem_pampd_lookup_in_obj(objfound, index);
 		if (pampd != NULL) {
 			/* if found, is a dup put, flush the old one */
@@ -570,6 +682,7 @@ int tmem_put(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 	if (unlikely(ret == -ENOMEM))
 		/* may have partially built objnode tree ("stump") */
 		goto delete_and_free;
+	spin_unlock(&obj->lock);
 	goto out;
 
 delete_and_free:
@@ -579,8 +692,10 @@ free:
 		(*tmem_pamops.free)(pampd, pool, NULL, 0);
 	if (objnew) {
 		tmem_obj_free(objnew, hb);
+		spin_unlock(&objnew->lock);
 		(*tmem_hostops.obj_free)(objnew, pool);
-	}
+	} else
+		spin_unlock(&obj->lock);
 out:
 	spin_unlock(&hb->lock);
 	return ret;
@@ -610,11 +725,10 @@ int tmem_get(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 	bool lock_held = false;
 
 	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
-	spin_lock(&hb->lock);
-	lock_held = true;
-	obj = tmem_obj_find(hb, oidp);
+	obj = tmem_obj_find_get(pool, hb, oidp);
 	if (obj == NULL)
 		goto out;
+	lock_held = true;
 	if (free)
 		pampd = tmem_pampd_delete_from_obj(obj, index);
 	else
@@ -622,15 +736,17 @@ int tmem_get(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 	if (pampd == NULL)
 		goto out;
 	if (free) {
-		if (obj->pampd_count == 0) {
-			tmem_obj_free(obj, hb);
-			(*tmem_hostops.obj_free)(obj, pool);
-			obj = NULL;
-		}
-	}
-	if (tmem_pamops.is_remote(pampd)) {
+		/* the pampd is ours now, the object lock is not needed */
+		bool empty = obj->pampd_count == 0;
+
 		lock_held = false;
-		spin_unlock(&hb->lock);
+		spin_unlock(&obj->lock);
+		if (empty)
+			tmem_obj_reap(obj, hb, pool, oidp);
+		obj = NULL;
+	} else if (tmem_pamops.is_remote(pampd)) {
+		lock_held = false;
+		spin_unlock(&obj->lock);
 	}
 	if (free)
 		ret = (*tmem_pamops.get_data_and_free)(
@@ -643,7 +759,7 @@ int tmem_get(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 	ret = 0;
 out:
 	if (lock_held)
-		spin_unlock(&hb->lock);
+		spin_unlock(&obj->lock);
 	return ret;
 }
 
@@ -665,14 +781,19 @@ int tmem_flush_page(struct tmem_pool *pool,
 	obj = tmem_obj_find(hb, oidp);
 	if (obj == NULL)
 		goto out;
+	spin_lock(&obj->lock);
 	pampd = tmem_pampd_delete_from_obj(obj, index);
-	if (pampd == NULL)
+	if (pampd == NULL) {
+		spin_unlock(&obj->lock);
 		goto out;
+	}
 	(*tmem_pamops.free)(pampd, pool, oidp, index);
 	if (obj->pampd_count == 0) {
 		tmem_obj_free(obj, hb);
+		spin_unlock(&obj->lock);
 		(*tmem_hostops.obj_free)(obj, pool);
-	}
+	} else
+		spin_unlock(&obj->lock);
 	ret = 0;
 
 out:
@@ -697,8 +818,10 @@ int tmem_replace(struct tmem_pool *pool, struct tmem_oid *oidp,
 	obj = tmem_obj_find(hb, oidp);
 	if (obj == NULL)
 		goto out;
+	spin_lock(&obj->lock);
 	new_pampd = tmem_pampd_replace_in_obj(obj, index, new_pampd);
 	ret = (*tmem_pamops.replace_in_obj)(new_pampd, obj);
+	spin_unlock(&obj->lock);
 out:
 	spin_unlock(&hb->lock);
 	return ret;
@@ -718,8 +841,10 @@ int tmem_flush_object(struct tmem_pool *pool, struct tmem_oid *oidp)
 	obj = tmem_obj_find(hb, oidp);
 	if (obj == NULL)
 		goto out;
+	spin_lock(&obj->lock);
 	tmem_pampd_destroy_all_in_obj(obj);
 	tmem_obj_free(obj, hb);
+	spin_unlock(&obj->lock);
 	(*tmem_hostops.obj_free)(obj, pool);
 	ret = 0;
 
@@ -760,6 +885,7 @@ void tmem_new_pool(struct tmem_pool *pool, uint32_t flags)
 	for (i = 0; i < TMEM_HASH_BUCKETS; i++, hb++) {
 		hb->obj_rb_root = RB_ROOT;
 		spin_lock_init(&hb->lock);
+		seqcount_init(&hb->seq);
 	}
 	INIT_LIST_HEAD(&pool->pool_list);
 	atomic_set(&pool->obj_count, 0);
@@ -13,6 +13,9 @@
 #include <linux/highmem.h>
 #include <linux/hash.h>
 #include <linux/atomic.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 
 /*
  * These are pre-defined by the Xen<->Linux ABI
@@ -54,7 +57,9 @@
  * usually corresponds to a large independent set of pages such as
  * a filesystem.  Each pool has an id, and certain attributes and counters.
  * It also contains a set of hash buckets, each of which contains an rbtree
- * of objects and a lock to manage concurrency within the pool.
+ * of objects and a lock to manage concurrency within the pool.  The lock
+ * serializes changes to the rbtree; the seqcount lets the get path search
+ * it under RCU without taking the lock (see tmem_obj_find_rcu()).
  */
 
 #define TMEM_HASH_BUCKET_BITS	8
@@ -63,6 +68,7 @@
 struct tmem_hashbucket {
 	struct rb_root obj_rb_root;
 	spinlock_t lock;
+	seqcount_t seq;
 };
 
 struct tmem_pool {
@@ -135,11 +141,19 @@ static inline unsigned tmem_oid_hash(struct tmem_oid *oidp)
  * pool and the rb_tree to which it belongs, counters, and an ordered
  * set of pampds, structured in a radix-tree-like tree.  The intermediate
  * nodes of the tree are called tmem_objnodes.
+ *
+ * The lock protects the objnode tree and the pampds in it; the identity
+ * fields (oid, pool) only change with both it and the hashbucket lock
+ * held.  Lockless lookups may touch a tmem_obj after it has been freed,
+ * so obj_alloc must hand out type-stable memory (e.g. from a
+ * SLAB_DESTROY_BY_RCU cache) whose lock was set up once by
+ * tmem_obj_ctor() and is never reinitialized.
  */
 
 struct tmem_objnode;
 
 struct tmem_obj {
+	spinlock_t lock;
 	struct tmem_oid oid;
 	struct tmem_pool *pool;
 	struct rb_node rb_tree_node;
@@ -190,6 +204,7 @@ struct tmem_hostops {
 	void (*objnode_free)(struct tmem_objnode *, struct tmem_pool *);
 };
 extern void tmem_register_hostops(struct tmem_hostops *m);
+extern void tmem_obj_ctor(void *obj);
 
 /* core tmem accessor functions */
 extern int tmem_put(struct tmem_pool *, struct tmem_oid *, uint32_t index,
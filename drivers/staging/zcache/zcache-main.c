@@ -29,6 +29,8 @@
 #include <linux/types.h>
 #include <linux/atomic.h>
 #include <linux/math64.h>
+#include <linux/memcontrol.h>
+#include <linux/sched.h>
 #include <linux/crypto.h>
 #include <linux/string.h>
 #include "tmem.h"
@@ -93,22 +95,39 @@ enum comp_op {
 	ZCACHE_COMPOP_DECOMPRESS
 };
 
+/*
+ * Cumulative counters for the compressor in use: ratio is
+ * comp_out / comp_in, throughput is bytes / ns.
+ */
+static atomic64_t zcache_comp_in = ATOMIC64_INIT(0);
+static atomic64_t zcache_comp_out = ATOMIC64_INIT(0);
+static atomic64_t zcache_comp_ns = ATOMIC64_INIT(0);
+static atomic64_t zcache_decomp_in = ATOMIC64_INIT(0);
+static atomic64_t zcache_decomp_ns = ATOMIC64_INIT(0);
+
 static inline int zcache_comp_op(enum comp_op op,
 				const u8 *src, unsigned int slen,
 				u8 *dst, unsigned int *dlen)
 {
 	struct crypto_comp *tfm;
+	u64 start;
 	int ret;
 
 	BUG_ON(!zcache_comp_pcpu_tfms);
 	tfm = *per_cpu_ptr(zcache_comp_pcpu_tfms, get_cpu());
 	BUG_ON(!tfm);
+	start = local_clock();
 	switch (op) {
 	case ZCACHE_COMPOP_COMPRESS:
 		ret = crypto_comp_compress(tfm, src, slen, dst, dlen);
+		atomic64_add(local_clock() - start, &zcache_comp_ns);
+		atomic64_add(slen, &zcache_comp_in);
+		atomic64_add(*dlen, &zcache_comp_out);
 		break;
 	case ZCACHE_COMPOP_DECOMPRESS:
 		ret = crypto_comp_decompress(tfm, src, slen, dst, dlen);
+		atomic64_add(local_clock() - start, &zcache_decomp_ns);
+		atomic64_add(slen, &zcache_decomp_in);
 		break;
 	}
 	put_cpu();
@@ -143,6 +162,7 @@ struct zbud_hdr {
 	struct tmem_oid oid;
 	uint32_t index;
 	uint16_t size; /* compressed size in bytes, zero means unused */
+	struct mem_cgroup *memcg; /* charged for size bytes */
 	DECL_SENTINEL
 };
 
@@ -319,6 +339,8 @@ static unsigned zbud_free(struct zbud_hdr *zh)
 	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
 	zh->size = 0;
 	tmem_oid_set_invalid(&zh->oid);
+	mem_cgroup_uncharge_compressed(zh->memcg, size);
+	zh->memcg = NULL;
 	INVERT_SENTINEL(zh, ZBH);
 	zcache_zbud_curr_zbytes -= size;
 	atomic_dec(&zcache_zbud_curr_zpages);
@@ -365,7 +387,8 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 static struct zbud_hdr *zbud_create(uint16_t client_id, uint16_t pool_id,
 					struct tmem_oid *oid,
 					uint32_t index, struct page *page,
-					void *cdata, unsigned size)
+					void *cdata, unsigned size,
+					struct mem_cgroup *memcg)
 {
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
 	struct zbud_page *zbpg = NULL, *ztmp;
@@ -423,6 +446,7 @@ init_zh:
 	zh->oid = *oid;
 	zh->pool_id = pool_id;
 	zh->client_id = client_id;
+	zh->memcg = memcg;
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
 	spin_unlock(&zbpg->lock);
@@ -602,6 +626,60 @@ out:
 	return;
 }
 
+static unsigned long zcache_evicted_memcg_pages;
+
+static bool zbud_charged_to(struct zbud_page *zbpg, struct mem_cgroup *memcg)
+{
+	int i;
+
+	for (i = 0; i < ZBUD_MAX_BUDS; i++)
+		if (zbpg->buddy[i].size && zbpg->buddy[i].memcg == memcg)
+			return true;
+	return false;
+}
+
+/*
+ * Free up to nr pages holding ephemeral zbuds charged to memcg, so a
+ * cgroup over its compressed limit makes room out of its own pages rather
+ * than having everyone else's evicted by the shrinker.  A buddy of another
+ * cgroup sharing the page goes too.  Called with interrupts disabled from
+ * the put path, hence no _bh locking as in zbud_evict_pages().
+ */
+static void zbud_evict_memcg(struct mem_cgroup *memcg, int nr)
+{
+	struct zbud_page *zbpg;
+	struct list_head *list;
+	int i;
+
+	BUG_ON(!irqs_disabled());
+	for (i = 0; i <= MAX_CHUNK; i++) {
+		list = i < MAX_CHUNK ? &zbud_unbuddied[i].list :
+				       &zbud_buddied_list;
+retry_list_i:
+		spin_lock(&zbud_budlists_spinlock);
+		list_for_each_entry(zbpg, list, bud_list) {
+			if (unlikely(!spin_trylock(&zbpg->lock)))
+				continue;
+			if (!zbud_charged_to(zbpg, memcg)) {
+				spin_unlock(&zbpg->lock);
+				continue;
+			}
+			list_del_init(&zbpg->bud_list);
+			if (i < MAX_CHUNK)
+				zbud_unbuddied[i].count--;
+			else
+				zcache_zbud_buddied_count--;
+			spin_unlock(&zbud_budlists_spinlock);
+			zcache_evicted_memcg_pages++;
+			zbud_evict_zbpg(zbpg);
+			if (--nr <= 0)
+				return;
+			goto retry_list_i;
+		}
+		spin_unlock(&zbud_budlists_spinlock);
+	}
+}
+
 static void zbud_init(void)
 {
 	int i;
@@ -672,6 +750,7 @@ struct zv_hdr {
 	struct tmem_oid oid;
 	uint32_t index;
 	size_t size;
+	struct mem_cgroup *memcg; /* charged for size bytes */
 	DECL_SENTINEL
 };
 
@@ -695,7 +774,8 @@ static atomic_t zv_cumul_dist_counts[NCHUNKS];
 
 static struct zv_hdr *zv_create(struct zs_pool *pool, uint32_t pool_id,
 				struct tmem_oid *oid, uint32_t index,
-				void *cdata, unsigned clen)
+				void *cdata, unsigned clen,
+				struct mem_cgroup *memcg)
 {
 	struct zv_hdr *zv;
 	u32 size = clen + sizeof(struct zv_hdr);
@@ -709,11 +789,12 @@ static struct zv_hdr *zv_create(struct zs_pool *pool, uint32_t pool_id,
 		goto out;
 	atomic_inc(&zv_curr_dist_counts[chunks]);
 	atomic_inc(&zv_cumul_dist_counts[chunks]);
-	zv = zs_map_object(pool, handle);
+	zv = zs_map_object(pool, handle, ZS_MM_WO);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
 	zv->size = clen;
+	zv->memcg = memcg;
 	SET_SENTINEL(zv, ZVH);
 	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
 	zs_unmap_object(pool, handle);
@@ -725,14 +806,17 @@ static void zv_free(struct zs_pool *pool, void *handle)
 {
 	unsigned long flags;
 	struct zv_hdr *zv;
+	struct mem_cgroup *memcg;
 	uint16_t size;
 	int chunks;
 
-	zv = zs_map_object(pool, handle);
+	zv = zs_map_object(pool, handle, ZS_MM_RW);
 	ASSERT_SENTINEL(zv, ZVH);
 	size = zv->size + sizeof(struct zv_hdr);
+	memcg = zv->memcg;
 	INVERT_SENTINEL(zv, ZVH);
 	zs_unmap_object(pool, handle);
+	mem_cgroup_uncharge_compressed(memcg, size);
 
 	chunks = (size + (CHUNK_SIZE - 1)) >> CHUNK_SHIFT;
 	BUG_ON(chunks >= NCHUNKS);
@@ -750,7 +834,7 @@ static void zv_decompress(struct page *page, void *handle)
 	int ret;
 	struct zv_hdr *zv;
 
-	zv = zs_map_object(zcache_host.zspool, handle);
+	zv = zs_map_object(zcache_host.zspool, handle, ZS_MM_RO);
 	BUG_ON(zv->size == 0);
 	ASSERT_SENTINEL(zv, ZVH);
 	to_va = kmap_atomic(page);
@@ -926,6 +1010,7 @@ static unsigned long zcache_flobj_total;
 static unsigned long zcache_flobj_found;
 static unsigned long zcache_failed_eph_puts;
 static unsigned long zcache_failed_pers_puts;
+static unsigned long zcache_memcg_failed_puts;
 
 /*
  * Tmem operations assume the poolid implies the invoking client.
@@ -1020,9 +1105,45 @@ struct zcache_preload {
 	struct tmem_obj *obj;
 	int nr;
 	struct tmem_objnode *objnodes[OBJNODE_TREE_MAX_PATH];
+	struct mem_cgroup *memcg;	/* owner of the page being put */
+	bool over_limit;		/* memcg refused the charge */
 };
 static DEFINE_PER_CPU(struct zcache_preload, zcache_preloads) = { 0, };
 
+/*
+ * Objnodes and objs freed by tmem go to a per-cpu magazine, from which
+ * zcache_do_preload() refills before falling back to the slab allocator,
+ * so a steady stream of puts and flushes keeps recycling the same few
+ * objects on each cpu instead of going through the slab.
+ */
+#define ZCACHE_MAG_OBJNODES	(2 * OBJNODE_TREE_MAX_PATH)
+#define ZCACHE_MAG_OBJS		16
+
+struct zcache_magazine {
+	int nr_objnodes;
+	int nr_objs;
+	struct tmem_objnode *objnodes[ZCACHE_MAG_OBJNODES];
+	struct tmem_obj *objs[ZCACHE_MAG_OBJS];
+};
+static DEFINE_PER_CPU(struct zcache_magazine, zcache_magazines);
+
+static unsigned long zcache_magazine_hits;
+
+/* called with preemption disabled */
+static void zcache_magazine_refill(struct zcache_preload *kp)
+{
+	struct zcache_magazine *mag = &__get_cpu_var(zcache_magazines);
+
+	while (kp->nr < ARRAY_SIZE(kp->objnodes) && mag->nr_objnodes) {
+		kp->objnodes[kp->nr++] = mag->objnodes[--mag->nr_objnodes];
+		zcache_magazine_hits++;
+	}
+	if (kp->obj == NULL && mag->nr_objs) {
+		kp->obj = mag->objs[--mag->nr_objs];
+		zcache_magazine_hits++;
+	}
+}
+
 static int zcache_do_preload(struct tmem_pool *pool)
 {
 	struct zcache_preload *kp;
@@ -1037,6 +1158,7 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		goto out;
 	preempt_disable();
 	kp = &__get_cpu_var(zcache_preloads);
+	zcache_magazine_refill(kp);
 	while (kp->nr < ARRAY_SIZE(kp->objnodes)) {
 		preempt_enable_no_resched();
 		objnode = kmem_cache_alloc(zcache_objnode_cache,
@@ -1052,28 +1174,34 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		else
 			kmem_cache_free(zcache_objnode_cache, objnode);
 	}
-	preempt_enable_no_resched();
-	obj = kmem_cache_alloc(zcache_obj_cache, ZCACHE_GFP_MASK);
-	if (unlikely(obj == NULL)) {
-		zcache_failed_alloc++;
-		goto out;
+	if (kp->obj == NULL) {
+		preempt_enable_no_resched();
+		obj = kmem_cache_alloc(zcache_obj_cache, ZCACHE_GFP_MASK);
+		if (unlikely(obj == NULL)) {
+			zcache_failed_alloc++;
+			goto out;
+		}
+		preempt_disable();
+		kp = &__get_cpu_var(zcache_preloads);
+		if (kp->obj == NULL)
+			kp->obj = obj;
+		else
+			kmem_cache_free(zcache_obj_cache, obj);
 	}
-	page = (void *)__get_free_page(ZCACHE_GFP_MASK);
-	if (unlikely(page == NULL)) {
-		zcache_failed_get_free_pages++;
-		kmem_cache_free(zcache_obj_cache, obj);
-		goto out;
+	if (kp->page == NULL) {
+		preempt_enable_no_resched();
+		page = (void *)__get_free_page(ZCACHE_GFP_MASK);
+		if (unlikely(page == NULL)) {
+			zcache_failed_get_free_pages++;
+			goto out;
+		}
+		preempt_disable();
+		kp = &__get_cpu_var(zcache_preloads);
+		if (kp->page == NULL)
+			kp->page = page;
+		else
+			free_page((unsigned long)page);
 	}
-	preempt_disable();
-	kp = &__get_cpu_var(zcache_preloads);
-	if (kp->obj == NULL)
-		kp->obj = obj;
-	else
-		kmem_cache_free(zcache_obj_cache, obj);
-	if (kp->page == NULL)
-		kp->page = page;
-	else
-		free_page((unsigned long)page);
 	ret = 0;
 out:
 	return ret;
@@ -1123,9 +1251,18 @@ out:
 static void zcache_objnode_free(struct tmem_objnode *objnode,
 					struct tmem_pool *pool)
 {
+	struct zcache_magazine *mag;
+
 	atomic_dec(&zcache_curr_objnode_count);
 	BUG_ON(atomic_read(&zcache_curr_objnode_count) < 0);
-	kmem_cache_free(zcache_objnode_cache, objnode);
+	mag = &get_cpu_var(zcache_magazines);
+	if (mag->nr_objnodes < ZCACHE_MAG_OBJNODES) {
+		mag->objnodes[mag->nr_objnodes++] = objnode;
+		objnode = NULL;
+	}
+	put_cpu_var(zcache_magazines);
+	if (objnode)
+		kmem_cache_free(zcache_objnode_cache, objnode);
 }
 
 static struct tmem_obj *zcache_obj_alloc(struct tmem_pool *pool)
@@ -1146,9 +1283,18 @@ static struct tmem_obj *zcache_obj_alloc(struct tmem_pool *pool)
 
 static void zcache_obj_free(struct tmem_obj *obj, struct tmem_pool *pool)
 {
+	struct zcache_magazine *mag;
+
 	atomic_dec(&zcache_curr_obj_count);
 	BUG_ON(atomic_read(&zcache_curr_obj_count) < 0);
-	kmem_cache_free(zcache_obj_cache, obj);
+	mag = &get_cpu_var(zcache_magazines);
+	if (mag->nr_objs < ZCACHE_MAG_OBJS) {
+		mag->objs[mag->nr_objs++] = obj;
+		obj = NULL;
+	}
+	put_cpu_var(zcache_magazines);
+	if (obj)
+		kmem_cache_free(zcache_obj_cache, obj);
 }
 
 static struct tmem_hostops zcache_hostops = {
@@ -1170,6 +1316,24 @@ static unsigned long zcache_curr_pers_pampd_count_max;
 /* forward reference */
 static int zcache_compress(struct page *from, void **out_va, unsigned *out_len);
 
+/*
+ * Charge size bytes to the cgroup that owns the page being put, which
+ * zcache_put_page() leaves in the preload.  A refused charge is noted
+ * there so the put can be retried after evicting some of the cgroup's
+ * own ephemeral pages.
+ */
+static int zcache_charge(size_t size, struct mem_cgroup **memcgp)
+{
+	struct zcache_preload *kp = &__get_cpu_var(zcache_preloads);
+
+	if (mem_cgroup_charge_compressed(kp->memcg, size)) {
+		kp->over_limit = true;
+		return -ENOMEM;
+	}
+	*memcgp = kp->memcg;
+	return 0;
+}
+
 static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 				struct tmem_pool *pool, struct tmem_oid *oid,
 				 uint32_t index)
@@ -1181,6 +1345,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 	struct page *page = (struct page *)(data);
 	struct zcache_client *cli = pool->client;
 	uint16_t client_id = get_client_id_from_client(cli);
+	struct mem_cgroup *memcg;
 	unsigned long zv_mean_zsize;
 	unsigned long curr_pers_pampd_count;
 	u64 total_zsize;
@@ -1193,13 +1358,16 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 			zcache_compress_poor++;
 			goto out;
 		}
+		if (zcache_charge(clen, &memcg))
+			goto out;
 		pampd = (void *)zbud_create(client_id, pool->pool_id, oid,
-						index, page, cdata, clen);
+						index, page, cdata, clen, memcg);
 		if (pampd != NULL) {
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
 				zcache_curr_eph_pampd_count_max = count;
-		}
+		} else
+			mem_cgroup_uncharge_compressed(memcg, clen);
 	} else {
 		curr_pers_pampd_count =
 			atomic_read(&zcache_curr_pers_pampd_count);
@@ -1224,10 +1392,15 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 				goto out;
 			}
 		}
+		if (zcache_charge(clen + sizeof(struct zv_hdr), &memcg))
+			goto out;
 		pampd = (void *)zv_create(cli->zspool, pool->pool_id,
-						oid, index, cdata, clen);
-		if (pampd == NULL)
+						oid, index, cdata, clen, memcg);
+		if (pampd == NULL) {
+			mem_cgroup_uncharge_compressed(memcg,
+					clen + sizeof(struct zv_hdr));
 			goto out;
+		}
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
 		if (count > zcache_curr_pers_pampd_count_max)
 			zcache_curr_pers_pampd_count_max = count;
@@ -1370,6 +1543,7 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 {
 	int ret, cpu = (long)pcpu;
 	struct zcache_preload *kp;
+	struct zcache_magazine *mag;
 
 	switch (action) {
 	case CPU_UP_PREPARE:
@@ -1402,6 +1576,13 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 			free_page((unsigned long)kp->page);
 			kp->page = NULL;
 		}
+		mag = &per_cpu(zcache_magazines, cpu);
+		while (mag->nr_objnodes)
+			kmem_cache_free(zcache_objnode_cache,
+				mag->objnodes[--mag->nr_objnodes]);
+		while (mag->nr_objs)
+			kmem_cache_free(zcache_obj_cache,
+				mag->objs[--mag->nr_objs]);
 		break;
 	default:
 		break;
@@ -1463,9 +1644,12 @@ ZCACHE_SYSFS_RO(zbpg_unused_list_count);
 ZCACHE_SYSFS_RO(evicted_raw_pages);
 ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
 ZCACHE_SYSFS_RO(evicted_buddied_pages);
+ZCACHE_SYSFS_RO(evicted_memcg_pages);
+ZCACHE_SYSFS_RO(memcg_failed_puts);
 ZCACHE_SYSFS_RO(failed_get_free_pages);
 ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
+ZCACHE_SYSFS_RO(magazine_hits);
 ZCACHE_SYSFS_RO(compress_poor);
 ZCACHE_SYSFS_RO(mean_compress_poor);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
@@ -1481,6 +1665,24 @@ ZCACHE_SYSFS_RO_CUSTOM(zv_curr_dist_counts,
 ZCACHE_SYSFS_RO_CUSTOM(zv_cumul_dist_counts,
 			zv_cumul_dist_counts_show);
 
+static int zcache_show_comp_algorithm(char *buf)
+{
+	return sprintf(buf, "%s\n", zcache_comp_name);
+}
+
+static int zcache_show_comp_stats(char *buf)
+{
+	return sprintf(buf, "%s %lld %lld %lld %lld %lld\n", zcache_comp_name,
+		(long long)atomic64_read(&zcache_comp_in),
+		(long long)atomic64_read(&zcache_comp_out),
+		(long long)atomic64_read(&zcache_comp_ns),
+		(long long)atomic64_read(&zcache_decomp_in),
+		(long long)atomic64_read(&zcache_decomp_ns));
+}
+
+ZCACHE_SYSFS_RO_CUSTOM(comp_algorithm, zcache_show_comp_algorithm);
+ZCACHE_SYSFS_RO_CUSTOM(comp_stats, zcache_show_comp_stats);
+
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
 	&zcache_curr_obj_count_max_attr.attr,
@@ -1504,9 +1706,12 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_evicted_raw_pages_attr.attr,
 	&zcache_evicted_unbuddied_pages_attr.attr,
 	&zcache_evicted_buddied_pages_attr.attr,
+	&zcache_evicted_memcg_pages_attr.attr,
+	&zcache_memcg_failed_puts_attr.attr,
 	&zcache_failed_get_free_pages_attr.attr,
 	&zcache_failed_alloc_attr.attr,
 	&zcache_put_to_flush_attr.attr,
+	&zcache_magazine_hits_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
 	&zcache_zv_curr_dist_counts_attr.attr,
@@ -1514,6 +1719,8 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_zv_max_zsize_attr.attr,
 	&zcache_zv_max_mean_zsize_attr.attr,
 	&zcache_zv_page_count_policy_percent_attr.attr,
+	&zcache_comp_algorithm_attr.attr,
+	&zcache_comp_stats_attr.attr,
 	NULL,
 };
 
@@ -1562,10 +1769,36 @@ static struct shrinker zcache_shrinker = {
  * zcache shims between cleancache/frontswap ops and tmem
  */
 
+/*
+ * Put with the owner of the page recorded for zcache_charge().  Called
+ * with the preload done, so preemption is disabled.  Returns -EDQUOT if
+ * the put failed because memcg is over its compressed limit.
+ */
+static int zcache_memcg_put(struct tmem_pool *pool, struct tmem_oid *oidp,
+				uint32_t index, struct page *page,
+				struct mem_cgroup *memcg)
+{
+	struct zcache_preload *kp = &__get_cpu_var(zcache_preloads);
+	int ret;
+
+	kp->memcg = memcg;
+	kp->over_limit = false;
+	ret = tmem_put(pool, oidp, index, (char *)(page),
+			PAGE_SIZE, 0, is_ephemeral(pool));
+	if (ret < 0 && kp->over_limit)
+		ret = -EDQUOT;
+	kp->memcg = NULL;
+	return ret;
+}
+
+/* ephemeral pages evicted from a cgroup over its limit before a retry */
+#define ZCACHE_MEMCG_EVICT_PAGES	4
+
 static int zcache_put_page(int cli_id, int pool_id, struct tmem_oid *oidp,
 				uint32_t index, struct page *page)
 {
 	struct tmem_pool *pool;
+	struct mem_cgroup *memcg;
 	int ret = -1;
 
 	BUG_ON(!irqs_disabled());
@@ -1574,8 +1807,20 @@ static int zcache_put_page(int cli_id, int pool_id, struct tmem_oid *oidp,
 		goto out;
 	if (!zcache_freeze && zcache_do_preload(pool) == 0) {
 		/* preload does preempt_disable on success */
-		ret = tmem_put(pool, oidp, index, (char *)(page),
-				PAGE_SIZE, 0, is_ephemeral(pool));
+		memcg = mem_cgroup_compressed_owner(page);
+		ret = zcache_memcg_put(pool, oidp, index, page, memcg);
+		if (ret == -EDQUOT) {
+			preempt_enable_no_resched();
+			zbud_evict_memcg(memcg, ZCACHE_MEMCG_EVICT_PAGES);
+			if (zcache_do_preload(pool) == 0)
+				ret = zcache_memcg_put(pool, oidp, index, page,
+							memcg);
+			else
+				preempt_disable();
+			if (ret == -EDQUOT)
+				zcache_memcg_failed_puts++;
+		}
+		mem_cgroup_compressed_owner_put(memcg);
 		if (ret < 0) {
 			if (is_ephemeral(pool))
 				zcache_failed_eph_puts++;
@@ -2044,8 +2289,10 @@ static int __init zcache_init(void)
 	}
 	zcache_objnode_cache = kmem_cache_create("zcache_objnode",
 				sizeof(struct tmem_objnode), 0, 0, NULL);
+	/* lockless tmem lookups need type-stable objs, see tmem.h */
 	zcache_obj_cache = kmem_cache_create("zcache_obj",
-				sizeof(struct tmem_obj), 0, 0, NULL);
+				sizeof(struct tmem_obj), 0,
+				SLAB_DESTROY_BY_RCU, tmem_obj_ctor);
 	ret = zcache_new_client(LOCAL_CLIENT);
 	if (ret) {
 		pr_err("zcache: can't create client\n");
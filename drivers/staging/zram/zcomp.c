@@ -0,0 +1,251 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/crypto.h>
+
+#include "zcomp.h"
+
+/* Size of zcomp_strm->buffer: worst case output for one page */
+#define ZCOMP_BUFFER_ORDER	1
+
+bool zcomp_available_algorithm(const char *name)
+{
+	return crypto_has_comp(name, 0, 0);
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, ZCOMP_BUFFER_ORDER);
+	kfree(zstrm);
+}
+
+/*
+ * crypto_alloc_comp() allocates with GFP_KERNEL, which could recurse into
+ * swap or fs reclaim and from there back into zram. So streams are never
+ * allocated on the I/O path, only in zcomp_create() and when the limit is
+ * raised, and writers just wait for an idle one.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	/*
+	 * allocate 2 pages. 1 for compressed data, plus 1 extra for the
+	 * case when compressed size is larger than the original one
+	 */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+					ZCOMP_BUFFER_ORDER);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		zstrm = NULL;
+	}
+	return zstrm;
+}
+
+/*
+ * Allocate num_strm more streams. They are added to the pool only once
+ * all of them have been allocated, so on failure the pool is unchanged.
+ */
+static int zcomp_strm_add(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm, *tmp;
+	LIST_HEAD(new_strm);
+	int i;
+
+	for (i = 0; i < num_strm; i++) {
+		zstrm = zcomp_strm_alloc(comp);
+		if (!zstrm)
+			goto fail;
+		list_add(&zstrm->list, &new_strm);
+	}
+
+	spin_lock(&comp->strm_lock);
+	list_splice(&new_strm, &comp->idle_strm);
+	comp->avail_strm += num_strm;
+	spin_unlock(&comp->strm_lock);
+	wake_up_all(&comp->strm_wait);
+	return 0;
+
+fail:
+	list_for_each_entry_safe(zstrm, tmp, &new_strm, list)
+		zcomp_strm_free(zstrm);
+	return -ENOMEM;
+}
+
+/* Get an idle stream, sleeping until some other writer releases one */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+/* Put the stream back, or free it if the limit has been lowered */
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(zstrm);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	u64 start;
+	unsigned int len = PAGE_SIZE << ZCOMP_BUFFER_ORDER;
+
+	start = local_clock();
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+			zstrm->buffer, &len);
+	if (ret)
+		return ret;
+
+	atomic64_add(local_clock() - start, &comp->stats.comp_ns);
+	atomic64_add(PAGE_SIZE, &comp->stats.comp_in);
+	atomic64_add(len, &comp->stats.comp_out);
+
+	*dst_len = len;
+	return 0;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	int ret;
+	u64 start;
+	unsigned int dst_len = PAGE_SIZE;
+
+	start = local_clock();
+	ret = crypto_comp_decompress(zstrm->tfm, src, src_len,
+			dst, &dst_len);
+	if (ret)
+		return ret;
+
+	atomic64_add(local_clock() - start, &comp->stats.decomp_ns);
+	atomic64_add(src_len, &comp->stats.decomp_in);
+
+	/* A stored page must always decompress to exactly one page */
+	return dst_len == PAGE_SIZE ? 0 : -EINVAL;
+}
+
+/*
+ * Change the number of streams. New streams are allocated here, in
+ * process context; idle streams above the new limit are freed right
+ * away and busy ones as they are released.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+	int old_strm, need;
+
+	if (num_strm < 1)
+		return -EINVAL;
+
+	spin_lock(&comp->strm_lock);
+	old_strm = comp->max_strm;
+	comp->max_strm = num_strm;
+	need = num_strm - comp->avail_strm;
+	while (comp->avail_strm > num_strm &&
+			!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+		comp->avail_strm--;
+	}
+	spin_unlock(&comp->strm_lock);
+
+	if (need > 0 && zcomp_strm_add(comp, need)) {
+		spin_lock(&comp->strm_lock);
+		comp->max_strm = old_strm;
+		spin_unlock(&comp->strm_lock);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a pool of max_strm streams using crypto compression
+ * algorithm 'name'. All of them are allocated up front, see
+ * zcomp_strm_alloc().
+ */
+struct zcomp *zcomp_create(const char *name, int max_strm)
+{
+	struct zcomp *comp;
+
+	if (max_strm < 1)
+		max_strm = 1;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	strlcpy(comp->name, name, sizeof(comp->name));
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm;
+
+	if (zcomp_strm_add(comp, max_strm)) {
+		kfree(comp);
+		return NULL;
+	}
+
+	return comp;
+}
@@ -0,0 +1,78 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/atomic.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream: a crypto compression transform plus a buffer
+ * large enough to hold the worst case compressed output of one page.
+ */
+struct zcomp_strm {
+	struct crypto_comp *tfm;
+	void *buffer;
+	struct list_head list;
+};
+
+/*
+ * Cumulative counters for the algorithm in use, so that algorithms
+ * can be compared on real workloads (ratio = comp_out / comp_in,
+ * throughput = bytes / ns).
+ */
+struct zcomp_stats {
+	atomic64_t comp_in;	/* bytes fed to the compressor */
+	atomic64_t comp_out;	/* bytes it produced */
+	atomic64_t comp_ns;	/* time spent compressing */
+	atomic64_t decomp_in;	/* compressed bytes fed to the decompressor */
+	atomic64_t decomp_ns;	/* time spent decompressing */
+};
+
+/*
+ * Pool of compression streams shared by all writers of a device.
+ * A writer grabs an idle stream, compresses and copies the result
+ * out, then puts the stream back. max_strm streams are allocated
+ * up front; when all of them are busy, writers sleep on strm_wait.
+ */
+struct zcomp {
+	char name[CRYPTO_MAX_ALG_NAME];
+	spinlock_t strm_lock;	/* protects idle_strm and avail_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* number of allocated streams */
+	int max_strm;		/* upper limit on avail_strm */
+	struct zcomp_stats stats;
+};
+
+bool zcomp_available_algorithm(const char *name);
+
+struct zcomp *zcomp_create(const char *name, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+/*
+ * Index of compressed objects by content. Compressors are deterministic,
+ * so two pages with equal compressed bytes have equal contents and can
+ * share one zsmalloc object. The tree is keyed by a checksum of the
+ * compressed data; entries with equal checksums are told apart by
+ * comparing the data itself.
+ */
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return jhash(mem, len, 0);
+}
+
+static int zram_dedup_match(struct zram *zram, struct zram_dedup_entry *entry,
+			    const unsigned char *mem, size_t len)
+{
+	int match;
+	unsigned char *cmem;
+
+	if (entry->len != len)
+		return 0;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(cmem + sizeof(struct zobj_header), mem, len);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look for an object holding the same compressed data and take a
+ * reference on it. Returns NULL if there is none.
+ */
+struct zram_dedup_entry *zram_dedup_get(struct zram *zram,
+			const unsigned char *mem, size_t len, u32 checksum)
+{
+	struct rb_node *rb, *first = NULL;
+	struct zram_dedup_entry *entry;
+
+	spin_lock(&zram->dedup_lock);
+
+	/* Find the leftmost entry with this checksum */
+	rb = zram->dedup_tree.rb_node;
+	while (rb) {
+		entry = rb_entry(rb, struct zram_dedup_entry, node);
+		if (checksum <= entry->checksum) {
+			if (checksum == entry->checksum)
+				first = rb;
+			rb = rb->rb_left;
+		} else {
+			rb = rb->rb_right;
+		}
+	}
+
+	for (rb = first; rb; rb = rb_next(rb)) {
+		entry = rb_entry(rb, struct zram_dedup_entry, node);
+		if (entry->checksum != checksum)
+			break;
+		if (zram_dedup_match(zram, entry, mem, len)) {
+			entry->refcount++;
+			atomic_inc(&zram->stats.pages_dup);
+			spin_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+/*
+ * Make the freshly stored object @handle available for sharing. The
+ * returned entry holds one reference. Returns NULL if no memory, in
+ * which case the object is simply not shared.
+ */
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram, void *handle,
+			size_t len, u32 checksum)
+{
+	struct rb_node **link, *parent = NULL;
+	struct zram_dedup_entry *entry, *cur;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->refcount = 1;
+	entry->checksum = checksum;
+	entry->len = len;
+
+	spin_lock(&zram->dedup_lock);
+	link = &zram->dedup_tree.rb_node;
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct zram_dedup_entry, node);
+		if (checksum < cur->checksum)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&entry->node, parent, link);
+	rb_insert_color(&entry->node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		atomic_dec(&zram->stats.pages_dup);
+		spin_unlock(&zram->dedup_lock);
+		return;
+	}
+	rb_erase(&entry->node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+}
@@ -0,0 +1,43 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * A compressed object shared by all table entries whose pages compress
+ * to the same bytes. Such entries carry ZRAM_DEDUP and their handle
+ * points to this instead of to the zsmalloc object.
+ */
+struct zram_dedup_entry {
+	struct rb_node node;	/* in zram->dedup_tree, keyed by checksum */
+	void *handle;		/* zsmalloc handle of the shared object */
+	unsigned long refcount;	/* protected by zram->dedup_lock */
+	u32 checksum;
+	u16 len;		/* compressed length */
+};
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len);
+struct zram_dedup_entry *zram_dedup_get(struct zram *zram,
+			const unsigned char *mem, size_t len, u32 checksum);
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram, void *handle,
+			size_t len, u32 checksum);
+void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry);
+
+#endif /* _ZRAM_DEDUP_H_ */
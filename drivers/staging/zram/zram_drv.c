@@ -22,16 +22,21 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bio.h>
+#include <linux/bit_spinlock.h>
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/memcontrol.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
+#include <linux/time.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -42,14 +47,26 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+/* Default compression algorithm (any crypto API compressor) */
+static const char *default_compressor = "lzo";
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Backing device reads are on the swap-in path, under memory pressure, so
+ * they get a workqueue with a rescuer instead of waiting for a worker to
+ * be created.
+ */
+static struct workqueue_struct *zram_bdev_wq;
+#endif
+
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -71,39 +88,244 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * Each table entry is protected by a bit spinlock in its value word, so
+ * I/O to different slots never contends. The lock holder may update
+ * the other bits of the word non-atomically: everybody else only
+ * touches the word through the lock bit.
+ */
+static void zram_slot_lock(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
+static void zram_slot_unlock(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
+{
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static int page_zero_filled(void *ptr)
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
+{
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page) - 1; pos++) {
+		if (page[pos] != page[pos + 1])
 			return 0;
 	}
 
+	*element = page[0];
+
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long value)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (!value) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	/* I/O is sector aligned, so len is a multiple of the word size */
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
+/* The zsmalloc handle of a compressed page, shared or not */
+static void *zram_zs_handle(struct zram *zram, u32 index)
+{
+	void *handle = zram->table[index].handle;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		return ((struct zram_dedup_entry *)handle)->handle;
+
+	return handle;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_update_access(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = get_seconds();
+}
+
+/*
+ * Block 0 of the backing device is never handed out, so a written
+ * back slot always has a non-NULL handle.
+ */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+
+	while (1) {
+		blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_blocks,
+					     blk_idx);
+		if (blk_idx >= zram->nr_blocks)
+			return 0;
+		if (!test_and_set_bit(blk_idx, zram->bitmap))
+			return blk_idx;
+	}
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk_idx, zram->bitmap));
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bdev_rw_page(struct zram *zram, struct page *page,
+			     unsigned long blk_idx, int rw)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx * SECTORS_PER_PAGE;
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw;
+
+	zw = container_of(work, struct zram_bdev_work, work);
+	zw->ret = zram_bdev_rw_page(zw->zram, zw->page, zw->blk_idx, READ);
+}
+
+/*
+ * Read block @blk_idx of the backing device into @mem.
+ *
+ * Bios submitted from our make_request function are only dispatched
+ * after it returns (see generic_make_request()), so waiting for one
+ * here would deadlock. The read is handed to a worker instead.
+ */
+static int zram_bdev_read(struct zram *zram, unsigned long blk_idx,
+			  unsigned char *mem)
+{
+	struct zram_bdev_work zw;
+	unsigned char *src;
+
+	zw.page = alloc_page(GFP_NOIO);
+	if (!zw.page)
+		return -ENOMEM;
+
+	zw.zram = zram;
+	zw.blk_idx = blk_idx;
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_read_work);
+	queue_work(zram_bdev_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	if (!zw.ret) {
+		src = kmap_atomic(zw.page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+	}
+	__free_page(zw.page);
+
+	return zw.ret;
+}
+#else
+static inline void zram_update_access(struct zram *zram, u32 index) {}
+static inline void zram_free_block(struct zram *zram, unsigned long blk_idx) {}
+static inline int zram_bdev_read(struct zram *zram, unsigned long blk_idx,
+				 unsigned char *mem)
+{
+	return -EIO;
+}
+#endif
+
+/*
+ * Stored objects are charged to the memory cgroup of the page they were
+ * written from. A slot sharing a dedup entry is charged its full size.
+ */
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+static void zram_set_memcg(struct zram *zram, u32 index,
+			   struct mem_cgroup *memcg)
+{
+	zram->table[index].memcg = memcg;
+}
+
+static void zram_uncharge(struct zram *zram, u32 index)
+{
+	struct table *t = &zram->table[index];
+
+	mem_cgroup_uncharge_compressed(t->memcg,
+				       zram_get_obj_size(zram, index));
+	t->memcg = NULL;
+}
+#else
+static inline void zram_set_memcg(struct zram *zram, u32 index,
+				  struct mem_cgroup *memcg) {}
+static inline void zram_uncharge(struct zram *zram, u32 index) {}
+#endif
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,19 +355,35 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/* Called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/* Any writeback in flight for this slot is now stale */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_block(zram, (unsigned long)handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].handle = NULL;
 		return;
 	}
 
@@ -156,227 +394,186 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	zs_free(zram->mem_pool, handle);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_dedup_put(zram, handle);
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
 
-	if (zram->table[index].size <= PAGE_SIZE / 2)
+	if (zram_get_obj_size(zram, index) <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
+			zram_get_obj_size(zram, index));
 	zram_stat_dec(&zram->stats.pages_stored);
 
+	zram_uncharge(zram, index);
 	zram->table[index].handle = NULL;
-	zram->table[index].size = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
-{
-	struct page *page = bvec->bv_page;
-	void *user_mem;
-
-	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	kunmap_atomic(user_mem);
-
-	flush_dcache_page(page);
-}
-
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+static inline int is_partial_io(struct bio_vec *bvec)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
-
-	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].handle);
-
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem);
-	kunmap_atomic(user_mem);
-
-	flush_dcache_page(page);
+	return bvec->bv_len != PAGE_SIZE;
 }
 
-static inline int is_partial_io(struct bio_vec *bvec)
+/* Unlocked peek: does reading this slot need a compression stream? */
+static int zram_slot_compressed(struct zram *zram, u32 index)
 {
-	return bvec->bv_len != PAGE_SIZE;
+	return zram->table[index].handle &&
+		!zram_test_flag(zram, index, ZRAM_SAME) &&
+		!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) &&
+		!zram_test_flag(zram, index, ZRAM_WB);
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+/*
+ * Read the full page stored in slot @index into @mem. A compression
+ * stream is taken into *@zstrmp if needed and none is there yet; the
+ * caller releases it, so one stream can serve a whole batch of pages.
+ */
+static int zram_read_page(struct zram *zram, unsigned char *mem, u32 index,
+			  struct zcomp_strm **zstrmp)
 {
-	int ret;
-	size_t clen;
-	struct page *page;
+	int ret = 0;
+	void *handle;
+	unsigned long blk_idx;
 	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *cmem;
 
-	page = bvec->bv_page;
+	/* Finding a stream may sleep, so do it before taking the slot lock */
+	if (!*zstrmp && zram_slot_compressed(zram, index))
+		*zstrmp = zcomp_strm_find(zram->comp);
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
-	}
+retry:
+	zram_slot_lock(zram, index);
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
-		return 0;
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		goto out;
 	}
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
+	/* Requested page is not present in compressed area */
+	if (!zram->table[index].handle) {
+		memset(mem, 0, PAGE_SIZE);
+		goto out;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
+	/*
+	 * Page was moved out to the backing device. The read sleeps, so
+	 * drop the slot lock first; a racing free or rewrite of the slot
+	 * is a race of the caller with itself, as on any block device.
+	 */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		blk_idx = (unsigned long)zram->table[index].handle;
+		zram_slot_unlock(zram, index);
+
+		ret = zram_bdev_read(zram, blk_idx, mem);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, page=%u\n",
+			       ret, index);
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
 		}
-	}
-
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-	clen = PAGE_SIZE;
-
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
-
-	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
-		kfree(uncmem);
-	}
-
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-	kunmap_atomic(user_mem);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
 	}
 
-	flush_dcache_page(page);
-
-	return 0;
-}
-
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
-{
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
-
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].handle);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem);
-		return 0;
+		goto out;
+	}
+
+	/* The slot was rewritten with a compressed page since we peeked */
+	if (!*zstrmp) {
+		zram_slot_unlock(zram, index);
+		*zstrmp = zcomp_strm_find(zram->comp);
+		goto retry;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+	handle = zram_zs_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, *zstrmp, cmem + sizeof(*zheader),
+			       zram_get_obj_size(zram, index), mem);
+	zs_unmap_object(zram->mem_pool, handle);
+
+out:
+	zram_slot_unlock(zram, index);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
 	}
 
-	return 0;
+	return ret;
 }
 
-static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
-			   int offset)
+/*
+ * Store the full page @page, or @buf if @page is NULL, in slot @index.
+ * The stored size is charged to the memory cgroup of @owner, which is
+ * @page itself unless the data was gathered in a staging buffer.
+ *
+ * Compression runs on a stream taken from zram->comp, so writers to
+ * different pages compress in parallel. As for zram_read_page() the
+ * stream is kept in *@zstrmp for the caller to release. The slot lock
+ * is only held for the table update at the end.
+ */
+static int zram_write_page(struct zram *zram, struct zcomp_strm **zstrmp,
+			   struct page *page, unsigned char *buf,
+			   struct page *owner, u32 index)
 {
-	int ret;
-	u32 store_offset;
+	int ret = 0;
+	int uncompressed = 0, shared = 0;
 	size_t clen;
+	u32 checksum = 0;
+	unsigned long element;
 	void *handle;
+	struct zram_dedup_entry *entry;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
-	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	struct mem_cgroup *memcg;
+	struct page *page_store;
+	struct zcomp_strm *zstrm;
+	unsigned char *user_mem = NULL, *cmem, *src, *uncmem;
+
+	/* Finding a stream may sleep, so do it before kmap_atomic() */
+	if (!*zstrmp)
+		*zstrmp = zcomp_strm_find(zram->comp);
+	zstrm = *zstrmp;
+	src = zstrm->buffer;
+
+	if (page)
+		uncmem = user_mem = kmap_atomic(page);
+	else
+		uncmem = buf;
 
-	page = bvec->bv_page;
-	src = zram->compress_buffer;
+	if (page_same_filled(uncmem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem);
 
-	if (is_partial_io(bvec)) {
+		zram_slot_lock(zram, index);
 		/*
-		 * This is a partial IO. We need to read the full page
-		 * before to write the changes.
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			ret = -ENOMEM;
-			goto out;
-		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
-			goto out;
-		}
-	}
-
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
 		zram_free_page(zram, index);
-
-	user_mem = kmap_atomic(page);
-
-	if (is_partial_io(bvec))
-		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
-		       bvec->bv_len);
-	else
-		uncmem = user_mem;
-
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
+		zram_stat_inc(&zram->stats.pages_same);
+		zram->table[index].element = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_slot_unlock(zram, index);
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
-	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (user_mem)
+		kunmap_atomic(user_mem);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -388,21 +585,47 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 */
 	if (unlikely(clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
+		uncompressed = 1;
+	}
+
+	/* Fails if the owner's cgroup is over its compressed memory limit */
+	memcg = mem_cgroup_compressed_owner(owner);
+	ret = mem_cgroup_charge_compressed(memcg, clen);
+	mem_cgroup_compressed_owner_put(memcg);
+	if (ret)
+		goto out;
+
+	if (uncompressed) {
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
-			goto out;
+			goto uncharge;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
 		handle = page_store;
-		src = kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
-		goto memstore;
+		if (page) {
+			src = kmap_atomic(page);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(src);
+		} else {
+			memcpy(cmem, buf, PAGE_SIZE);
+		}
+		kunmap_atomic(cmem);
+		goto update;
+	}
+
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(src, clen);
+		entry = zram_dedup_get(zram, src, clen, checksum);
+		if (entry) {
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			handle = entry;
+			shared = 1;
+			goto update;
+		}
 	}
 
 	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
@@ -410,31 +633,47 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		ret = -ENOMEM;
-		goto out;
+		goto uncharge;
 	}
-	cmem = zs_map_object(zram->mem_pool, handle);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-memstore:
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
 	memcpy(cmem, src, clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, handle);
+	if (zram->use_dedup) {
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+		if (entry) {
+			handle = entry;
+			shared = 1;
+		}
 	}
 
+update:
+	zram_slot_lock(zram, index);
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_free_page(zram, index);
+
 	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	zram_set_obj_size(zram, index, clen);
+	zram_set_memcg(zram, index, memcg);
+	zram_update_access(zram, index);
+	if (shared)
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	if (uncompressed) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	}
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
@@ -442,27 +681,129 @@ memstore:
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
+	zram_slot_unlock(zram, index);
 	return 0;
 
+uncharge:
+	mem_cgroup_uncharge_compressed(memcg, clen);
 out:
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+/*
+ * A bio is served as a batch: one compression stream is taken for all
+ * of its pages, and segments smaller than a page are gathered in a
+ * staging page, so a zram page is decompressed and compressed at most
+ * once however many segments it is split into.
+ */
+struct zram_batch {
+	struct zcomp_strm *zstrm;
+	unsigned char *buf;	/* staging page for partial segments */
+	u32 index;		/* slot held in buf */
+	int staged;
+	struct page *owner;	/* last page written into buf */
+};
+
+/* Write back the staged page, if any */
+static int zram_batch_flush(struct zram *zram, struct zram_batch *batch,
+			    int rw)
+{
+	int ret = 0;
+
+	if (batch->staged && rw == WRITE)
+		ret = zram_write_page(zram, &batch->zstrm, NULL, batch->buf,
+				      batch->owner, batch->index);
+	batch->staged = 0;
+
+	return ret;
+}
+
+static int zram_batch_stage(struct zram *zram, struct zram_batch *batch,
+			    struct bio *bio, u32 index, int rw)
 {
 	int ret;
+	u64 start, end, page_start;
+
+	if (batch->staged && batch->index == index)
+		return 0;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
+	ret = zram_batch_flush(zram, batch, rw);
+	if (ret)
+		return ret;
+
+	if (!batch->buf) {
+		batch->buf = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!batch->buf) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	/*
+	 * A write needs the old contents only if the bio does not cover
+	 * the whole page.
+	 */
+	start = (u64)bio->bi_sector << SECTOR_SHIFT;
+	end = start + bio->bi_size;
+	page_start = (u64)index << PAGE_SHIFT;
+	if (rw == READ || start > page_start ||
+	    end < page_start + PAGE_SIZE) {
+		ret = zram_read_page(zram, batch->buf, index, &batch->zstrm);
+		if (ret)
+			return ret;
+	}
+
+	batch->index = index;
+	batch->staged = 1;
+
+	return 0;
+}
+
+static void zram_batch_end(struct zram *zram, struct zram_batch *batch)
+{
+	kfree(batch->buf);
+	if (batch->zstrm)
+		zcomp_strm_release(zram->comp, batch->zstrm);
+}
+
+static int zram_bvec_rw(struct zram *zram, struct zram_batch *batch,
+			struct bio_vec *bvec, u32 index, int offset,
+			struct bio *bio, int rw)
+{
+	int ret;
+	struct page *page = bvec->bv_page;
+	unsigned char *user_mem;
+
+	if (!is_partial_io(bvec)) {
+		if (rw == WRITE)
+			return zram_write_page(zram, &batch->zstrm, page, NULL,
+					       page, index);
+
+		user_mem = kmap(page);
+		ret = zram_read_page(zram, user_mem, index, &batch->zstrm);
+		kunmap(page);
 	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+		ret = zram_batch_stage(zram, batch, bio, index, rw);
+		if (ret)
+			return ret;
+
+		user_mem = kmap_atomic(page);
+		if (rw == READ)
+			memcpy(user_mem + bvec->bv_offset,
+			       batch->buf + offset, bvec->bv_len);
+		else
+			memcpy(batch->buf + offset,
+			       user_mem + bvec->bv_offset, bvec->bv_len);
+		kunmap_atomic(user_mem);
+		if (rw == WRITE)
+			batch->owner = page;
+	}
+
+	if (!ret && rw == READ) {
+		zram_update_access(zram, index);
+		flush_dcache_page(page);
 	}
 
 	return ret;
@@ -480,6 +821,7 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 	int i, offset;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_batch batch = { .zstrm = NULL, .buf = NULL, .staged = 0 };
 
 	switch (rw) {
 	case READ:
@@ -507,26 +849,33 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 			bv.bv_len = max_transfer_size;
 			bv.bv_offset = bvec->bv_offset;
 
-			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw) < 0)
+			if (zram_bvec_rw(zram, &batch, &bv, index, offset,
+					 bio, rw) < 0)
 				goto out;
 
 			bv.bv_len = bvec->bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
-			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw) < 0)
+			if (zram_bvec_rw(zram, &batch, &bv, index + 1, 0,
+					 bio, rw) < 0)
 				goto out;
 		} else
-			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw)
-			    < 0)
+			if (zram_bvec_rw(zram, &batch, bvec, index, offset,
+					 bio, rw) < 0)
 				goto out;
 
 		update_position(&index, &offset, bvec);
 	}
 
+	if (zram_batch_flush(zram, &batch, rw) < 0)
+		goto out;
+	zram_batch_end(zram, &batch);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+	zram_batch_end(zram, &batch);
 	bio_io_error(bio);
 }
 
@@ -577,30 +926,225 @@ error:
 	bio_io_error(bio);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static bool zram_wb_candidate(struct zram *zram, u32 index, u32 now)
+{
+	struct table *t = &zram->table[index];
+
+	if (!t->handle || (t->value & (BIT(ZRAM_SAME) | BIT(ZRAM_WB) |
+				       BIT(ZRAM_UNDER_WB))))
+		return false;
+
+	if (t->value & BIT(ZRAM_UNCOMPRESSED))
+		return true;
+
+	return zram->wb_idle_secs && now - t->ac_time >= zram->wb_idle_secs;
+}
+
+/*
+ * Move incompressible pages, and pages idle for more than wb_idle_secs,
+ * to the backing device. The slot is marked ZRAM_UNDER_WB while the
+ * bio is in flight; if the slot gets freed or rewritten meanwhile the
+ * mark is gone and the copy on the backing device is dropped.
+ */
+static void zram_writeback_work(struct work_struct *work)
+{
+	int ret;
+	u32 now;
+	size_t index, num_pages;
+	unsigned long blk_idx;
+	unsigned char *mem;
+	struct page *page;
+	struct zcomp_strm *zstrm;
+	struct zram *zram;
+
+	zram = container_of(to_delayed_work(work), struct zram, wb_work);
+
+	/* Reset holds init_lock for write while it cancels us */
+	if (!down_read_trylock(&zram->init_lock)) {
+		queue_delayed_work(system_long_wq, &zram->wb_work, HZ);
+		return;
+	}
+
+	if (!zram->init_done || !zram->bdev)
+		goto out;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		goto requeue;
+
+	now = get_seconds();
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < num_pages; index++) {
+		cond_resched();
+
+		/* Unlocked peek, so most slots cost no lock round trip */
+		if (!zram_wb_candidate(zram, index, now))
+			continue;
+
+		zram_slot_lock(zram, index);
+		if (!zram_wb_candidate(zram, index, now)) {
+			zram_slot_unlock(zram, index);
+			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_slot_unlock(zram, index);
+
+		zstrm = NULL;
+		mem = kmap(page);
+		ret = zram_read_page(zram, mem, index, &zstrm);
+		kunmap(page);
+		if (zstrm)
+			zcomp_strm_release(zram->comp, zstrm);
+
+		blk_idx = 0;
+		if (!ret) {
+			blk_idx = zram_alloc_block(zram);
+			if (blk_idx &&
+			    zram_bdev_rw_page(zram, page, blk_idx, WRITE)) {
+				zram_free_block(zram, blk_idx);
+				blk_idx = 0;
+			}
+		}
+
+		zram_slot_lock(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_slot_unlock(zram, index);
+			if (blk_idx)
+				zram_free_block(zram, blk_idx);
+			continue;
+		}
+
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		if (blk_idx) {
+			zram_free_page(zram, index);
+			zram->table[index].handle = (void *)blk_idx;
+			zram_set_flag(zram, index, ZRAM_WB);
+			zram_stat_inc(&zram->stats.pages_wb);
+			zram_stat64_inc(zram, &zram->stats.bd_writes);
+		}
+		zram_slot_unlock(zram, index);
+
+		/* Backing device is full */
+		if (!ret && !blk_idx)
+			break;
+	}
+
+	__free_page(page);
+requeue:
+	queue_delayed_work(system_long_wq, &zram->wb_work, ZRAM_WB_PERIOD);
+out:
+	up_read(&zram->init_lock);
+}
+
+/* Run the writeback worker now. Called with init_lock held. */
+void zram_kick_writeback(struct zram *zram)
+{
+	cancel_delayed_work(&zram->wb_work);
+	queue_delayed_work(system_long_wq, &zram->wb_work, 0);
+}
+
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+}
+
+/* Called with init_lock held for write on an uninitialized device */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+	struct inode *inode;
+	struct file *file;
+
+	file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	inode = file->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto out;
+
+	/* Block 0 is reserved, see zram_alloc_block() */
+	nr_blocks = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		ret = -EINVAL;
+		goto put;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto put;
+	}
+
+	zram_reset_backing_dev(zram);
+	zram->backing_dev = file;
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_blocks = nr_blocks;
+
+	pr_info("Using backing device %s (%lu pages)\n", path, nr_blocks);
+	return 0;
+
+put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out:
+	filp_close(file, NULL);
+	return ret;
+}
+#else
+static inline void zram_reset_backing_dev(struct zram *zram) {}
+#endif
+
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
 	zram->init_done = 0;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->wb_work);
+#endif
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
+		else if (zram_test_flag(zram, index, ZRAM_DEDUP))
+			zram_dedup_put(zram, handle);
 		else
 			zs_free(zram->mem_pool, handle);
+		zram_uncharge(zram, index);
 	}
+	zram->dedup_tree = RB_ROOT;
 
 	vfree(zram->table);
 	zram->table = NULL;
@@ -608,6 +1152,8 @@ void __zram_reset_device(struct zram *zram)
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	zram_reset_backing_dev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -635,17 +1181,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -671,6 +1209,11 @@ int zram_init_device(struct zram *zram)
 	}
 
 	zram->init_done = 1;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->bdev)
+		queue_delayed_work(system_long_wq, &zram->wb_work,
+				   ZRAM_WB_PERIOD);
+#endif
 	up_write(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -692,7 +1235,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_slot_lock(zram, index);
 	zram_free_page(zram, index);
+	zram_slot_unlock(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -705,9 +1250,16 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_tree = RB_ROOT;
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
+#ifdef CONFIG_ZRAM_WRITEBACK
+	INIT_DELAYED_WORK(&zram->wb_work, zram_writeback_work);
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -795,11 +1347,20 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_bdev_wq = alloc_workqueue("zram_bdev",
+				       WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!zram_bdev_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+#endif
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_wq;
 	}
 
 	if (!num_devices) {
@@ -829,6 +1390,10 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_wq:
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_bdev_wq);
+#endif
 out:
 	return ret;
 }
@@ -847,6 +1412,9 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_bdev_wq);
+#endif
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
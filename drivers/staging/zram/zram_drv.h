@@ -15,10 +15,15 @@
 #ifndef _ZRAM_DRV_H_
 #define _ZRAM_DRV_H_
 
+#include <linux/atomic.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -55,6 +60,14 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
  * otherwise, xv_malloc() would always return failure.
  */
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * How often the writeback worker scans the table for pages to move
+ * to the backing device.
+ */
+#define ZRAM_WB_PERIOD		(60 * HZ)
+#endif
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -66,13 +79,31 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size,
+ * the upper bits the zram_pageflags below.
+ */
+#define ZRAM_FLAG_SHIFT		24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
+	/* Slot lock, see zram_slot_lock() */
+	ZRAM_ACCESS = ZRAM_FLAG_SHIFT,
+
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one word repeated; the word is kept in table.element */
+	ZRAM_SAME,
+
+	/* Object is shared; handle points to a struct zram_dedup_entry */
+	ZRAM_DEDUP,
+
+	/* Page lives on the backing device; handle is the block index */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -81,11 +112,18 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	void *handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	union {
+		void *handle;
+		unsigned long element;	/* fill word of a ZRAM_SAME page */
+	};
+	unsigned long value;	/* object size (excluding header) and flags */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;	/* last access, in seconds (idle tracking) */
+#endif
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+	struct mem_cgroup *memcg;	/* charged for the stored object */
+#endif
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -95,20 +133,23 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 dedup_hits;		/* writes that found an identical object */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of same element filled pages */
+	atomic_t pages_dup;	/* no. of pages sharing an object */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zcomp *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +160,20 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	int max_comp_streams;	/* limit on parallel compressions */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	int use_dedup;		/* share objects of identical pages */
+	spinlock_t dedup_lock;	/* protect dedup_tree and entry refcounts */
+	struct rb_root dedup_tree;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Backing device; set and cleared under init_lock */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned long *bitmap;	/* blocks in use on the backing device */
+	unsigned long nr_blocks;
+	unsigned int wb_idle_secs; /* idle time before writeback, 0: never */
+	struct delayed_work wb_work;
+#endif
 
 	struct zram_stats stats;
 };
@@ -131,5 +186,9 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_kick_writeback(struct zram *zram);
+#endif
 
 #endif
@@ -27,6 +27,8 @@
 #include <linux/cpumask.h>
 #include <linux/cpu.h>
 #include <linux/vmalloc.h>
+#include <linux/bit_spinlock.h>
+#include <linux/sched.h>
 
 #include "zsmalloc.h"
 #include "zsmalloc_int.h"
@@ -43,6 +45,17 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/*
+ * Whether objects crossing page boundaries are mapped by copying them
+ * to mapping_area->vm_buf rather than through page tables. Which one is
+ * faster depends on the CPU (TLB flush vs memcpy cost), so zs_init()
+ * times both and picks one.
+ */
+static bool zs_map_by_copy;
+
+/* handles (see zsmalloc_int.h) are allocated from here */
+static struct kmem_cache *zs_handle_cachep;
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -230,30 +243,54 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
 
-	return (void *)handle;
+	return obj << OBJ_TAG_BITS;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
+}
+
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +367,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = (void *)location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +378,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = (void *)location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,7 +433,7 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
 	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
 
@@ -425,6 +462,475 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/*
+ * Take the first free object of the given zspage and record @handle
+ * in its header. Called with class->lock held.
+ */
+static unsigned long obj_malloc(struct page *first_page,
+				struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+	void *vaddr;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)(vaddr + m_offset);
+	first_page->freelist = link->next;
+	link->handle = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(vaddr);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj;
+}
+
+/* Return obj to its zspage's freelist. Called with class->lock held. */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	vaddr = kmap_atomic(f_page);
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = first_page->freelist;
+	kunmap_atomic(vaddr);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
+/*
+ * Compaction
+ *
+ * Objects are moved out of sparsely used (ZS_ALMOST_EMPTY) zspages into
+ * the free slots of fuller zspages of the same size class, and the
+ * emptied zspages are freed. Pinned objects (mapped or being freed)
+ * are skipped.
+ */
+
+struct zs_compact_control {
+	/* source sub-page being scanned and object index to resume at */
+	struct page *s_page;
+	int index;
+	/* destination zspage (first page) */
+	struct page *d_page;
+};
+
+/* Number of pages compaction could free in this class */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long objs_per_zspage, objs_allocated, objs_wasted;
+
+	objs_per_zspage = class->zspage_order * PAGE_SIZE / class->size;
+	objs_allocated = (unsigned long)class->pages_allocated /
+				class->zspage_order * objs_per_zspage;
+	if (objs_allocated <= class->objs_inuse)
+		return 0;
+
+	objs_wasted = objs_allocated - class->objs_inuse;
+	return objs_wasted / objs_per_zspage * class->zspage_order;
+}
+
+/*
+ * Copy an object between two locations of the same class. Either end
+ * may span two pages.
+ */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be released in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Find the next allocated object starting in @page at or after object
+ * index *@index, and pin it. Returns its handle, or 0 if there is none.
+ */
+static unsigned long find_alloced_obj(struct page *page, int *index,
+					struct size_class *class)
+{
+	unsigned long head, handle = 0;
+	unsigned long offset;
+	void *addr;
+
+	offset = obj_idx_to_offset(page, *index, class->size);
+	addr = kmap_atomic(page);
+
+	while (offset < PAGE_SIZE) {
+		/* the tail of the last page is unused space, not an object */
+		if (is_last_page(page) && offset + class->size > PAGE_SIZE)
+			break;
+
+		head = ((struct link_free *)(addr + offset))->handle;
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+
+		offset += class->size;
+		(*index)++;
+	}
+
+	kunmap_atomic(addr);
+	return handle;
+}
+
+/*
+ * Move objects from cc->s_page onwards into cc->d_page. Returns 0 once
+ * the whole source zspage has been scanned, -ENOMEM if the destination
+ * filled up first.
+ */
+static int migrate_zspage(struct size_class *class,
+				struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj, handle;
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	int index = cc->index;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(s_page, &index, class);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			index = 0;
+			continue;
+		}
+
+		if (d_page->inuse == d_page->objects) {
+			unpin_tag(handle);
+			ret = -ENOMEM;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(d_page, class, handle);
+		zs_object_copy(free_obj, used_obj, class);
+		index++;
+		/*
+		 * The copy above also copied the header, which must keep
+		 * pointing at the handle: rewrite it after the copy.
+		 */
+		record_obj(handle, free_obj | (1UL << HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	cc->s_page = s_page;
+	cc->index = index;
+
+	return ret;
+}
+
+static struct page *isolate_source_page(struct size_class *class)
+{
+	struct page *page;
+
+	page = class->fullness_list[ZS_ALMOST_EMPTY];
+	if (page)
+		remove_zspage(page, class, ZS_ALMOST_EMPTY);
+
+	return page;
+}
+
+static struct page *isolate_target_page(struct size_class *class)
+{
+	int i;
+	struct page *page;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		page = class->fullness_list[i];
+		if (page) {
+			remove_zspage(page, class, i);
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+/* Return an isolated zspage to the list matching its current fullness */
+static enum fullness_group putback_zspage(struct size_class *class,
+					struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	if (fullness == ZS_EMPTY)
+		class->pages_allocated -= class->zspage_order;
+
+	return fullness;
+}
+
+static unsigned long __zs_compact(struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page, *dst_page;
+	unsigned long nr_freed = 0;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		src_page = isolate_source_page(class);
+		if (!src_page)
+			break;
+
+		cc.s_page = src_page;
+		cc.index = 0;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_page = dst_page;
+			if (!migrate_zspage(class, &cc))
+				break;
+			putback_zspage(class, dst_page);
+		}
+
+		if (dst_page)
+			putback_zspage(class, dst_page);
+
+		/*
+		 * Stop if we ran out of destination slots or some objects
+		 * were pinned: retrying right away would not do better.
+		 */
+		if (putback_zspage(class, src_page) != ZS_EMPTY)
+			break;
+
+		spin_unlock(&class->lock);
+		free_zspage(src_page);
+		nr_freed += class->zspage_order;
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return nr_freed;
+}
+
+/**
+ * zs_compact - Compact all size classes of a pool.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed. May sleep.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long nr_freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		nr_freed += __zs_compact(&pool->size_class[i]);
+
+	atomic_long_add(nr_freed, &pool->pages_compacted);
+
+	return nr_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/* Total number of pages freed by compaction over the pool's lifetime */
+unsigned long zs_get_pages_compacted(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_pages_compacted);
+
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	int i;
+	unsigned long nr_compactable = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	/* racy, but only used as a hint by the VM */
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		nr_compactable += zs_can_compact(&pool->size_class[i]);
+
+	return min_t(unsigned long, nr_compactable, INT_MAX);
+}
+
+
+static void __zs_map_pte(struct mapping_area *area, struct page *pages[2])
+{
+	set_pte(area->vm_ptes[0], mk_pte(pages[0], PAGE_KERNEL));
+	set_pte(area->vm_ptes[1], mk_pte(pages[1], PAGE_KERNEL));
+
+	/* We pre-allocated VM area so mapping can never fail */
+	area->vm_addr = area->vm->addr;
+}
+
+static void __zs_unmap_pte(struct mapping_area *area)
+{
+	set_pte(area->vm_ptes[0], __pte(0));
+	set_pte(area->vm_ptes[1], __pte(0));
+	__flush_tlb_one((unsigned long)area->vm_addr);
+	__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+}
+
+/*
+ * Copy @size bytes at offset @off of the two pages @pages to @buf, or
+ * from @buf back to the pages if @to_pages is set.
+ */
+static void __zs_copy(char *buf, struct page *pages[2], int off, int size,
+			bool to_pages)
+{
+	int first = 0;
+	char *addr;
+
+	if (off < PAGE_SIZE) {
+		first = min_t(int, size, PAGE_SIZE - off);
+		addr = kmap_atomic(pages[0]);
+		if (to_pages)
+			memcpy(addr + off, buf, first);
+		else
+			memcpy(buf, addr + off, first);
+		kunmap_atomic(addr);
+	}
+
+	if (size > first) {
+		addr = kmap_atomic(pages[1]);
+		off = off + first - PAGE_SIZE;
+		if (to_pages)
+			memcpy(addr + off, buf + first, size - first);
+		else
+			memcpy(buf + first, addr + off, size - first);
+		kunmap_atomic(addr);
+	}
+}
+
+#define ZS_MAP_BENCH_LOOPS	1000
+
+/*
+ * Time mapping and unmapping (read-write) a half page object that
+ * crosses a page boundary both ways on this CPU, and use the faster.
+ */
+static void zs_select_map_mode(void)
+{
+	int i, off, size = PAGE_SIZE / 2;
+	u64 start, pte_ns, copy_ns;
+	struct page *pages[2];
+	struct mapping_area *area;
+	char *addr;
+
+	pages[0] = alloc_page(GFP_KERNEL);
+	pages[1] = alloc_page(GFP_KERNEL);
+	if (!pages[0] || !pages[1])
+		goto out;
+
+	off = PAGE_SIZE - size / 2;
+	area = &get_cpu_var(zs_map_area);
+
+	start = local_clock();
+	for (i = 0; i < ZS_MAP_BENCH_LOOPS; i++) {
+		__zs_map_pte(area, pages);
+		addr = area->vm_addr + off;
+		addr[0] = addr[size - 1];
+		__zs_unmap_pte(area);
+	}
+	pte_ns = local_clock() - start;
+
+	start = local_clock();
+	for (i = 0; i < ZS_MAP_BENCH_LOOPS; i++) {
+		__zs_copy(area->vm_buf, pages, off, size, false);
+		addr = area->vm_buf;
+		addr[0] = addr[size - 1];
+		__zs_copy(area->vm_buf, pages, off, size, true);
+	}
+	copy_ns = local_clock() - start;
+
+	put_cpu_var(zs_map_area);
+
+	zs_map_by_copy = copy_ns < pte_ns;
+	pr_info("zsmalloc: mapping objects across pages by %s "
+		"(%llu ns copying, %llu ns page tables per %d maps)\n",
+		zs_map_by_copy ? "copying" : "page tables",
+		copy_ns, pte_ns, ZS_MAP_BENCH_LOOPS);
+out:
+	if (pages[0])
+		__free_page(pages[0]);
+	if (pages[1])
+		__free_page(pages[1]);
+}
 
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
@@ -435,11 +941,17 @@ static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 	switch (action) {
 	case CPU_UP_PREPARE:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			break;
-		area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
-		if (!area->vm)
-			return notifier_from_errno(-ENOMEM);
+		if (!area->vm) {
+			area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
+			if (!area->vm)
+				return notifier_from_errno(-ENOMEM);
+		}
+		if (!area->vm_buf) {
+			/* the largest object (ZS_MAX_ALLOC_SIZE) fits */
+			area->vm_buf = (char *)__get_free_page(GFP_KERNEL);
+			if (!area->vm_buf)
+				return notifier_from_errno(-ENOMEM);
+		}
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
@@ -447,6 +959,8 @@ static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 		if (area->vm)
 			free_vm_area(area->vm);
 		area->vm = NULL;
+		free_page((unsigned long)area->vm_buf);
+		area->vm_buf = NULL;
 		break;
 	}
 
@@ -464,18 +978,29 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
+	zs_handle_cachep = NULL;
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
 		if (notifier_to_errno(ret))
 			goto fail;
 	}
+
+	zs_select_map_mode();
 	return 0;
 fail:
 	zs_exit();
@@ -514,6 +1039,10 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 	pool->flags = flags;
 	pool->name = name;
 
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -522,6 +1051,8 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -542,28 +1073,31 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, a handle to the allocated object is returned; it stays
+ * valid even if compaction moves the object. On failure, NULL is
+ * returned.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+					pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
 		return NULL;
 
+	/* extra space in the object header to store the handle */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
@@ -574,79 +1108,77 @@ void *zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			kmem_cache_free(zs_handle_cachep, (void *)handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->zspage_order;
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+	obj = obj_malloc(first_page, class, handle);
+	record_obj(handle, obj);
 
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return (void *)handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *handle)
 {
-	struct link_free *link;
+	unsigned long obj;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	unsigned long f_objidx;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* Keep compaction from moving the object under us */
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
 
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->zspage_order;
 
 	spin_unlock(&class->lock);
+	unpin_tag((unsigned long)handle);
+
+	kmem_cache_free(zs_handle_cachep, handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
-void *zs_map_object(struct zs_pool *pool, void *handle)
+/*
+ * The object is pinned from zs_map_object() until zs_unmap_object(),
+ * so compaction will not move it while it is being accessed.
+ *
+ * @mm tells how the object is going to be accessed, see enum zs_mapmode.
+ */
+void *zs_map_object(struct zs_pool *pool, void *handle, enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -655,61 +1187,69 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
+	area->vm_handle = (unsigned long)handle;
+	area->vm_pages[0] = page;
+	area->vm_off = off;
+	area->vm_size = class->size;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-	} else {
-		/* this object spans two pages */
-		struct page *nextp;
-
-		nextp = get_next_page(page);
-		BUG_ON(!nextp);
-
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
+	}
 
-		set_pte(area->vm_ptes[0], mk_pte(page, PAGE_KERNEL));
-		set_pte(area->vm_ptes[1], mk_pte(nextp, PAGE_KERNEL));
+	/* this object spans two pages */
+	area->vm_pages[1] = get_next_page(page);
+	BUG_ON(!area->vm_pages[1]);
 
-		/* We pre-allocated VM area so mapping can never fail */
-		area->vm_addr = area->vm->addr;
+	if (!zs_map_by_copy) {
+		__zs_map_pte(area, area->vm_pages);
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
-	return area->vm_addr + off;
+	/* the object header is of no interest to the caller */
+	area->vm_mm = mm;
+	if (mm != ZS_MM_WO)
+		__zs_copy(area->vm_buf + ZS_HANDLE_SIZE, area->vm_pages,
+			off + ZS_HANDLE_SIZE, class->size - ZS_HANDLE_SIZE,
+			false);
+
+	return area->vm_buf + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, void *handle)
 {
-	struct page *page;
-	unsigned long obj_idx, off;
-
-	unsigned int class_idx;
-	enum fullness_group fg;
-	struct size_class *class;
 	struct mapping_area *area;
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
-	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
-	off = obj_idx_to_offset(page, obj_idx, class->size);
-
+	/*
+	 * The object stays pinned and this CPU cannot be left while it is
+	 * mapped, so the location zs_map_object() decoded is still valid.
+	 */
 	area = &__get_cpu_var(zs_map_area);
-	if (off + class->size <= PAGE_SIZE) {
+	BUG_ON(area->vm_handle != (unsigned long)handle);
+
+	if (area->vm_off + area->vm_size <= PAGE_SIZE) {
 		kunmap_atomic(area->vm_addr);
-	} else {
-		set_pte(area->vm_ptes[0], __pte(0));
-		set_pte(area->vm_ptes[1], __pte(0));
-		__flush_tlb_one((unsigned long)area->vm_addr);
-		__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+	} else if (!zs_map_by_copy) {
+		__zs_unmap_pte(area);
+	} else if (area->vm_mm != ZS_MM_RO) {
+		__zs_copy(area->vm_buf + ZS_HANDLE_SIZE, area->vm_pages,
+			area->vm_off + ZS_HANDLE_SIZE,
+			area->vm_size - ZS_HANDLE_SIZE, true);
 	}
+	area->vm_handle = 0;
 	put_cpu_var(zs_map_area);
+	unpin_tag((unsigned long)handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -15,6 +15,18 @@
 
 #include <linux/types.h>
 
+/*
+ * How a mapped object is going to be accessed. Objects spanning two
+ * pages may be mapped by copying them to a per-cpu buffer: ZS_MM_RO
+ * then skips the copy back in zs_unmap_object() and ZS_MM_WO skips
+ * copying the old contents in.
+ */
+enum zs_mapmode {
+	ZS_MM_RW,
+	ZS_MM_RO,
+	ZS_MM_WO
+};
+
 struct zs_pool;
 
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags);
@@ -23,9 +35,13 @@ void zs_destroy_pool(struct zs_pool *pool);
 void *zs_malloc(struct zs_pool *pool, size_t size);
 void zs_free(struct zs_pool *pool, void *obj);
 
-void *zs_map_object(struct zs_pool *pool, void *handle);
+void *zs_map_object(struct zs_pool *pool, void *handle,
+			enum zs_mapmode mm);
 void zs_unmap_object(struct zs_pool *pool, void *handle);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool);
 
+unsigned long zs_compact(struct zs_pool *pool);
+unsigned long zs_get_pages_compacted(struct zs_pool *pool);
+
 #endif
@@ -14,6 +14,7 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
@@ -34,13 +35,22 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single unsigned long 'obj' value.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Objects can be moved by compaction, so the handle returned to users
+ * is not the obj itself but a pointer to a word holding it. The low
+ * OBJ_TAG_BITS of an obj are always zero:
+ *  - in the handle word, bit HANDLE_PIN_BIT pins the object in place
+ *    while it is mapped, freed or migrated.
+ *  - the first word of every allocated object holds its handle with
+ *    OBJ_ALLOCATED_TAG set, which lets compaction tell allocated
+ *    objects from free ones (whose first word is a freelist link).
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +65,14 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+#define HANDLE_PIN_BIT		0
+#define OBJ_ALLOCATED_TAG	1
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -110,9 +125,16 @@ enum fullness_group {
 static const int fullness_threshold_frac = 4;
 
 struct mapping_area {
-	struct vm_struct *vm;
+	struct vm_struct *vm;	/* for mapping through page tables */
 	pte_t *vm_ptes[2];
-	char *vm_addr;
+	char *vm_buf;		/* for mapping by copying */
+	char *vm_addr;		/* address of the mapped object's page(s) */
+	enum zs_mapmode vm_mm;
+	/* object mapped by zs_map_object(), decoded once for zs_unmap_object() */
+	unsigned long vm_handle;
+	struct page *vm_pages[2];
+	int vm_off;		/* offset of the object in vm_pages[0] */
+	int vm_size;
 };
 
 struct size_class {
@@ -130,6 +152,7 @@ struct size_class {
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long objs_inuse;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -137,12 +160,17 @@ struct size_class {
 /*
  * Placed within free objects to form a singly linked list.
  * For every zspage, first_page->freelist gives head of this list.
+ * Allocated objects hold their handle here instead.
  *
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of allocated object, tagged with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -150,6 +178,10 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* compaction is triggered by the shrinker or zs_compact() */
+	struct shrinker shrinker;
+	atomic_long_t pages_compacted;
 };
 
 #endif
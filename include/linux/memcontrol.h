@@ -85,6 +85,12 @@ extern struct mem_cgroup *try_get_mem_cgroup_from_page(struct page *page);
 extern struct mem_cgroup *mem_cgroup_from_task(struct task_struct *p);
 extern struct mem_cgroup *try_get_mem_cgroup_from_mm(struct mm_struct *mm);
 
+extern struct mem_cgroup *mem_cgroup_compressed_owner(struct page *page);
+extern void mem_cgroup_compressed_owner_put(struct mem_cgroup *memcg);
+extern int mem_cgroup_charge_compressed(struct mem_cgroup *memcg, size_t size);
+extern void mem_cgroup_uncharge_compressed(struct mem_cgroup *memcg,
+					   size_t size);
+
 extern struct mem_cgroup *parent_mem_cgroup(struct mem_cgroup *memcg);
 extern struct mem_cgroup *mem_cgroup_from_cont(struct cgroup *cont);
 
@@ -284,6 +290,26 @@ static inline struct mem_cgroup *try_get_mem_cgroup_from_mm(struct mm_struct *mm
 	return NULL;
 }
 
+static inline struct mem_cgroup *mem_cgroup_compressed_owner(struct page *page)
+{
+	return NULL;
+}
+
+static inline void mem_cgroup_compressed_owner_put(struct mem_cgroup *memcg)
+{
+}
+
+static inline int mem_cgroup_charge_compressed(struct mem_cgroup *memcg,
+					       size_t size)
+{
+	return 0;
+}
+
+static inline void mem_cgroup_uncharge_compressed(struct mem_cgroup *memcg,
+						  size_t size)
+{
+}
+
 static inline int mm_match_cgroup(struct mm_struct *mm,
 		struct mem_cgroup *memcg)
 {
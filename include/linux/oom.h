@@ -67,6 +67,35 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/*
+ * The Android low memory killer keeps every thread group leader in a bucket
+ * of its oom_score_adj, so that it can pick a victim without walking the
+ * whole task list. These keep the buckets in sync with fork, exec, exit and
+ * writes to oom_score_adj, and let the page allocator tell it that a zone
+ * has dropped below its low watermark.
+ */
+static inline void lowmem_task_init(struct task_struct *p)
+{
+	INIT_HLIST_NODE(&p->lowmem_node);
+}
+
+extern void lowmem_task_add(struct task_struct *p);
+extern void lowmem_task_del(struct task_struct *p);
+extern void lowmem_task_replace(struct task_struct *old,
+				struct task_struct *new);
+extern void lowmem_task_adj_changed(struct task_struct *p);
+extern void lowmem_watermark_low(void);
+#else
+static inline void lowmem_task_init(struct task_struct *p) { }
+static inline void lowmem_task_add(struct task_struct *p) { }
+static inline void lowmem_task_del(struct task_struct *p) { }
+static inline void lowmem_task_replace(struct task_struct *old,
+				       struct task_struct *new) { }
+static inline void lowmem_task_adj_changed(struct task_struct *p) { }
+static inline void lowmem_watermark_low(void) { }
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
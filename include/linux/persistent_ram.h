@@ -19,6 +19,12 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
+
+/* flags for persistent_ram_init_ringbuffer_flags() */
+#define PERSISTENT_RAM_ECC		(1 << 0)
+#define PERSISTENT_RAM_ECC_DEFERRED	(1 << 1)
+#define PERSISTENT_RAM_PERCPU		(1 << 2)
 
 struct persistent_ram_buffer;
 
@@ -54,6 +60,17 @@ struct persistent_ram_zone {
 	int ecc_size;
 	int ecc_symsize;
 	int ecc_poly;
+	int ecc_blocks;
+
+	/* Deferred ECC: blocks, then the header, written since the last flush */
+	unsigned long *ecc_dirty;
+	struct delayed_work ecc_work;
+	int unset_blocks;
+
+	/* Per-CPU rings, carved out of this zone's buffer */
+	struct persistent_ram_zone *sub;
+	struct persistent_ram_zone **cpu_sub;
+	int nr_sub;
 
 	char *old_log;
 	size_t old_log_size;
@@ -65,6 +82,8 @@ int persistent_ram_early_init(struct persistent_ram *ram);
 
 struct persistent_ram_zone *persistent_ram_init_ringbuffer(struct device *dev,
 		bool ecc);
+struct persistent_ram_zone *persistent_ram_init_ringbuffer_flags(
+		struct device *dev, unsigned int flags, size_t record_size);
 
 int persistent_ram_write(struct persistent_ram_zone *prz, const void *s,
 	unsigned int count);
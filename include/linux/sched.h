@@ -1325,6 +1325,10 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_node;	/* oom_score_adj bucket, leaders only */
+	int lowmem_bucket;
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -0,0 +1,76 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/gfp.h>
+#include <linux/types.h>
+#include <linux/cgroup.h>
+
+/*
+ * Memory pressure levels, from how hard reclaim has to work to get pages
+ * back. See Documentation/cgroups/memory.txt.
+ */
+enum vmpressure_levels {
+	VMPRESSURE_LOW = 0,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NUM_LEVELS,
+};
+
+struct vmpressure {
+	/* pages scanned and reclaimed since the last report */
+	unsigned long scanned;
+	unsigned long reclaimed;
+	spinlock_t sr_lock;
+
+	/* eventfds registered through memory.pressure_level */
+	struct list_head events;
+	struct mutex events_lock;
+
+	struct work_struct work;
+};
+
+struct mem_cgroup;
+struct eventfd_ctx;
+struct notifier_block;
+
+extern void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
+		       unsigned long scanned, unsigned long reclaimed);
+extern void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio);
+
+extern void vmpressure_init(struct vmpressure *vmpr);
+extern void vmpressure_cleanup(struct vmpressure *vmpr);
+extern int vmpressure_register_event(struct vmpressure *vmpr,
+				     struct eventfd_ctx *eventfd,
+				     const char *args);
+extern void vmpressure_unregister_event(struct vmpressure *vmpr,
+					struct eventfd_ctx *eventfd);
+
+/*
+ * In-kernel listeners for system-wide pressure, such as the Android low
+ * memory killer. They are called from process context with the level as
+ * the notifier action.
+ */
+extern int register_vmpressure_notifier(struct notifier_block *nb);
+extern int unregister_vmpressure_notifier(struct notifier_block *nb);
+
+/* system-wide pressure, reported in the root memory cgroup */
+extern struct vmpressure global_vmpressure;
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+extern struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg);
+extern struct vmpressure *vmpressure_parent(struct vmpressure *vmpr);
+#else
+static inline struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg)
+{
+	return &global_vmpressure;
+}
+
+static inline struct vmpressure *vmpressure_parent(struct vmpressure *vmpr)
+{
+	return NULL;
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR */
+#endif /* __LINUX_VMPRESSURE_H */
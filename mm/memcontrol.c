@@ -49,6 +49,7 @@
 #include <linux/page_cgroup.h>
 #include <linux/cpu.h>
 #include <linux/oom.h>
+#include <linux/vmpressure.h>
 #include "internal.h"
 #include <net/sock.h>
 #include <net/tcp_memcontrol.h>
@@ -88,6 +89,7 @@ enum mem_cgroup_stat_index {
 	MEM_CGROUP_STAT_RSS,	   /* # of pages charged as anon rss */
 	MEM_CGROUP_STAT_FILE_MAPPED,  /* # of pages charged as file rss */
 	MEM_CGROUP_STAT_SWAPOUT, /* # of pages, swapped out */
+	MEM_CGROUP_STAT_COMPRESSED, /* # of bytes in compressed pools */
 	MEM_CGROUP_STAT_DATA, /* end of data requires synchronization */
 	MEM_CGROUP_STAT_NSTATS,
 };
@@ -251,6 +253,12 @@ struct mem_cgroup {
 		struct work_struct work_freeing;
 	};
 
+	/*
+	 * the counter to account for memory held in compressed pools
+	 * (zram, zcache) on behalf of this cgroup.
+	 */
+	struct res_counter compressed;
+
 	/*
 	 * Per cgroup active and inactive list, similar to the
 	 * per zone LRU lists.
@@ -291,6 +299,9 @@ struct mem_cgroup {
 	/* For oom notifier event fd */
 	struct list_head oom_notify;
 
+	/* reclaim efficiency, for memory.pressure_level */
+	struct vmpressure vmpressure;
+
 	/*
 	 * Should we move charges of a task when a task is moved into this
 	 * mem_cgroup ? And what type of charges should we move ?
@@ -377,6 +388,7 @@ enum charge_type {
 #define _MEM			(0)
 #define _MEMSWAP		(1)
 #define _OOM_TYPE		(2)
+#define _COMPRESSED		(3)
 #define MEMFILE_PRIVATE(x, val)	(((x) << 16) | (val))
 #define MEMFILE_TYPE(val)	(((val) >> 16) & 0xffff)
 #define MEMFILE_ATTR(val)	((val) & 0xffff)
@@ -2482,6 +2494,82 @@ struct mem_cgroup *try_get_mem_cgroup_from_page(struct page *page)
 	return memcg;
 }
 
+/*
+ * Compressed memory accounting.
+ *
+ * zram and zcache keep compressed copies of pages long after the page
+ * itself has been uncharged, so the bytes they hold are charged to a
+ * separate counter of the cgroup that owned the page.  The owner is looked
+ * up without the page lock: zram sees pages that are already under
+ * writeback.  Each charged object pins the mem_cgroup until it is
+ * uncharged, exactly like a swap entry does.
+ */
+struct mem_cgroup *mem_cgroup_compressed_owner(struct page *page)
+{
+	struct mem_cgroup *memcg = NULL;
+	struct page_cgroup *pc;
+	unsigned short id;
+	swp_entry_t ent;
+
+	if (mem_cgroup_disabled())
+		return NULL;
+
+	pc = lookup_page_cgroup(page);
+	lock_page_cgroup(pc);
+	if (PageCgroupUsed(pc)) {
+		memcg = pc->mem_cgroup;
+		if (memcg && !css_tryget(&memcg->css))
+			memcg = NULL;
+	} else if (PageSwapCache(page)) {
+		ent.val = page_private(page);
+		id = lookup_swap_cgroup_id(ent);
+		rcu_read_lock();
+		memcg = mem_cgroup_lookup(id);
+		if (memcg && !css_tryget(&memcg->css))
+			memcg = NULL;
+		rcu_read_unlock();
+	}
+	unlock_page_cgroup(pc);
+	return memcg;
+}
+EXPORT_SYMBOL(mem_cgroup_compressed_owner);
+
+void mem_cgroup_compressed_owner_put(struct mem_cgroup *memcg)
+{
+	if (memcg)
+		css_put(&memcg->css);
+}
+EXPORT_SYMBOL(mem_cgroup_compressed_owner_put);
+
+/*
+ * Charge @size bytes of compressed data to @memcg.  Returns -ENOMEM if
+ * this or a parent cgroup is over its compressed limit; the caller may
+ * free some of @memcg's objects and try again.
+ */
+int mem_cgroup_charge_compressed(struct mem_cgroup *memcg, size_t size)
+{
+	struct res_counter *fail_res;
+
+	if (!memcg)
+		return 0;
+	if (res_counter_charge(&memcg->compressed, size, &fail_res))
+		return -ENOMEM;
+	this_cpu_add(memcg->stat->count[MEM_CGROUP_STAT_COMPRESSED], size);
+	mem_cgroup_get(memcg);
+	return 0;
+}
+EXPORT_SYMBOL(mem_cgroup_charge_compressed);
+
+void mem_cgroup_uncharge_compressed(struct mem_cgroup *memcg, size_t size)
+{
+	if (!memcg)
+		return;
+	res_counter_uncharge(&memcg->compressed, size);
+	this_cpu_sub(memcg->stat->count[MEM_CGROUP_STAT_COMPRESSED], size);
+	mem_cgroup_put(memcg);
+}
+EXPORT_SYMBOL(mem_cgroup_uncharge_compressed);
+
 static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 				       struct page *page,
 				       unsigned int nr_pages,
@@ -3903,6 +3991,9 @@ static u64 mem_cgroup_read(struct cgroup *cont, struct cftype *cft)
 		else
 			val = res_counter_read_u64(&memcg->memsw, name);
 		break;
+	case _COMPRESSED:
+		val = res_counter_read_u64(&memcg->compressed, name);
+		break;
 	default:
 		BUG();
 	}
@@ -3934,8 +4025,10 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 			break;
 		if (type == _MEM)
 			ret = mem_cgroup_resize_limit(memcg, val);
-		else
+		else if (type == _MEMSWAP)
 			ret = mem_cgroup_resize_memsw_limit(memcg, val);
+		else
+			ret = res_counter_set_limit(&memcg->compressed, val);
 		break;
 	case RES_SOFT_LIMIT:
 		ret = res_counter_memparse_write_strategy(buffer, &val);
@@ -3997,14 +4090,18 @@ static int mem_cgroup_reset(struct cgroup *cont, unsigned int event)
 	case RES_MAX_USAGE:
 		if (type == _MEM)
 			res_counter_reset_max(&memcg->res);
-		else
+		else if (type == _MEMSWAP)
 			res_counter_reset_max(&memcg->memsw);
+		else
+			res_counter_reset_max(&memcg->compressed);
 		break;
 	case RES_FAILCNT:
 		if (type == _MEM)
 			res_counter_reset_failcnt(&memcg->res);
-		else
+		else if (type == _MEMSWAP)
 			res_counter_reset_failcnt(&memcg->memsw);
+		else
+			res_counter_reset_failcnt(&memcg->compressed);
 		break;
 	}
 
@@ -4053,6 +4150,7 @@ enum {
 	MCS_PGPGIN,
 	MCS_PGPGOUT,
 	MCS_SWAP,
+	MCS_COMPRESSED,
 	MCS_PGFAULT,
 	MCS_PGMAJFAULT,
 	MCS_INACTIVE_ANON,
@@ -4077,6 +4175,7 @@ struct {
 	{"pgpgin", "total_pgpgin"},
 	{"pgpgout", "total_pgpgout"},
 	{"swap", "total_swap"},
+	{"compressed", "total_compressed"},
 	{"pgfault", "total_pgfault"},
 	{"pgmajfault", "total_pgmajfault"},
 	{"inactive_anon", "total_inactive_anon"},
@@ -4107,6 +4206,8 @@ mem_cgroup_get_local_stat(struct mem_cgroup *memcg, struct mcs_total_stat *s)
 		val = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_SWAPOUT);
 		s->stat[MCS_SWAP] += val * PAGE_SIZE;
 	}
+	val = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_COMPRESSED);
+	s->stat[MCS_COMPRESSED] += val;
 	val = mem_cgroup_read_events(memcg, MEM_CGROUP_EVENTS_PGFAULT);
 	s->stat[MCS_PGFAULT] += val;
 	val = mem_cgroup_read_events(memcg, MEM_CGROUP_EVENTS_PGMAJFAULT);
@@ -4582,6 +4683,47 @@ static void mem_cgroup_oom_unregister_event(struct cgroup *cgrp,
 	spin_unlock(&memcg_oom_lock);
 }
 
+/*
+ * The root cgroup reports system-wide pressure, which is also where global
+ * reclaim, done on behalf of no cgroup in particular, accounts it.
+ */
+struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg)
+{
+	if (!memcg || mem_cgroup_is_root(memcg))
+		return &global_vmpressure;
+	return &memcg->vmpressure;
+}
+
+struct vmpressure *vmpressure_parent(struct vmpressure *vmpr)
+{
+	struct mem_cgroup *memcg;
+
+	if (vmpr == &global_vmpressure)
+		return NULL;
+	memcg = parent_mem_cgroup(container_of(vmpr, struct mem_cgroup,
+					       vmpressure));
+	if (!memcg)
+		return NULL;
+	return memcg_to_vmpressure(memcg);
+}
+
+static int mem_cgroup_pressure_register_event(struct cgroup *cgrp,
+	struct cftype *cft, struct eventfd_ctx *eventfd, const char *args)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	return vmpressure_register_event(memcg_to_vmpressure(memcg), eventfd,
+					 args);
+}
+
+static void mem_cgroup_pressure_unregister_event(struct cgroup *cgrp,
+	struct cftype *cft, struct eventfd_ctx *eventfd)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	vmpressure_unregister_event(memcg_to_vmpressure(memcg), eventfd);
+}
+
 static int mem_cgroup_oom_control_read(struct cgroup *cgrp,
 	struct cftype *cft,  struct cgroup_map_cb *cb)
 {
@@ -4729,6 +4871,34 @@ static struct cftype mem_cgroup_files[] = {
 		.unregister_event = mem_cgroup_oom_unregister_event,
 		.private = MEMFILE_PRIVATE(_OOM_TYPE, OOM_CONTROL),
 	},
+	{
+		.name = "pressure_level",
+		.register_event = mem_cgroup_pressure_register_event,
+		.unregister_event = mem_cgroup_pressure_unregister_event,
+	},
+	{
+		.name = "compressed.usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_COMPRESSED, RES_USAGE),
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "compressed.max_usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_COMPRESSED, RES_MAX_USAGE),
+		.trigger = mem_cgroup_reset,
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "compressed.limit_in_bytes",
+		.private = MEMFILE_PRIVATE(_COMPRESSED, RES_LIMIT),
+		.write_string = mem_cgroup_write,
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "compressed.failcnt",
+		.private = MEMFILE_PRIVATE(_COMPRESSED, RES_FAILCNT),
+		.trigger = mem_cgroup_reset,
+		.read_u64 = mem_cgroup_read,
+	},
 #ifdef CONFIG_NUMA
 	{
 		.name = "numa_stat",
@@ -5011,6 +5181,7 @@ mem_cgroup_create(struct cgroup *cont)
 	if (parent && parent->use_hierarchy) {
 		res_counter_init(&memcg->res, &parent->res);
 		res_counter_init(&memcg->memsw, &parent->memsw);
+		res_counter_init(&memcg->compressed, &parent->compressed);
 		/*
 		 * We increment refcnt of the parent to ensure that we can
 		 * safely access it on res_counter_charge/uncharge.
@@ -5021,9 +5192,11 @@ mem_cgroup_create(struct cgroup *cont)
 	} else {
 		res_counter_init(&memcg->res, NULL);
 		res_counter_init(&memcg->memsw, NULL);
+		res_counter_init(&memcg->compressed, NULL);
 	}
 	memcg->last_scanned_node = MAX_NUMNODES;
 	INIT_LIST_HEAD(&memcg->oom_notify);
+	vmpressure_init(&memcg->vmpressure);
 
 	if (parent)
 		memcg->swappiness = mem_cgroup_swappiness(parent);
@@ -5049,6 +5222,7 @@ static void mem_cgroup_destroy(struct cgroup *cont)
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
 
 	kmem_cgroup_destroy(cont);
+	vmpressure_cleanup(&memcg->vmpressure);
 
 	mem_cgroup_put(memcg);
 }
@@ -0,0 +1,276 @@
+/*
+ * linux/mm/vmpressure.c
+ *
+ * Memory pressure notification, from how efficiently reclaim gets pages
+ * back. Reclaim reports the pages it scanned and reclaimed on behalf of a
+ * memory cgroup (or of the whole system); once a window's worth has been
+ * scanned, the ratio is turned into a low/medium/critical level and sent
+ * to the eventfds registered through the cgroup's memory.pressure_level,
+ * and for system-wide reclaim to in-kernel listeners as well.
+ *
+ * This lets userspace act before the system runs out of memory, without
+ * polling /proc/meminfo.
+ */
+#include <linux/kernel.h>
+#include <linux/export.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/eventfd.h>
+#include <linux/notifier.h>
+#include <linux/vmpressure.h>
+
+/*
+ * Pressure is reported once per window of scanned pages. Smaller windows
+ * react faster but are noisier; 16 reclaim batches is 512 pages (2MB with
+ * 4K pages), which an actively reclaiming system goes through quickly.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/*
+ * Percentage of scanned pages that were not reclaimed at which pressure
+ * is medium or critical. At medium the system is swapping or dropping
+ * caches it may want back; at critical it is about to start killing.
+ */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+/*
+ * Reclaim that has come down to scanning a 2^prio fraction of the LRU
+ * this small is in trouble no matter how efficient it still is.
+ */
+static const unsigned int vmpressure_level_critical_prio = ilog2(100 / 10);
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+struct vmpressure_event {
+	struct eventfd_ctx *efd;
+	enum vmpressure_levels level;
+	struct list_head node;
+};
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+static void vmpressure_work_fn(struct work_struct *work);
+
+struct vmpressure global_vmpressure = {
+	.sr_lock = __SPIN_LOCK_UNLOCKED(global_vmpressure.sr_lock),
+	.events = LIST_HEAD_INIT(global_vmpressure.events),
+	.events_lock = __MUTEX_INITIALIZER(global_vmpressure.events_lock),
+	.work = __WORK_INITIALIZER(global_vmpressure.work, vmpressure_work_fn),
+};
+
+static enum vmpressure_levels vmpressure_level(unsigned long pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static enum vmpressure_levels vmpressure_calc_level(unsigned long scanned,
+						    unsigned long reclaimed)
+{
+	unsigned long pressure;
+
+	/* slab and compound pages can make reclaimed exceed scanned */
+	if (reclaimed >= scanned)
+		return VMPRESSURE_LOW;
+
+	pressure = 100 - reclaimed * 100 / scanned;
+	pr_debug("%s: %3lu  (s: %lu  r: %lu)\n", __func__, pressure,
+		 scanned, reclaimed);
+
+	return vmpressure_level(pressure);
+}
+
+/* Returns true if anybody listening on @vmpr was told about @level. */
+static bool vmpressure_event(struct vmpressure *vmpr,
+			     enum vmpressure_levels level)
+{
+	struct vmpressure_event *ev;
+	bool signalled = false;
+
+	mutex_lock(&vmpr->events_lock);
+	list_for_each_entry(ev, &vmpr->events, node) {
+		if (level >= ev->level) {
+			eventfd_signal(ev->efd, 1);
+			signalled = true;
+		}
+	}
+	mutex_unlock(&vmpr->events_lock);
+
+	return signalled;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	struct vmpressure *vmpr = container_of(work, struct vmpressure, work);
+	enum vmpressure_levels level;
+	unsigned long scanned;
+	unsigned long reclaimed;
+
+	spin_lock(&vmpr->sr_lock);
+	scanned = vmpr->scanned;
+	reclaimed = vmpr->reclaimed;
+	vmpr->scanned = 0;
+	vmpr->reclaimed = 0;
+	spin_unlock(&vmpr->sr_lock);
+
+	/* an earlier run may have picked up what queued this one */
+	if (!scanned)
+		return;
+
+	level = vmpressure_calc_level(scanned, reclaimed);
+	if (vmpr == &global_vmpressure)
+		blocking_notifier_call_chain(&vmpressure_notifier, level, NULL);
+
+	/*
+	 * Pressure in a cgroup is pressure in its ancestors too, but only
+	 * pass it up until some cgroup has a listener for it.
+	 */
+	do {
+		if (vmpressure_event(vmpr, level))
+			break;
+	} while ((vmpr = vmpressure_parent(vmpr)));
+}
+
+/**
+ * vmpressure() - account memory pressure through scanned/reclaimed ratio
+ * @gfp:	reclaimer's gfp mask
+ * @memcg:	cgroup reclaim was done for, or NULL for the whole system
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called from the reclaim paths after every zone they shrink. Does not
+ * sleep; the levels are worked out and sent from a work item once a
+ * window's worth of pages has been scanned.
+ */
+void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
+		unsigned long scanned, unsigned long reclaimed)
+{
+	struct vmpressure *vmpr = memcg_to_vmpressure(memcg);
+
+	/*
+	 * Only report pressure userspace can do something about. Reclaim
+	 * for, say, the DMA zone is not relieved by userspace freeing
+	 * memory, which is mostly highmem and movable. kswapd reclaims
+	 * with GFP_KERNEL, so it is counted.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpr->sr_lock);
+	vmpr->scanned += scanned;
+	vmpr->reclaimed += reclaimed;
+	scanned = vmpr->scanned;
+	spin_unlock(&vmpr->sr_lock);
+
+	if (scanned < vmpressure_win || work_pending(&vmpr->work))
+		return;
+	schedule_work(&vmpr->work);
+}
+
+/**
+ * vmpressure_prio() - account memory pressure through reclaim priority
+ * @gfp:	reclaimer's gfp mask
+ * @memcg:	cgroup reclaim was done for, or NULL for the whole system
+ * @prio:	reclaim priority
+ *
+ * Reports critical pressure once reclaim has had to raise its priority
+ * to vmpressure_level_critical_prio, however many pages it still gets.
+ */
+void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio)
+{
+	if (prio > vmpressure_level_critical_prio)
+		return;
+
+	/* a full window with nothing reclaimed reads as critical */
+	vmpressure(gfp, memcg, vmpressure_win, 0);
+}
+
+/**
+ * vmpressure_register_event() - bind an eventfd to a pressure level
+ * @vmpr:	pressure to watch
+ * @eventfd:	eventfd to signal
+ * @args:	"low", "medium" or "critical"
+ *
+ * The eventfd is signalled whenever pressure is at @args or above.
+ */
+int vmpressure_register_event(struct vmpressure *vmpr,
+			      struct eventfd_ctx *eventfd, const char *args)
+{
+	struct vmpressure_event *ev;
+	int level;
+
+	for (level = 0; level < VMPRESSURE_NUM_LEVELS; level++) {
+		if (!strcmp(vmpressure_str_levels[level], args))
+			break;
+	}
+	if (level >= VMPRESSURE_NUM_LEVELS)
+		return -EINVAL;
+
+	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	if (!ev)
+		return -ENOMEM;
+
+	ev->efd = eventfd;
+	ev->level = level;
+
+	mutex_lock(&vmpr->events_lock);
+	list_add(&ev->node, &vmpr->events);
+	mutex_unlock(&vmpr->events_lock);
+
+	return 0;
+}
+
+void vmpressure_unregister_event(struct vmpressure *vmpr,
+				 struct eventfd_ctx *eventfd)
+{
+	struct vmpressure_event *ev;
+
+	mutex_lock(&vmpr->events_lock);
+	list_for_each_entry(ev, &vmpr->events, node) {
+		if (ev->efd != eventfd)
+			continue;
+		list_del(&ev->node);
+		kfree(ev);
+		break;
+	}
+	mutex_unlock(&vmpr->events_lock);
+}
+
+int register_vmpressure_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(register_vmpressure_notifier);
+
+int unregister_vmpressure_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_vmpressure_notifier);
+
+void vmpressure_init(struct vmpressure *vmpr)
+{
+	spin_lock_init(&vmpr->sr_lock);
+	mutex_init(&vmpr->events_lock);
+	INIT_LIST_HEAD(&vmpr->events);
+	INIT_WORK(&vmpr->work, vmpressure_work_fn);
+}
+
+/* Called before @vmpr is freed, once nobody can report pressure to it. */
+void vmpressure_cleanup(struct vmpressure *vmpr)
+{
+	flush_work(&vmpr->work);
+}
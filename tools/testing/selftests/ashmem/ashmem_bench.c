@@ -0,0 +1,262 @@
+/*
+ * ashmem_bench:
+ *
+ * Measure ASHMEM_PIN/ASHMEM_UNPIN throughput as the number of threads
+ * grows, with and without a thread purging all unpinned memory
+ * back-to-back. Each thread owns a region of its own and unpins and
+ * re-pins random runs of its pages, as a cache would. With per-area
+ * locking the threads should scale, and purging should only slow down
+ * the region it is truncating.
+ *
+ * Every page carries a marker byte. A pin that reports ASHMEM_NOT_PURGED
+ * must find all of its markers intact, or the test fails.
+ *
+ * Usage: ashmem_bench [-t max_threads] [-s seconds] [-p region_pages]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <linux/types.h>
+
+#include "ashmem.h"
+
+#define MAX_THREADS	256
+#define MAX_RUN		16	/* pages unpinned at once, at most */
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	unsigned long ops;
+	unsigned long purged;
+	unsigned long corrupted;
+	int failed;
+};
+
+static int region_pages = 256;
+static int seconds = 3;
+static int ncpus;
+static long page_size;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char marker(int page)
+{
+	return page * 7 % 255 + 1;
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w->cpu + 1;
+	size_t size = (size_t)region_pages * page_size;
+	unsigned char *map;
+	cpu_set_t set;
+	int fd, i;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu % ncpus, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	fd = open("/dev/ashmem", O_RDWR);
+	if (fd < 0 || ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+		perror("ashmem");
+		w->failed = 1;
+		return NULL;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		w->failed = 1;
+		close(fd);
+		return NULL;
+	}
+	for (i = 0; i < region_pages; i++)
+		map[i * page_size] = marker(i);
+
+	while (!stop) {
+		struct ashmem_pin pin;
+		int first = rand_r(&seed) % region_pages;
+		int run = rand_r(&seed) % MAX_RUN + 1;
+		int ret;
+
+		if (first + run > region_pages)
+			run = region_pages - first;
+		pin.offset = first * page_size;
+		pin.len = run * page_size;
+
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0) {
+			perror("ASHMEM_UNPIN");
+			w->failed = 1;
+			break;
+		}
+		ret = ioctl(fd, ASHMEM_PIN, &pin);
+		if (ret < 0) {
+			perror("ASHMEM_PIN");
+			w->failed = 1;
+			break;
+		}
+		w->ops += 2;
+
+		for (i = first; i < first + run; i++) {
+			if (map[i * page_size] == marker(i))
+				continue;
+			if (ret == ASHMEM_NOT_PURGED)
+				w->corrupted++;
+			map[i * page_size] = marker(i);
+		}
+		if (ret == ASHMEM_WAS_PURGED)
+			w->purged++;
+	}
+
+	munmap(map, size);
+	close(fd);
+	return NULL;
+}
+
+static void *reclaimer(void *arg)
+{
+	int fd = *(int *)arg;
+
+	while (!stop)
+		ioctl(fd, ASHMEM_PURGE_ALL_CACHES);
+	return NULL;
+}
+
+/*
+ * Returns the aggregate rate in pin and unpin operations per second, or
+ * -1 if a worker failed.
+ */
+static double run_threads(int threads, int reclaim_fd, unsigned long *purged)
+{
+	struct worker w[MAX_THREADS];
+	pthread_t reclaim;
+	unsigned long ops = 0;
+	double start, elapsed;
+	int i, failed = 0;
+
+	memset(w, 0, sizeof(w));
+	stop = 0;
+	start = now();
+	for (i = 0; i < threads; i++) {
+		w[i].cpu = i;
+		if (pthread_create(&w[i].thread, NULL, worker, &w[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (reclaim_fd >= 0 &&
+	    pthread_create(&reclaim, NULL, reclaimer, &reclaim_fd)) {
+		perror("pthread_create");
+		exit(1);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		ops += w[i].ops;
+		*purged += w[i].purged;
+		if (w[i].corrupted) {
+			fprintf(stderr, "ashmem_bench: %lu pages lost while "
+				"pinned\n", w[i].corrupted);
+			failed = 1;
+		}
+		failed |= w[i].failed;
+	}
+	if (reclaim_fd >= 0)
+		pthread_join(reclaim, NULL);
+	elapsed = now() - start;
+
+	return failed ? -1 : ops / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = 0;
+	int threads, reclaim_fd;
+	int opt;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	page_size = sysconf(_SC_PAGESIZE);
+	while ((opt = getopt(argc, argv, "t:s:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'p':
+			region_pages = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+				"[-s seconds] [-p region_pages]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads <= 0)
+		max_threads = ncpus;
+	if (max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+	if (seconds <= 0)
+		seconds = 1;
+	if (region_pages < MAX_RUN)
+		region_pages = MAX_RUN;
+
+	/* purging needs CAP_SYS_ADMIN */
+	reclaim_fd = open("/dev/ashmem", O_RDWR);
+	if (reclaim_fd < 0) {
+		perror("/dev/ashmem");
+		return 1;
+	}
+	if (ioctl(reclaim_fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+		printf("ASHMEM_PURGE_ALL_CACHES: %s, not purging\n",
+		       strerror(errno));
+		close(reclaim_fd);
+		reclaim_fd = -1;
+	}
+
+	printf("%d cpus, %d page regions, %d s per round\n",
+	       ncpus, region_pages, seconds);
+	for (threads = 1; ; threads *= 2) {
+		unsigned long purged = 0;
+		double idle, busy = 0;
+
+		if (threads > max_threads)
+			threads = max_threads;
+		idle = run_threads(threads, -1, &purged);
+		if (idle >= 0 && reclaim_fd >= 0)
+			busy = run_threads(threads, reclaim_fd, &purged);
+		if (idle < 0 || busy < 0)
+			return 1;
+		printf("%3d threads: %10.0f ops/s, %10.0f ops/s while "
+		       "purging, %lu pins found their pages purged\n",
+		       threads, idle, busy, purged);
+		fflush(stdout);
+		if (threads == max_threads)
+			break;
+	}
+
+	if (reclaim_fd >= 0)
+		close(reclaim_fd);
+	return 0;
+}
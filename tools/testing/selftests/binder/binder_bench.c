@@ -0,0 +1,516 @@
+/*
+ * binder_bench:
+ *
+ * Measure binder transaction throughput as the number of independent
+ * client/server pairs grows. Each pair is a client process and a server
+ * process pinned to CPUs of their own; the client calls its server
+ * back-to-back and the server replies straight away. Pairs share nothing
+ * but the driver, so the aggregate rate should scale with the number of
+ * pairs until the CPUs run out.
+ *
+ * A registry process becomes the context manager so that clients can look
+ * their server up by key. That means the test cannot run while something
+ * else, such as Android's servicemanager, holds that role.
+ *
+ * Usage: binder_bench [-p max_pairs] [-s seconds] [-b payload_bytes]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAIRS	256
+#define MAX_PAYLOAD	4096
+
+enum {
+	REG_ADD = 1,	/* data: key, then the server's binder object */
+	REG_GET,	/* data: key; reply: a handle, or nothing yet */
+	BENCH_CALL,
+};
+
+struct reg_entry {
+	long key;
+	struct flat_binder_object obj;
+} __attribute__((packed));
+
+/* Commands queued for the next ioctl. */
+struct wbuf {
+	char data[256];
+	size_t len;
+};
+
+static int payload = 128;
+static int seconds = 3;
+static int ncpus;
+
+/* Every process in the test is single threaded. */
+static int binder_fd;
+static uint32_t rbuf[256];
+static size_t rpos, rlen;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % ncpus, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+static int binder_open(void)
+{
+	uint32_t cmd = BC_ENTER_LOOPER;
+	struct binder_write_read bwr;
+
+	binder_fd = open("/dev/binder", O_RDWR);
+	if (binder_fd < 0) {
+		perror("/dev/binder");
+		return -1;
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, binder_fd, 0) ==
+	    MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = sizeof(cmd);
+	bwr.write_buffer = (unsigned long)&cmd;
+	return ioctl(binder_fd, BINDER_WRITE_READ, &bwr);
+}
+
+static int binder_write(const void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (unsigned long)data;
+	return ioctl(binder_fd, BINDER_WRITE_READ, &bwr);
+}
+
+/*
+ * Write out len bytes of commands, then read until a transaction or a
+ * reply arrives and return its BR_ code, or -1 on failure. The write and
+ * the first read share one ioctl, like libbinder's talkWithDriver().
+ * Reference count requests on our own node are acknowledged on the way.
+ */
+static int binder_talk(const void *wdata, size_t wlen,
+		       struct binder_transaction_data *tr)
+{
+	for (;;) {
+		struct binder_ptr_cookie pc;
+		uint32_t cmd;
+
+		if (wlen || rpos == rlen) {
+			struct binder_write_read bwr;
+			int ret;
+
+			memset(&bwr, 0, sizeof(bwr));
+			bwr.write_size = wlen;
+			bwr.write_buffer = (unsigned long)wdata;
+			if (rpos == rlen) {
+				bwr.read_size = sizeof(rbuf);
+				bwr.read_buffer = (unsigned long)rbuf;
+			}
+			ret = ioctl(binder_fd, BINDER_WRITE_READ, &bwr);
+			wdata = (const char *)wdata + bwr.write_consumed;
+			wlen -= bwr.write_consumed;
+			if (bwr.read_size) {
+				rpos = 0;
+				rlen = bwr.read_consumed;
+			}
+			if (ret < 0 && errno != EINTR) {
+				perror("BINDER_WRITE_READ");
+				return -1;
+			}
+			continue;
+		}
+
+		memcpy(&cmd, (char *)rbuf + rpos, sizeof(cmd));
+		rpos += sizeof(cmd);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_SPAWN_LOOPER:
+		case BR_TRANSACTION_COMPLETE:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+		case BR_RELEASE:
+		case BR_DECREFS:
+			memcpy(&pc, (char *)rbuf + rpos, sizeof(pc));
+			rpos += sizeof(pc);
+			if (cmd == BR_INCREFS || cmd == BR_ACQUIRE) {
+				struct {
+					uint32_t cmd;
+					struct binder_ptr_cookie pc;
+				} __attribute__((packed)) done;
+
+				done.cmd = cmd == BR_INCREFS ?
+					BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+				done.pc = pc;
+				if (binder_write(&done, sizeof(done)) < 0)
+					return -1;
+			}
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, (char *)rbuf + rpos, sizeof(*tr));
+			rpos += sizeof(*tr);
+			return cmd;
+		default:
+			fprintf(stderr, "binder_bench: %d: unexpected return %#x\n",
+				getpid(), cmd);
+			return -1;
+		}
+	}
+}
+
+static void wb_put(struct wbuf *wb, const void *p, size_t len)
+{
+	memcpy(wb->data + wb->len, p, len);
+	wb->len += len;
+}
+
+static void wb_cmd(struct wbuf *wb, uint32_t cmd, const void *arg,
+		   size_t len)
+{
+	wb_put(wb, &cmd, sizeof(cmd));
+	wb_put(wb, arg, len);
+}
+
+static void wb_free(struct wbuf *wb, const void *buffer)
+{
+	wb_cmd(wb, BC_FREE_BUFFER, &buffer, sizeof(buffer));
+}
+
+static void wb_txn(struct wbuf *wb, uint32_t cmd, uint32_t handle,
+		   uint32_t code, const void *data, size_t size,
+		   const size_t *offs, size_t noffs)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = noffs * sizeof(size_t);
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	wb_cmd(wb, cmd, &tr, sizeof(tr));
+}
+
+/*
+ * The registry holds the context manager role and maps keys to server
+ * handles. Whatever it sends must stay put until the next binder_talk(),
+ * hence the statics.
+ */
+static void registry(int status_fd)
+{
+	static struct reg_entry table[MAX_PAIRS * 8];
+	static struct flat_binder_object reply_obj;
+	static size_t reply_off;
+	static struct wbuf wb;
+	struct binder_transaction_data tr;
+	int n = 0;
+	char ok;
+
+	ok = binder_open() == 0 &&
+		ioctl(binder_fd, BINDER_SET_CONTEXT_MGR, 0) == 0;
+	if (write(status_fd, &ok, 1) != 1 || !ok)
+		exit(1);
+	close(status_fd);
+
+	for (;;) {
+		const struct reg_entry *e;
+		size_t reply_size = 0;
+		int i;
+
+		if (binder_talk(wb.data, wb.len, &tr) != BR_TRANSACTION)
+			exit(1);
+		wb.len = 0;
+		e = (const void *)tr.data.ptr.buffer;
+		if (tr.code == REG_ADD && tr.data_size >= sizeof(*e) &&
+		    tr.offsets_size && n < MAX_PAIRS * 8) {
+			table[n++] = *e;
+			/* keep the reference once the request is freed */
+			wb_cmd(&wb, BC_ACQUIRE, &e->obj.handle, sizeof(uint32_t));
+		} else if (tr.code == REG_GET && tr.data_size >= sizeof(long)) {
+			for (i = 0; i < n; i++) {
+				if (table[i].key == e->key) {
+					reply_obj = table[i].obj;
+					reply_size = sizeof(reply_obj);
+					break;
+				}
+			}
+		}
+		wb_free(&wb, tr.data.ptr.buffer);
+		wb_txn(&wb, BC_REPLY, 0, 0, &reply_obj, reply_size,
+		       &reply_off, reply_size ? 1 : 0);
+	}
+}
+
+static void server(long key, int cpu)
+{
+	static struct reg_entry reg;
+	static size_t reg_off = offsetof(struct reg_entry, obj);
+	static char reply[MAX_PAYLOAD];
+	static struct wbuf wb;
+	struct binder_transaction_data tr;
+
+	pin(cpu);
+	if (binder_open() < 0)
+		exit(1);
+
+	reg.key = key;
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.binder = &reg;
+	reg.obj.cookie = NULL;
+	wb_txn(&wb, BC_TRANSACTION, 0, REG_ADD, &reg, sizeof(reg),
+	       &reg_off, 1);
+	if (binder_talk(wb.data, wb.len, &tr) != BR_REPLY)
+		exit(1);
+	wb.len = 0;
+	wb_free(&wb, tr.data.ptr.buffer);
+
+	for (;;) {
+		if (binder_talk(wb.data, wb.len, &tr) != BR_TRANSACTION)
+			exit(1);
+		wb.len = 0;
+		wb_free(&wb, tr.data.ptr.buffer);
+		wb_txn(&wb, BC_REPLY, 0, 0, reply, payload, NULL, 0);
+	}
+}
+
+/* Returns the server's handle, or 0 if the lookup failed. */
+static uint32_t lookup(long key)
+{
+	struct binder_transaction_data tr;
+	struct flat_binder_object obj;
+	struct wbuf wb;
+	int tries;
+
+	for (tries = 0; tries < 5000; tries++) {
+		wb.len = 0;
+		wb_txn(&wb, BC_TRANSACTION, 0, REG_GET, &key, sizeof(key),
+		       NULL, 0);
+		if (binder_talk(wb.data, wb.len, &tr) != BR_REPLY)
+			return 0;
+		wb.len = 0;
+		if (tr.data_size >= sizeof(obj) && tr.offsets_size) {
+			memcpy(&obj, (const void *)tr.data.ptr.buffer,
+			       sizeof(obj));
+			/* take a reference before the reply is freed */
+			wb_cmd(&wb, BC_ACQUIRE, &obj.handle, sizeof(uint32_t));
+			wb_free(&wb, tr.data.ptr.buffer);
+			if (binder_write(wb.data, wb.len) < 0)
+				return 0;
+			return obj.handle;
+		}
+		wb_free(&wb, tr.data.ptr.buffer);
+		if (binder_write(wb.data, wb.len) < 0)
+			return 0;
+		usleep(1000);
+	}
+	fprintf(stderr, "binder_bench: server %ld never registered\n", key);
+	return 0;
+}
+
+static void client(long key, int cpu, int ready_fd, int start_fd,
+		   int result_fd)
+{
+	static char request[MAX_PAYLOAD];
+	struct binder_transaction_data tr;
+	const void *prev = NULL;
+	struct wbuf wb;
+	long calls = -1;
+	uint32_t handle;
+	double end;
+	char c = 0;
+
+	pin(cpu);
+	handle = binder_open() == 0 ? lookup(key) : 0;
+	if (write(ready_fd, &c, 1) != 1)
+		exit(1);
+	if (read(start_fd, &c, 1) < 0)
+		exit(1);
+
+	if (handle) {
+		calls = 0;
+		end = now() + seconds;
+		while (now() < end) {
+			wb.len = 0;
+			if (prev)
+				wb_free(&wb, prev);
+			wb_txn(&wb, BC_TRANSACTION, handle, BENCH_CALL,
+			       request, payload, NULL, 0);
+			if (binder_talk(wb.data, wb.len, &tr) != BR_REPLY) {
+				calls = -1;
+				break;
+			}
+			prev = tr.data.ptr.buffer;
+			calls++;
+		}
+	}
+	if (write(result_fd, &calls, sizeof(calls)) != sizeof(calls))
+		exit(1);
+	exit(calls < 0);
+}
+
+/* Run one round with the given number of pairs; returns calls per second. */
+static double run_pairs(int pairs, int round)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	int ready[2], start[2], result[2];
+	double total = 0;
+	int i, failed = 0;
+	char c;
+
+	if (pipe(ready) || pipe(start) || pipe(result)) {
+		perror("pipe");
+		exit(1);
+	}
+	for (i = 0; i < pairs; i++) {
+		long key = (long)round * MAX_PAIRS + i;
+
+		servers[i] = fork();
+		if (servers[i] == 0)
+			server(key, 2 * i + 1);
+		clients[i] = fork();
+		if (clients[i] == 0) {
+			close(start[1]);
+			client(key, 2 * i, ready[1], start[0], result[1]);
+		}
+	}
+	close(start[0]);
+	for (i = 0; i < pairs; i++)
+		if (read(ready[0], &c, 1) != 1)
+			failed = 1;
+	/* closing the start pipe releases all clients at once */
+	close(start[1]);
+
+	for (i = 0; i < pairs; i++) {
+		long calls;
+
+		if (read(result[0], &calls, sizeof(calls)) != sizeof(calls) ||
+		    calls < 0)
+			failed = 1;
+		else
+			total += calls;
+	}
+	for (i = 0; i < pairs; i++) {
+		waitpid(clients[i], NULL, 0);
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(result[0]);
+	close(result[1]);
+	if (failed) {
+		fprintf(stderr, "binder_bench: %d pairs: a client failed\n",
+			pairs);
+		exit(1);
+	}
+	return total / seconds;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_pairs = 0;
+	int status[2];
+	pid_t reg;
+	double base = 0;
+	int pairs, round = 0;
+	char ok = 0;
+	int opt;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "p:s:b:")) != -1) {
+		switch (opt) {
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			payload = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p max_pairs] [-s seconds]"
+				" [-b payload_bytes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_pairs <= 0)
+		max_pairs = ncpus / 2 > 0 ? ncpus / 2 : 1;
+	if (max_pairs > MAX_PAIRS)
+		max_pairs = MAX_PAIRS;
+	if (seconds <= 0)
+		seconds = 1;
+	if (payload < 0 || payload > MAX_PAYLOAD)
+		payload = MAX_PAYLOAD;
+
+	if (pipe(status)) {
+		perror("pipe");
+		return 1;
+	}
+	reg = fork();
+	if (reg == 0) {
+		close(status[0]);
+		registry(status[1]);
+	}
+	close(status[1]);
+	if (read(status[0], &ok, 1) != 1 || !ok) {
+		fprintf(stderr, "binder_bench: could not become the context "
+			"manager\n");
+		waitpid(reg, NULL, 0);
+		return 1;
+	}
+
+	printf("%d cpus, %d byte payload, %d s per round\n",
+	       ncpus, payload, seconds);
+	for (pairs = 1; ; pairs *= 2) {
+		double rate;
+
+		if (pairs > max_pairs)
+			pairs = max_pairs;
+		rate = run_pairs(pairs, round++);
+		if (pairs == 1)
+			base = rate;
+		printf("%3d pairs: %10.0f calls/s, %9.0f per pair, "
+		       "scaling %.2f\n", pairs, rate, rate / pairs,
+		       base ? rate / base : 0);
+		fflush(stdout);
+		if (pairs == max_pairs)
+			break;
+	}
+
+	kill(reg, SIGKILL);
+	waitpid(reg, NULL, 0);
+	return 0;
+}
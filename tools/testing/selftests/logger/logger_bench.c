@@ -0,0 +1,354 @@
+/*
+ * logger_bench:
+ *
+ * Measure logger write throughput as the number of writing threads grows.
+ * Each thread is pinned to a CPU of its own and writes entries shaped like
+ * liblog's (priority, tag, message) back-to-back for a few seconds. With
+ * per-CPU staging of writes the aggregate rate should scale with the
+ * number of threads instead of flattening out on the log's mutex.
+ *
+ * A last round has every thread hop to the next CPU after each write, so
+ * that consecutive writes of a thread are staged on different CPUs, often
+ * within the same tick.
+ *
+ * Afterwards the log is mapped read-only and walked from its oldest entry
+ * to the newest, to check that every entry is well formed and to count
+ * how many are out of timestamp order. Each message starts with its
+ * round and its count within the writing thread, and any entry that
+ * comes before an earlier write of the same thread fails the test.
+ *
+ * Usage: logger_bench [-t max_threads] [-s seconds] [-b payload_bytes] log
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define MAX_THREADS	256
+#define MAX_SEEN	4096
+#define MIN_PAYLOAD	32	/* room for the round and count */
+#define TAG		"logger_bench"
+
+struct writer {
+	pthread_t thread;
+	int cpu;
+	int migrate;
+	unsigned long writes;
+	unsigned long failures;
+};
+
+/* the last write seen of each thread while walking the log */
+struct seen {
+	int tid;
+	int round;
+	unsigned long count;
+};
+
+static const char *log_path;
+static int payload = 100;
+static int seconds = 3;
+static int ncpus;
+static int round;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg)
+{
+	struct writer *w = arg;
+	char prio = 4;	/* ANDROID_LOG_INFO */
+	char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	struct iovec iov[3];
+	cpu_set_t set;
+	int fd;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu % ncpus, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	fd = open(log_path, O_WRONLY);
+	if (fd < 0) {
+		perror(log_path);
+		w->failures++;
+		return NULL;
+	}
+	memset(msg, 'x', payload);
+	msg[payload - 1] = '\0';
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = TAG;
+	iov[1].iov_len = sizeof(TAG);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = payload;
+
+	while (!stop) {
+		int n = snprintf(msg, payload, "%d %lu ", round, w->writes);
+
+		msg[n] = 'x';
+		if (writev(fd, iov, 3) < 0) {
+			w->failures++;
+			continue;
+		}
+		w->writes++;
+		if (w->migrate) {
+			CPU_ZERO(&set);
+			CPU_SET((w->cpu + w->writes) % ncpus, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Returns the aggregate rate in writes per second. */
+static double run_threads(int threads, int migrate, unsigned long *failures)
+{
+	struct writer w[MAX_THREADS];
+	unsigned long writes = 0;
+	double start, elapsed;
+	int i;
+
+	memset(w, 0, sizeof(w));
+	stop = 0;
+	start = now();
+	for (i = 0; i < threads; i++) {
+		w[i].cpu = i;
+		w[i].migrate = migrate;
+		if (pthread_create(&w[i].thread, NULL, writer, &w[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		writes += w[i].writes;
+		*failures += w[i].failures;
+	}
+	elapsed = now() - start;
+	round++;
+
+	return writes / elapsed;
+}
+
+static void read_status(volatile struct logger_mmap_status *status,
+			uint64_t *w_pos, uint64_t *head_pos)
+{
+	uint32_t seq;
+
+	do {
+		seq = status->seq;
+		__sync_synchronize();
+		*w_pos = status->w_pos;
+		*head_pos = status->head_pos;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != status->seq);
+}
+
+static void copy_out(const unsigned char *buf, uint32_t size, uint64_t pos,
+		     void *dst, size_t len)
+{
+	size_t off = pos & (size - 1);
+	size_t first = len < size - off ? len : size - off;
+
+	memcpy(dst, buf + off, first);
+	memcpy((char *)dst + first, buf, len - first);
+}
+
+/*
+ * Checks an entry against the previous write of its thread, if it is one
+ * of ours. Returns -1 if it was written before that one.
+ */
+static int check_order(const struct logger_entry *entry, const char *payload,
+		       struct seen *seen, int *nr_seen)
+{
+	const char *msg = payload + 1 + sizeof(TAG);
+	unsigned long count;
+	int r, i;
+
+	if (entry->len < 1 + sizeof(TAG) + MIN_PAYLOAD ||
+	    memcmp(payload + 1, TAG, sizeof(TAG)) ||
+	    sscanf(msg, "%d %lu", &r, &count) != 2)
+		return 0;
+	for (i = 0; i < *nr_seen; i++)
+		if (seen[i].tid == entry->tid)
+			break;
+	if (i == *nr_seen) {
+		if (*nr_seen == MAX_SEEN)
+			return 0;
+		(*nr_seen)++;
+	} else if (r < seen[i].round ||
+		   (r == seen[i].round && count <= seen[i].count)) {
+		fprintf(stderr, "logger_bench: tid %d write %d/%lu logged "
+			"after %d/%lu\n", entry->tid, r, count,
+			seen[i].round, seen[i].count);
+		return -1;
+	}
+	seen[i].tid = entry->tid;
+	seen[i].round = r;
+	seen[i].count = count;
+	return 0;
+}
+
+/*
+ * Walk the mapped log. Returns -1 if an entry is malformed or a thread's
+ * writes are out of order, without the writers having lapped the walk.
+ */
+static int check_mapping(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	volatile struct logger_mmap_status *status;
+	const unsigned char *buf;
+	static struct seen seen[MAX_SEEN];
+	char payload[LOGGER_ENTRY_MAX_PAYLOAD];
+	uint64_t pos, w_pos, head_pos, last = 0;
+	unsigned long entries = 0, inversions = 0;
+	size_t map_len;
+	int fd, size, nr_seen = 0, ret = 0;
+
+	fd = open(log_path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(log_path);
+		return -1;
+	}
+	size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	map_len = page + size;
+	status = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (status == MAP_FAILED) {
+		/* only readers that may see every entry can map the log */
+		printf("mmap: %s, not checking the log\n", strerror(errno));
+		close(fd);
+		return errno == EPERM ? 0 : -1;
+	}
+	buf = (const unsigned char *)status + page;
+
+	/* any ioctl merges the staged entries into the log */
+	ioctl(fd, LOGGER_GET_LOG_LEN);
+	read_status(status, &w_pos, &head_pos);
+	for (pos = head_pos; pos < w_pos; ) {
+		struct logger_entry entry;
+		uint64_t check, ts;
+
+		copy_out(buf, size, pos, &entry, sizeof(entry));
+		if (entry.len <= LOGGER_ENTRY_MAX_PAYLOAD)
+			copy_out(buf, size, pos + sizeof(entry), payload,
+				 entry.len);
+		read_status(status, &check, &head_pos);
+		if (check > pos + size)
+			break;	/* lapped, the entry may be torn */
+		if (entry.hdr_size != sizeof(entry) ||
+		    entry.len > LOGGER_ENTRY_MAX_PAYLOAD) {
+			fprintf(stderr, "logger_bench: bad entry at %llu\n",
+				(unsigned long long)pos);
+			ret = -1;
+			break;
+		}
+		if (check_order(&entry, payload, seen, &nr_seen)) {
+			ret = -1;
+			break;
+		}
+		ts = (uint64_t)entry.sec * 1000000000 + entry.nsec;
+		if (ts < last)
+			inversions++;
+		last = ts;
+		entries++;
+		pos += sizeof(entry) + entry.len;
+	}
+	printf("mmap: %lu entries, %lu out of timestamp order\n",
+	       entries, inversions);
+
+	munmap((void *)status, map_len);
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = 0;
+	unsigned long failures = 0;
+	double base = 0;
+	int threads;
+	int opt;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "t:s:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			payload = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	log_path = argv[optind];
+	if (max_threads <= 0)
+		max_threads = ncpus;
+	if (max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+	if (seconds <= 0)
+		seconds = 1;
+	if (payload < MIN_PAYLOAD)
+		payload = MIN_PAYLOAD;
+	if (payload > LOGGER_ENTRY_MAX_PAYLOAD - 1 - (int)sizeof(TAG))
+		payload = LOGGER_ENTRY_MAX_PAYLOAD - 1 - sizeof(TAG);
+
+	printf("%d cpus, %d byte messages, %d s per round\n",
+	       ncpus, payload, seconds);
+	for (threads = 1; ; threads *= 2) {
+		double rate;
+
+		if (threads > max_threads)
+			threads = max_threads;
+		rate = run_threads(threads, 0, &failures);
+		if (threads == 1)
+			base = rate;
+		printf("%3d threads: %10.0f writes/s, %9.0f per thread, "
+		       "scaling %.2f\n", threads, rate, rate / threads,
+		       base ? rate / base : 0);
+		fflush(stdout);
+		if (threads == max_threads)
+			break;
+	}
+	printf("%3d threads: %10.0f writes/s, hopping CPUs after each write\n",
+	       max_threads, run_threads(max_threads, 1, &failures));
+	if (failures) {
+		fprintf(stderr, "logger_bench: %lu writes failed\n", failures);
+		return 1;
+	}
+
+	return check_mapping() ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-t max_threads] [-s seconds]"
+		" [-b payload_bytes] log\n", argv[0]);
+	return 1;
+}
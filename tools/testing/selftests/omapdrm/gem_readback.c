@@ -0,0 +1,314 @@
+/*
+ * gem_readback:
+ *
+ * Measure how fast the CPU reads back omapdrm buffers, as a software
+ * renderer does with frames the GPU or a video decoder produced. Every
+ * round brackets the read with DRM_OMAP_GEM_CPU_PREP/CPU_FINI, the way
+ * such a renderer has to, and the buffer is read as:
+ *
+ *	wc		write-combined
+ *	cached		cached, kept coherent by page faults
+ *	cpu_sync	cached with OMAP_BO_CPU_SYNC, whole buffer prepped
+ *	cpu_sync/8	the same, but each round preps and reads a band of
+ *			an eighth of the buffer, passed down as a region
+ *
+ * Nothing but the CPU touches the buffers in between rounds, so the
+ * cached numbers are the best case for a buffer kept coherent by page
+ * faults, which refaults every page it reads after each DMA.
+ *
+ * Before measuring, the regions interface is checked: data written
+ * through a region prep/fini must read back, a region past the end of
+ * the buffer must be refused with EINVAL, and the cpu_prep struct of
+ * userspace that predates regions must still be accepted.
+ *
+ * Usage: gem_readback [-m megabytes] [-r rounds] [device]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "omap_drm.h"
+
+#define MAX_CARDS	4
+
+struct mode {
+	const char *name;
+	uint32_t flags;
+	int bands;		/* read 1/bands of the buffer per round */
+};
+
+static const struct mode modes[] = {
+	{ "wc", OMAP_BO_WC, 1 },
+	{ "cached", OMAP_BO_CACHED, 1 },
+	{ "cpu_sync", OMAP_BO_CACHED | OMAP_BO_CPU_SYNC, 1 },
+	{ "cpu_sync/8", OMAP_BO_CACHED | OMAP_BO_CPU_SYNC, 8 },
+};
+
+/* cpu_prep as it was before regions were added */
+struct old_cpu_prep {
+	uint32_t handle;
+	uint32_t op;
+};
+
+#define OLD_IOCTL_OMAP_GEM_CPU_PREP \
+	DRM_IOW(DRM_COMMAND_BASE + DRM_OMAP_GEM_CPU_PREP, struct old_cpu_prep)
+
+struct bo {
+	uint32_t handle;
+	uint32_t size;
+	uint32_t *map;
+};
+
+static int fd;
+static volatile uint32_t sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int try_open(const char *dev)
+{
+	char name[32];
+	struct drm_version v;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0)
+		return -1;
+	memset(&v, 0, sizeof(v));
+	memset(name, 0, sizeof(name));
+	v.name = name;
+	v.name_len = sizeof(name) - 1;
+	if (!ioctl(fd, DRM_IOCTL_VERSION, &v) && !strcmp(name, "omapdrm"))
+		return 0;
+	close(fd);
+	return -1;
+}
+
+static int open_omapdrm(const char *path)
+{
+	char dev[32];
+	int i;
+
+	if (path && !try_open(path))
+		return 0;
+	for (i = 0; !path && i < MAX_CARDS; i++) {
+		snprintf(dev, sizeof(dev), "/dev/dri/card%d", i);
+		if (!try_open(dev))
+			return 0;
+	}
+	fprintf(stderr, "gem_readback: no omapdrm device found\n");
+	return -1;
+}
+
+static int bo_new(struct bo *bo, uint32_t size, uint32_t flags)
+{
+	struct drm_omap_gem_new req = {
+		.size.bytes = size,
+		.flags = flags,
+	};
+	struct drm_omap_gem_info info;
+
+	if (ioctl(fd, DRM_IOCTL_OMAP_GEM_NEW, &req)) {
+		perror("DRM_IOCTL_OMAP_GEM_NEW");
+		return -1;
+	}
+	memset(&info, 0, sizeof(info));
+	info.handle = req.handle;
+	if (ioctl(fd, DRM_IOCTL_OMAP_GEM_INFO, &info)) {
+		perror("DRM_IOCTL_OMAP_GEM_INFO");
+		return -1;
+	}
+	bo->handle = req.handle;
+	bo->size = size;
+	bo->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		       info.offset);
+	if (bo->map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	return 0;
+}
+
+static void bo_del(struct bo *bo)
+{
+	struct drm_gem_close req = { .handle = bo->handle };
+
+	munmap(bo->map, bo->size);
+	ioctl(fd, DRM_IOCTL_GEM_CLOSE, &req);
+}
+
+/* prep or fini a single region, or the whole buffer if size is zero */
+static int cpu_op(unsigned long cmd, struct bo *bo, uint32_t op,
+		  uint32_t offset, uint32_t size)
+{
+	struct drm_omap_gem_region region = { offset, size };
+	struct drm_omap_gem_cpu_fini req = {
+		.handle = bo->handle,
+		.op = op,
+		.nregions = size ? 1 : 0,
+		.regions = (uintptr_t)&region,
+	};
+
+	/* both structs have the same layout */
+	return ioctl(fd, cmd, &req);
+}
+
+static int cpu_prep(struct bo *bo, uint32_t op, uint32_t offset,
+		    uint32_t size)
+{
+	return cpu_op(DRM_IOCTL_OMAP_GEM_CPU_PREP, bo, op, offset, size);
+}
+
+static int cpu_fini(struct bo *bo, uint32_t op, uint32_t offset,
+		    uint32_t size)
+{
+	return cpu_op(DRM_IOCTL_OMAP_GEM_CPU_FINI, bo, op, offset, size);
+}
+
+static int check_regions(uint32_t size)
+{
+	struct old_cpu_prep old;
+	struct bo bo;
+	uint32_t band = size / 8, i, *p;
+	int ret = -1;
+
+	if (bo_new(&bo, size, OMAP_BO_CACHED | OMAP_BO_CPU_SYNC))
+		return -1;
+
+	/* write the last band only, read everything back */
+	if (cpu_prep(&bo, OMAP_GEM_WRITE, size - band, band))
+		goto out_errno;
+	p = bo.map + (size - band) / 4;
+	for (i = 0; i < band / 4; i++)
+		p[i] = i ^ 0x5a5a5a5a;
+	if (cpu_fini(&bo, OMAP_GEM_WRITE, size - band, band) ||
+	    cpu_prep(&bo, OMAP_GEM_READ, 0, 0))
+		goto out_errno;
+	for (i = 0; i < band / 4; i++) {
+		if (p[i] != (i ^ 0x5a5a5a5a)) {
+			fprintf(stderr, "gem_readback: word %u of the band "
+				"reads %08x\n", i, p[i]);
+			goto out;
+		}
+	}
+	if (cpu_fini(&bo, OMAP_GEM_READ, 0, 0))
+		goto out_errno;
+
+	if (!cpu_prep(&bo, OMAP_GEM_READ, size - band, band + 4096) ||
+	    errno != EINVAL) {
+		fprintf(stderr, "gem_readback: region past the end of the "
+			"buffer was not refused\n");
+		goto out;
+	}
+
+	old.handle = bo.handle;
+	old.op = OMAP_GEM_READ;
+	if (ioctl(fd, OLD_IOCTL_OMAP_GEM_CPU_PREP, &old))
+		goto out_errno;
+	ret = 0;
+	goto out;
+
+out_errno:
+	perror("gem_readback: cpu_prep/cpu_fini");
+out:
+	bo_del(&bo);
+	return ret;
+}
+
+/* returns the readback rate in MB/s, or -1 on error */
+static double readback(const struct mode *m, uint32_t size, int rounds)
+{
+	uint32_t band = size / m->bands;
+	struct bo bo;
+	double start, elapsed;
+	int r;
+
+	if (bo_new(&bo, size, m->flags))
+		return -1;
+
+	/* fault everything in first, that is not what is measured */
+	cpu_prep(&bo, OMAP_GEM_WRITE, 0, 0);
+	memset(bo.map, 0xa5, size);
+	cpu_fini(&bo, OMAP_GEM_WRITE, 0, 0);
+
+	start = now();
+	for (r = 0; r < rounds; r++) {
+		uint32_t offset = (r % m->bands) * band;
+		uint32_t *p = bo.map + offset / 4;
+		uint32_t i, sum = 0;
+
+		if (cpu_prep(&bo, OMAP_GEM_READ, offset,
+			     m->bands > 1 ? band : 0)) {
+			perror("cpu_prep");
+			bo_del(&bo);
+			return -1;
+		}
+		for (i = 0; i < band / 4; i++)
+			sum += p[i];
+		sink = sum;
+		cpu_fini(&bo, OMAP_GEM_READ, offset, m->bands > 1 ? band : 0);
+	}
+	elapsed = now() - start;
+
+	bo_del(&bo);
+	return (double)band * rounds / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	int megabytes = 8, rounds = 50;
+	uint32_t size;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "m:r:")) != -1) {
+		switch (opt) {
+		case 'm':
+			megabytes = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m megabytes] [-r rounds] "
+				"[device]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (megabytes <= 0)
+		megabytes = 1;
+	if (rounds <= 0)
+		rounds = 1;
+	size = megabytes << 20;
+
+	if (open_omapdrm(optind < argc ? argv[optind] : NULL))
+		return 1;
+
+	if (check_regions(size))
+		return 1;
+
+	printf("%d MB buffers, %d rounds\n", megabytes, rounds);
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		double rate = readback(&modes[i], size, rounds);
+
+		if (rate < 0)
+			return 1;
+		printf("%-12s %8.1f MB/s\n", modes[i].name, rate);
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,10 @@
+/*
+ * omap_drm.h includes <drm/drm.h>.  Take it from the tree rather than
+ * from whatever the system has installed, but leave <linux/types.h> and
+ * friends to the system so kernel-only headers stay out of the build.
+ */
+#ifndef __user
+#define __user
+#endif
+
+#include "../../../../../../include/drm/drm.h"
@@ -0,0 +1,125 @@
+/*
+ * trace_overhead:
+ *
+ * Measure the cost of a cheap system call, getppid(), with one thread per
+ * CPU calling it back-to-back. Run it once per tracer (nop, function,
+ * persistent) to see what every traced function call costs, and whether
+ * it stays flat as threads are added.
+ *
+ * Usage: trace_overhead [-t max_threads] [-s seconds]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define MAX_THREADS	256
+
+struct caller {
+	pthread_t thread;
+	int cpu;
+	unsigned long calls;
+};
+
+static int seconds = 2;
+static int ncpus;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *caller(void *arg)
+{
+	struct caller *c = arg;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(c->cpu % ncpus, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	while (!stop) {
+		syscall(SYS_getppid);
+		c->calls++;
+	}
+	return NULL;
+}
+
+/* Returns the average time of one call, in nanoseconds. */
+static double run_threads(int threads)
+{
+	struct caller c[MAX_THREADS];
+	unsigned long calls = 0;
+	double start, elapsed;
+	int i;
+
+	memset(c, 0, sizeof(c));
+	stop = 0;
+	start = now();
+	for (i = 0; i < threads; i++) {
+		c[i].cpu = i;
+		if (pthread_create(&c[i].thread, NULL, caller, &c[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < threads; i++) {
+		pthread_join(c[i].thread, NULL);
+		calls += c[i].calls;
+	}
+	elapsed = now() - start;
+
+	return calls ? elapsed * threads * 1e9 / calls : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int max_threads = 0;
+	int threads;
+	int opt;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] "
+				"[-s seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads <= 0)
+		max_threads = ncpus;
+	if (max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+	if (seconds <= 0)
+		seconds = 1;
+
+	for (threads = 1; ; threads *= 2) {
+		if (threads > max_threads)
+			threads = max_threads;
+		printf("%3d threads: %8.0f ns per getppid()\n", threads,
+		       run_threads(threads));
+		fflush(stdout);
+		if (threads == max_threads)
+			break;
+	}
+	return 0;
+}
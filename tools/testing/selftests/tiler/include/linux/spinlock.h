@@ -0,0 +1 @@
+#include "tcm_shim.h"
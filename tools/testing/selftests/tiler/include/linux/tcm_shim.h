@@ -0,0 +1,126 @@
+/*
+ * Just enough of the kernel API to build the tiler container managers in
+ * drivers/staging/omapdrm as userspace code. There is no locking, the
+ * benchmark is single threaded.
+ */
+#ifndef _TCM_SHIM_H
+#define _TCM_SHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int16_t s16;
+typedef int32_t s32;
+
+#define GFP_KERNEL		0
+#define kmalloc(size, gfp)	malloc(size)
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kfree(p)		free(p)
+
+typedef int spinlock_t;
+#define spin_lock_init(l)	(*(l) = 0)
+#define spin_lock(l)		((void)(l))
+#define spin_unlock(l)		((void)(l))
+
+#define WARN_ON(cond) ({						\
+	int __ret = !!(cond);						\
+	if (__ret)							\
+		fprintf(stderr, "WARN_ON(%s) at %s:%d\n", #cond,	\
+			__FILE__, __LINE__);				\
+	__ret;								\
+})
+#define BUG_ON(cond)		do { if (cond) abort(); } while (0)
+
+#define ALIGN(x, a)		(((x) + ((typeof(x))(a) - 1)) & \
+				 ~((typeof(x))(a) - 1))
+
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_LONG))
+#define BITMAP_LAST_WORD_MASK(nbits) \
+	(((nbits) % BITS_PER_LONG) ? (1UL << ((nbits) % BITS_PER_LONG)) - 1 : ~0UL)
+
+/* word at a time, like lib/find_next_bit.c */
+static inline unsigned long _find_next(const unsigned long *addr,
+				       unsigned long size, unsigned long offset,
+				       unsigned long invert)
+{
+	unsigned long tmp;
+
+	if (offset >= size)
+		return size;
+	tmp = (addr[offset / BITS_PER_LONG] ^ invert) &
+	      BITMAP_FIRST_WORD_MASK(offset);
+	offset -= offset % BITS_PER_LONG;
+	while (!tmp) {
+		offset += BITS_PER_LONG;
+		if (offset >= size)
+			return size;
+		tmp = addr[offset / BITS_PER_LONG] ^ invert;
+	}
+	offset += __builtin_ctzl(tmp);
+	return offset < size ? offset : size;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr,
+					  unsigned long size,
+					  unsigned long offset)
+{
+	return _find_next(addr, size, offset, 0UL);
+}
+
+static inline unsigned long find_next_zero_bit(const unsigned long *addr,
+					       unsigned long size,
+					       unsigned long offset)
+{
+	return _find_next(addr, size, offset, ~0UL);
+}
+
+static inline void bitmap_set(unsigned long *map, unsigned long start,
+			      unsigned long nr)
+{
+	unsigned long *p = map + start / BITS_PER_LONG;
+	unsigned long mask = BITMAP_FIRST_WORD_MASK(start);
+	long bits = BITS_PER_LONG - start % BITS_PER_LONG;
+	long left = nr;
+
+	while (left - bits >= 0) {
+		*p++ |= mask;
+		left -= bits;
+		bits = BITS_PER_LONG;
+		mask = ~0UL;
+	}
+	if (left) {
+		mask &= BITMAP_LAST_WORD_MASK(start + nr);
+		*p |= mask;
+	}
+}
+
+static inline void bitmap_clear(unsigned long *map, unsigned long start,
+				unsigned long nr)
+{
+	unsigned long *p = map + start / BITS_PER_LONG;
+	unsigned long mask = BITMAP_FIRST_WORD_MASK(start);
+	long bits = BITS_PER_LONG - start % BITS_PER_LONG;
+	long left = nr;
+
+	while (left - bits >= 0) {
+		*p++ &= ~mask;
+		left -= bits;
+		bits = BITS_PER_LONG;
+		mask = ~0UL;
+	}
+	if (left) {
+		mask &= BITMAP_LAST_WORD_MASK(start + nr);
+		*p &= ~mask;
+	}
+}
+
+#endif /* _TCM_SHIM_H */
@@ -0,0 +1,367 @@
+/*
+ * tcm_bench:
+ *
+ * Replay a trace of tiler container reservations and frees against the
+ * SiTA and the row bitmap container managers from drivers/staging/omapdrm,
+ * built as userspace code, and compare the time they spend per call and
+ * how many reservations they fail to place.
+ *
+ * Every area handed out is checked against the slots already in use and
+ * against the container bounds, so a manager that overlaps two areas or
+ * hands out slots it doesn't have fails the run.
+ *
+ * A trace has one operation per line, '#' starts a comment:
+ *
+ *	2d <id> <width> <height> <align>	reserve a 2D area, in slots
+ *	1d <id> <slots>				reserve a 1D area
+ *	free <id>				free an area
+ *
+ * Without a trace file a synthetic one is generated, a churn of display,
+ * camera and video buffers with some 1D buffers mixed in. -g writes that
+ * trace to stdout instead of replaying it.
+ *
+ * Usage: tcm_bench [-r rounds] [-n ops] [-s seed] [-g] [trace]
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "linux/tcm_shim.h"
+#include "tcm.h"
+
+/* OMAP4 container, in slots */
+#define WIDTH		256
+#define HEIGHT		128
+#define MAX_IDS		4096
+
+enum op_type { OP_2D, OP_1D, OP_FREE };
+
+struct op {
+	enum op_type type;
+	int id;
+	u16 w, h, align;
+	u32 slots;
+};
+
+struct manager {
+	const char *name;
+	struct tcm *(*init)(u16 width, u16 height, struct tcm_pt *attr);
+};
+
+static const struct manager managers[] = {
+	{ "sita", sita_init },
+	{ "bitmap", bitmap_init },
+};
+
+struct result {
+	double reserve_ns;
+	double free_ns;
+	double max_ns;
+	unsigned long reserves;
+	unsigned long frees;
+	unsigned long failed;
+};
+
+static struct op *ops;
+static int nr_ops;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void add_op(struct op *op)
+{
+	static int max_ops;
+
+	if (nr_ops == max_ops) {
+		max_ops = max_ops ? max_ops * 2 : 1024;
+		ops = realloc(ops, max_ops * sizeof(*ops));
+		if (!ops) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ops[nr_ops++] = *op;
+}
+
+static int load_trace(const char *path)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+	int n = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		struct op op = { 0 };
+		unsigned int a, b, c, d;
+
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "2d %u %u %u %u", &a, &b, &c, &d) == 4) {
+			op.type = OP_2D;
+			op.w = b;
+			op.h = c;
+			op.align = d;
+		} else if (sscanf(line, "1d %u %u", &a, &b) == 2) {
+			op.type = OP_1D;
+			op.slots = b;
+		} else if (sscanf(line, "free %u", &a) == 1) {
+			op.type = OP_FREE;
+		} else {
+			fprintf(stderr, "%s:%d: bad operation\n", path, n);
+			fclose(f);
+			return -1;
+		}
+		if (a >= MAX_IDS) {
+			fprintf(stderr, "%s:%d: id %u too large\n", path, n, a);
+			fclose(f);
+			return -1;
+		}
+		op.id = a;
+		add_op(&op);
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Buffer shapes in slots: NV12 planes of 1080p, 720p and VGA frames
+ * (32 and 64 slot aligned), 32bpp framebuffers and overlays (1 aligned),
+ * and small thumbnails.
+ */
+static const struct { u16 w, h, align; } shapes[] = {
+	{ 30, 17, 64 }, { 30, 9, 64 },
+	{ 20, 12, 32 }, { 20, 6, 32 },
+	{ 10, 8, 32 }, { 10, 4, 32 },
+	{ 120, 17, 1 }, { 64, 12, 1 },
+	{ 4, 3, 1 }, { 2, 2, 1 },
+};
+
+static void generate_trace(int count, unsigned int seed)
+{
+	int live[MAX_IDS], nr_live = 0, next_id = 0;
+	int i;
+
+	srand(seed);
+	for (i = 0; i < count; i++) {
+		struct op op = { 0 };
+		int r = rand() % 100;
+
+		/* keep between a few and a few dozen buffers around */
+		if (nr_live > 8 && (r < 45 || nr_live >= 48)) {
+			int k = rand() % nr_live;
+
+			op.type = OP_FREE;
+			op.id = live[k];
+			live[k] = live[--nr_live];
+		} else {
+			op.id = next_id;
+			next_id = (next_id + 1) % MAX_IDS;
+			if (r % 8 == 0) {
+				op.type = OP_1D;
+				op.slots = 64 + rand() % 2048;
+			} else {
+				int s = rand() % (sizeof(shapes) /
+						  sizeof(shapes[0]));
+
+				op.type = OP_2D;
+				op.w = shapes[s].w;
+				op.h = shapes[s].h;
+				op.align = shapes[s].align;
+			}
+			live[nr_live++] = op.id;
+		}
+		add_op(&op);
+	}
+}
+
+static void print_trace(void)
+{
+	int i;
+
+	for (i = 0; i < nr_ops; i++) {
+		struct op *op = &ops[i];
+
+		if (op->type == OP_2D)
+			printf("2d %d %u %u %u\n", op->id, op->w, op->h,
+			       op->align);
+		else if (op->type == OP_1D)
+			printf("1d %d %u\n", op->id, op->slots);
+		else
+			printf("free %d\n", op->id);
+	}
+}
+
+/* mark the slots of an area with owner, after checking they were free */
+static int claim(struct tcm_area *a, short *owner, short id)
+{
+	int x, y, i, start, end;
+
+	if (!tcm_area_is_valid(a)) {
+		fprintf(stderr, "invalid area (%u,%u)-(%u,%u)\n",
+			a->p0.x, a->p0.y, a->p1.x, a->p1.y);
+		return -1;
+	}
+	if (a->is2d) {
+		for (y = a->p0.y; y <= a->p1.y; y++)
+			for (x = a->p0.x; x <= a->p1.x; x++) {
+				i = y * WIDTH + x;
+				if (id >= 0 && owner[i] >= 0)
+					goto overlap;
+				owner[i] = id;
+			}
+	} else {
+		start = a->p0.y * WIDTH + a->p0.x;
+		end = a->p1.y * WIDTH + a->p1.x;
+		for (i = start; i <= end; i++) {
+			if (id >= 0 && owner[i] >= 0)
+				goto overlap;
+			owner[i] = id;
+		}
+	}
+	return 0;
+
+overlap:
+	fprintf(stderr, "area %d overlaps area %d at slot (%d,%d)\n",
+		id, owner[i], i % WIDTH, i / WIDTH);
+	return -1;
+}
+
+static int replay(const struct manager *m, struct result *res)
+{
+	static struct tcm_area areas[MAX_IDS];
+	static bool used[MAX_IDS];
+	static short owner[WIDTH * HEIGHT];
+	struct tcm *tcm = m->init(WIDTH, HEIGHT, NULL);
+	double t, dt;
+	int i, ret = 0;
+
+	if (!tcm) {
+		fprintf(stderr, "%s: init failed\n", m->name);
+		return -1;
+	}
+	memset(used, 0, sizeof(used));
+	memset(owner, 0xff, sizeof(owner));
+
+	for (i = 0; i < nr_ops; i++) {
+		struct op *op = &ops[i];
+		struct tcm_area *a = &areas[op->id];
+		s32 err;
+
+		if (op->type == OP_FREE) {
+			if (!used[op->id])
+				continue;	/* its reservation failed */
+			claim(a, owner, -1);
+			t = now_ns();
+			tcm_free(a);
+			dt = now_ns() - t;
+			res->free_ns += dt;
+			res->frees++;
+			used[op->id] = false;
+			continue;
+		}
+		if (used[op->id]) {
+			fprintf(stderr, "op %d: id %d is in use\n", i, op->id);
+			ret = -1;
+			break;
+		}
+
+		t = now_ns();
+		if (op->type == OP_2D)
+			err = tcm_reserve_2d(tcm, op->w, op->h, op->align, a);
+		else
+			err = tcm_reserve_1d(tcm, op->slots, a);
+		dt = now_ns() - t;
+		res->reserve_ns += dt;
+		if (dt > res->max_ns)
+			res->max_ns = dt;
+		res->reserves++;
+		if (err) {
+			res->failed++;
+			continue;
+		}
+		if (claim(a, owner, op->id)) {
+			fprintf(stderr, "%s: op %d: bad reservation\n",
+				m->name, i);
+			ret = -1;
+			break;
+		}
+		used[op->id] = true;
+	}
+
+	for (i = 0; i < MAX_IDS; i++)
+		if (used[i])
+			tcm_free(&areas[i]);
+	tcm_deinit(tcm);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = 5, count = 100000, generate = 0;
+	unsigned int seed = 1;
+	int opt, i, r;
+
+	while ((opt = getopt(argc, argv, "r:n:s:g")) != -1) {
+		switch (opt) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'g':
+			generate = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r rounds] [-n ops] "
+				"[-s seed] [-g] [trace]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rounds <= 0)
+		rounds = 1;
+
+	if (optind < argc) {
+		if (load_trace(argv[optind]))
+			return 1;
+	} else {
+		generate_trace(count, seed);
+	}
+	if (generate) {
+		print_trace();
+		return 0;
+	}
+
+	printf("%d operations, %dx%d slot container, %d rounds\n",
+	       nr_ops, WIDTH, HEIGHT, rounds);
+	for (i = 0; i < sizeof(managers) / sizeof(managers[0]); i++) {
+		struct result res = { 0 };
+
+		for (r = 0; r < rounds; r++)
+			if (replay(&managers[i], &res))
+				return 1;
+		printf("%-8s reserve %8.0f ns avg %10.0f ns max, "
+		       "free %6.0f ns avg, %5.2f%% failed\n",
+		       managers[i].name, res.reserve_ns / res.reserves,
+		       res.max_ns, res.frees ? res.free_ns / res.frees : 0,
+		       100.0 * res.failed / res.reserves);
+	}
+	return 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * zram_stress:
+ *
+ * Hammer random slots of a zram device from all CPUs at once and report
+ * the aggregate throughput. Each thread owns the slots congruent to its
+ * id modulo the thread count: it writes only those, verifying each write
+ * by reading it back, and reads any slot, checking that what comes back
+ * is a complete, self-consistent page written for that slot.
+ *
+ * Pages are a mix of compressible, same-filled and incompressible data
+ * so that all of zram's storage paths are exercised concurrently.
+ *
+ * Usage: zram_stress [-t threads] [-s seconds] [-r read%] <device>
+ * The device must have been given a disksize (see run_zramtests).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define PAGE_SZ		4096
+#define WORDS		(PAGE_SZ / sizeof(uint64_t))
+#define MAGIC		0x7a72616d73747273ULL	/* "zramstrs" */
+#define SAME_BIT	(1ULL << 63)
+
+enum { KIND_TEXT, KIND_SAME, KIND_RANDOM, NR_KINDS };
+
+struct worker {
+	pthread_t thread;
+	int id;
+	uint64_t rng;
+	uint64_t *seq;		/* last sequence written, per owned slot */
+	unsigned long reads, writes, errors;
+};
+
+static int fd;
+static int nr_threads;
+static int read_pct = 70;
+static uint64_t nr_slots;
+static volatile int stop;
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static uint64_t page_seed(uint64_t slot, uint64_t seq)
+{
+	return (slot * 0x9e3779b97f4a7c15ULL) ^ (seq + 1);
+}
+
+static void fill_page(uint64_t *p, uint64_t slot, uint64_t seq)
+{
+	uint64_t state, i;
+	int kind = seq % NR_KINDS;
+
+	if (kind == KIND_SAME) {
+		uint64_t w = SAME_BIT | (slot << 20) | (seq & 0xfffff);
+
+		for (i = 0; i < WORDS; i++)
+			p[i] = w;
+		return;
+	}
+
+	p[0] = MAGIC;
+	p[1] = slot;
+	p[2] = seq;
+	state = page_seed(slot, seq);
+	for (i = 3; i < WORDS; i++) {
+		if (kind == KIND_RANDOM)
+			p[i] = xorshift(&state);
+		else
+			p[i] = slot + (i & 7);	/* compresses well */
+	}
+}
+
+/* Same-filled pages only have room for the low bits of the sequence */
+static uint64_t stored_seq(uint64_t seq)
+{
+	return seq % NR_KINDS == KIND_SAME ? seq & 0xfffff : seq;
+}
+
+/*
+ * Return the sequence number of a valid page for @slot, or -1 if the
+ * page is corrupt or belongs to another slot. Unwritten slots read back
+ * as zeroes and are reported as sequence 0 with *@unwritten set.
+ */
+static int64_t check_page(uint64_t *p, uint64_t slot, int *unwritten)
+{
+	uint64_t expect[WORDS];
+	uint64_t i, seq;
+
+	*unwritten = 0;
+	if (p[0] & SAME_BIT) {
+		for (i = 1; i < WORDS; i++)
+			if (p[i] != p[0])
+				return -1;
+		if (((p[0] & ~SAME_BIT) >> 20) != slot)
+			return -1;
+		return p[0] & 0xfffff;
+	}
+
+	if (p[0] != MAGIC) {
+		for (i = 0; i < WORDS; i++)
+			if (p[i])
+				return -1;
+		*unwritten = 1;
+		return 0;
+	}
+
+	if (p[1] != slot)
+		return -1;
+	seq = p[2];
+	fill_page(expect, slot, seq);
+	if (memcmp(expect, p, PAGE_SZ))
+		return -1;
+
+	return seq;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t *buf, slot, seq;
+	int64_t got;
+	int unwritten;
+	off_t off;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->errors++;
+		return NULL;
+	}
+
+	while (!stop) {
+		slot = xorshift(&w->rng) % nr_slots;
+		off = (off_t)slot * PAGE_SZ;
+
+		if ((int)(slot % nr_threads) == w->id &&
+		    (int)(xorshift(&w->rng) % 100) >= read_pct) {
+			seq = ++w->seq[slot / nr_threads];
+			fill_page(buf, slot, seq);
+			if (pwrite(fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+				perror("pwrite");
+				w->errors++;
+				break;
+			}
+			w->writes++;
+
+			/* We are the only writer: must read back exactly */
+			if (pread(fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+				perror("pread");
+				w->errors++;
+				break;
+			}
+			w->reads++;
+			got = check_page(buf, slot, &unwritten);
+			if (got < 0 || unwritten ||
+			    (uint64_t)got != stored_seq(seq)) {
+				fprintf(stderr, "slot %llu: wrote seq %llu, read back %lld\n",
+					(unsigned long long)slot,
+					(unsigned long long)seq, (long long)got);
+				w->errors++;
+			}
+		} else {
+			if (pread(fd, buf, PAGE_SZ, off) != PAGE_SZ) {
+				perror("pread");
+				w->errors++;
+				break;
+			}
+			w->reads++;
+			if (check_page(buf, slot, &unwritten) < 0) {
+				fprintf(stderr, "slot %llu: torn or foreign page\n",
+					(unsigned long long)slot);
+				w->errors++;
+			}
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-s seconds] [-r read%%] <device>\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	struct timespec start, end;
+	unsigned long reads = 0, writes = 0, errors = 0;
+	uint64_t size;
+	double secs;
+	int opt, i, duration = 10;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "t:s:r:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			duration = atoi(optarg);
+			break;
+		case 'r':
+			read_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nr_threads < 1 || read_pct < 0 ||
+	    read_pct > 100)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) || size < PAGE_SZ) {
+		fprintf(stderr, "%s: no disksize set?\n", argv[optind]);
+		return 1;
+	}
+	nr_slots = size / PAGE_SZ;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].rng = 0x2545f4914f6cdd1dULL * (i + 1);
+		workers[i].seq = calloc(nr_slots / nr_threads + 1,
+					sizeof(uint64_t));
+		if (!workers[i].seq ||
+		    pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			fprintf(stderr, "cannot start worker %d\n", i);
+			return 1;
+		}
+	}
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		reads += workers[i].reads;
+		writes += workers[i].writes;
+		errors += workers[i].errors;
+		free(workers[i].seq);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%d threads, %llu slots, %.1fs: %lu reads, %lu writes, "
+	       "%.0f ops/s, %lu errors\n", nr_threads,
+	       (unsigned long long)nr_slots, secs, reads, writes,
+	       (reads + writes) / secs, errors);
+
+	close(fd);
+	free(workers);
+	return errors ? 1 : 0;
+}